@@ -0,0 +1,584 @@
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+
+#include <render_queue.h>
+#include <frustum_culler.h>
+#include <scene_bvh.h>
+#include <occlusion_culler.h>
+#include <normal_matrix.h>
+#include <instance_buffer.h>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <vector>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+using namespace std;
+
+// CPU benchmarks of engine subsystems, run with --bench instead of opening a window.
+
+// sorts a frame of random draws the way the render queue does and counts the state changes left between
+// consecutive draws, in submission order and sorted
+inline void BenchmarkRenderQueue(unsigned int draws = 100000, unsigned int frames = 20)
+{
+    const unsigned int shaders = 16, materials = 512, meshes = 4096;
+    std::mt19937 random(1234);
+    struct Draw { uint32_t shader, material, mesh; float depth; };
+    vector<Draw> scene(draws);
+    for (unsigned int i = 0; i < draws; i++)
+    {
+        // a material always uses the same program, a mesh the same material, like real content
+        scene[i].mesh = random() % meshes;
+        scene[i].material = scene[i].mesh % materials;
+        scene[i].shader = scene[i].material % shaders;
+        scene[i].depth = (random() % 100000) / 100000.0f;
+    }
+
+    auto changes = [&](const vector<SortItem> &order, unsigned int &programs, unsigned int &materialChanges, unsigned int &vaos) {
+        programs = materialChanges = vaos = 0;
+        for (unsigned int i = 0; i < order.size(); i++)
+        {
+            const Draw &draw = scene[order[i].index];
+            const Draw *previous = i > 0 ? &scene[order[i - 1].index] : nullptr;
+            programs += !previous || previous->shader != draw.shader;
+            materialChanges += !previous || previous->material != draw.material;
+            vaos += !previous || previous->mesh != draw.mesh;
+        }
+    };
+
+    vector<SortItem> items(draws), scratch;
+    unsigned int programs, materialChanges, vaos;
+    for (unsigned int i = 0; i < draws; i++)
+        items[i] = { MakeSortKey(PASS_OPAQUE, scene[i].shader, scene[i].material, scene[i].mesh, scene[i].depth), i };
+    changes(items, programs, materialChanges, vaos);
+    std::cout << "Render queue, " << draws << " draws unsorted: " << programs << " program, " << materialChanges << " material, "
+              << vaos << " vertex array changes" << std::endl;
+
+    double radix = 0.0, standard = 0.0;
+    vector<SortItem> sorted;
+    for (unsigned int frame = 0; frame < frames; frame++)
+    {
+        // keys are rebuilt every frame since depths change
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < draws; i++)
+            items[i] = { MakeSortKey(PASS_OPAQUE, scene[i].shader, scene[i].material, scene[i].mesh, scene[i].depth), i };
+        sorted = items;
+        RadixSort(sorted, scratch);
+        radix += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        start = std::chrono::steady_clock::now();
+        vector<SortItem> reference = items;
+        std::sort(reference.begin(), reference.end(), [](const SortItem &a, const SortItem &b) { return a.key < b.key; });
+        standard += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        for (unsigned int i = 0; i < draws; i++)
+            if (reference[i].key != sorted[i].key)
+            {
+                std::cout << "ERROR::BENCHMARK::RADIX_SORT_MISMATCH at " << i << std::endl;
+                return;
+            }
+    }
+    changes(sorted, programs, materialChanges, vaos);
+    std::cout << "Render queue, " << draws << " draws sorted: " << programs << " program, " << materialChanges << " material, "
+              << vaos << " vertex array changes" << std::endl;
+    std::cout << "Render queue: keys + radix sort " << radix / frames << " ms per frame, std::sort " << standard / frames << " ms" << std::endl;
+}
+
+// culls a scene of random boxes around the camera with the batched FrustumCuller, and one box at a time
+// with Frustum::Intersects, which it has to agree with
+inline void BenchmarkFrustumCulling(unsigned int boxes = 1000000, unsigned int frames = 20)
+{
+    std::mt19937 random(4321);
+    std::uniform_real_distribution<float> position(-100.0f, 100.0f), size(0.1f, 4.0f);
+    vector<Bounds> scene(boxes);
+    for (unsigned int i = 0; i < boxes; i++)
+    {
+        glm::vec3 center(position(random), position(random), position(random));
+        glm::vec3 extent(size(random), size(random), size(random));
+        scene[i].min = center - extent;
+        scene[i].max = center + extent;
+    }
+
+    FrustumCuller culler;
+    vector<uint8_t> reference(boxes);
+    double batched = 0.0, kernel = 0.0, single = 0.0;
+    unsigned int visible = 0;
+    for (unsigned int frame = 0; frame < frames; frame++)
+    {
+        // turn a little every frame
+        glm::vec3 direction(std::sin(frame * 0.3f), 0.0f, -std::cos(frame * 0.3f));
+        glm::mat4 viewProjection = glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, 100.0f)
+                                 * glm::lookAt(glm::vec3(0.0f), direction, glm::vec3(0.0f, 1.0f, 0.0f));
+        Frustum frustum(viewProjection);
+
+        auto start = std::chrono::steady_clock::now();
+        culler.Clear();
+        for (unsigned int i = 0; i < boxes; i++)
+            culler.Add(scene[i]);
+        visible = culler.Cull(frustum);
+        batched += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        kernel += culler.GetStats().milliseconds;
+
+        start = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < boxes; i++)
+            reference[i] = frustum.Intersects(scene[i]);
+        single += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        for (unsigned int i = 0; i < boxes; i++)
+            if (culler.Visible(i) != (reference[i] != 0))
+            {
+                std::cout << "ERROR::BENCHMARK::FRUSTUM_CULLING_MISMATCH at " << i << std::endl;
+                return;
+            }
+    }
+#if defined(FRUSTUM_CULLER_AVX)
+    const char *kernelName = "AVX";
+#elif defined(FRUSTUM_CULLER_SSE)
+    const char *kernelName = "SSE";
+#else
+    const char *kernelName = "scalar";
+#endif
+    std::cout << "Frustum culling, " << boxes << " boxes: " << visible << " visible in the last frame" << std::endl;
+    std::cout << "Frustum culling: batched (" << kernelName << ", " << GetJobSystem().WorkerCount() << " workers) " << kernel / frames
+              << " ms per frame, " << batched / frames << " ms with filling the arrays; one box at a time " << single / frames << " ms" << std::endl;
+}
+
+// builds a SceneBVH over a level of random objects, moves a tenth of them every frame and refits, then
+// culls and queries it; every query is checked against testing all objects
+inline void BenchmarkSceneBVH(unsigned int objects = 500000, unsigned int frames = 20, unsigned int queries = 10000)
+{
+    auto milliseconds = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    std::mt19937 random(2468);
+    std::uniform_real_distribution<float> position(-1000.0f, 1000.0f), size(0.5f, 5.0f), step(-1.0f, 1.0f);
+    vector<Bounds> scene(objects);
+    for (unsigned int i = 0; i < objects; i++)
+    {
+        glm::vec3 center(position(random), position(random) * 0.1f, position(random));
+        glm::vec3 extent(size(random), size(random), size(random));
+        scene[i].min = center - extent;
+        scene[i].max = center + extent;
+    }
+
+    SceneBVH bvh;
+    auto start = std::chrono::steady_clock::now();
+    bvh.Build(scene);
+    double build = milliseconds(start);
+
+    // the last tenth of the objects are dynamic
+    double refit = 0.0;
+    for (unsigned int frame = 0; frame < frames; frame++)
+    {
+        for (unsigned int i = objects - objects / 10; i < objects; i++)
+        {
+            glm::vec3 delta(step(random), 0.0f, step(random));
+            scene[i].min += delta;
+            scene[i].max += delta;
+        }
+        start = std::chrono::steady_clock::now();
+        for (unsigned int i = objects - objects / 10; i < objects; i++)
+            bvh.Update(i, scene[i]);
+        bvh.Refit();
+        refit += milliseconds(start);
+    }
+
+    // frustum culling, against the batched linear culler
+    FrustumCuller culler;
+    vector<unsigned int> visible, reference;
+    double hierarchical = 0.0, linear = 0.0;
+    for (unsigned int frame = 0; frame < frames; frame++)
+    {
+        glm::vec3 direction(std::sin(frame * 0.3f), 0.0f, -std::cos(frame * 0.3f));
+        Frustum frustum(glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, 500.0f)
+                        * glm::lookAt(glm::vec3(0.0f), direction, glm::vec3(0.0f, 1.0f, 0.0f)));
+        start = std::chrono::steady_clock::now();
+        bvh.Cull(frustum, visible);
+        hierarchical += milliseconds(start);
+
+        start = std::chrono::steady_clock::now();
+        culler.Clear();
+        for (unsigned int i = 0; i < objects; i++)
+            culler.Add(scene[i]);
+        culler.Cull(frustum);
+        linear += milliseconds(start);
+        reference.clear();
+        for (unsigned int i = 0; i < objects; i++)
+            if (culler.Visible(i))
+                reference.push_back(i);
+        std::sort(visible.begin(), visible.end());
+        if (visible != reference)
+        {
+            std::cout << "ERROR::BENCHMARK::BVH_CULL_MISMATCH " << visible.size() << " visible, " << reference.size() << " expected" << std::endl;
+            return;
+        }
+    }
+
+    // range and nearest queries around random points
+    vector<glm::vec3> points(queries);
+    for (unsigned int i = 0; i < queries; i++)
+        points[i] = glm::vec3(position(random), position(random) * 0.1f, position(random));
+    const float range = 25.0f;
+    unsigned int found = 0;
+    vector<unsigned int> results;
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < queries; i++)
+    {
+        bvh.QueryRange(points[i], range, results);
+        found += (unsigned int)results.size();
+    }
+    double rangeQueries = milliseconds(start);
+    vector<int> nearest(queries);
+    start = std::chrono::steady_clock::now();
+    for (unsigned int i = 0; i < queries; i++)
+        nearest[i] = bvh.Nearest(points[i]);
+    double nearestQueries = milliseconds(start);
+
+    auto distanceSquared = [&](const glm::vec3 &point, unsigned int object) {
+        glm::vec3 delta = glm::max(glm::max(scene[object].min - point, point - scene[object].max), glm::vec3(0.0f));
+        return glm::dot(delta, delta);
+    };
+    for (unsigned int i = 0; i < std::min(queries, 50u); i++)
+    {
+        unsigned int inRange = 0;
+        float best = FLT_MAX;
+        for (unsigned int object = 0; object < objects; object++)
+        {
+            float distance = distanceSquared(points[i], object);
+            inRange += distance <= range * range;
+            best = std::min(best, distance);
+        }
+        bvh.QueryRange(points[i], range, results);
+        if (results.size() != inRange || nearest[i] < 0 || distanceSquared(points[i], nearest[i]) != best)
+        {
+            std::cout << "ERROR::BENCHMARK::BVH_QUERY_MISMATCH at query " << i << std::endl;
+            return;
+        }
+    }
+
+    std::cout << "Scene BVH, " << objects << " objects: built in " << build << " ms (" << bvh.NodeCount() << " nodes), "
+              << objects / 10 << " moved and refit in " << refit / frames << " ms per frame" << std::endl;
+    std::cout << "Scene BVH: frustum culling " << hierarchical / frames << " ms per frame (" << visible.size() << " visible), linear batched "
+              << linear / frames << " ms" << std::endl;
+    std::cout << "Scene BVH: " << queries << " range queries (" << range << ", " << (double)found / queries << " found on average) in "
+              << rangeQueries << " ms, " << queries << " nearest queries in " << nearestQueries << " ms" << std::endl;
+}
+
+// a city block grid seen from street level: the buildings are occluders, small props on the streets and
+// roofs are tested after frustum culling. Checks a wall hides what's behind and inside it first.
+inline void BenchmarkOcclusionCulling(unsigned int props = 100000, unsigned int frames = 20)
+{
+    auto milliseconds = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    auto box = [](const glm::vec3 &min, const glm::vec3 &max) {
+        Bounds bounds;
+        bounds.Extend(min);
+        bounds.Extend(max);
+        return bounds;
+    };
+    // corner i is at (i & 1, i & 2, i & 4) of the box, faces counter clockwise from outside
+    auto boxOccluder = [](const Bounds &bounds) {
+        OccluderMesh occluder;
+        for (unsigned int i = 0; i < 8; i++)
+            occluder.vertices.push_back(glm::vec3(i & 1 ? bounds.max.x : bounds.min.x, i & 2 ? bounds.max.y : bounds.min.y, i & 4 ? bounds.max.z : bounds.min.z));
+        occluder.indices = { 0, 2, 1, 1, 2, 3,  4, 5, 6, 5, 7, 6,  0, 1, 4, 1, 5, 4,  2, 6, 3, 3, 6, 7,  0, 4, 2, 2, 4, 6,  1, 3, 5, 3, 7, 5 };
+        return occluder;
+    };
+    glm::mat4 projection = glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, 500.0f);
+
+    OcclusionCuller culler;
+    culler.Begin(projection * glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f)));
+    culler.AddOccluder(boxOccluder(box(glm::vec3(-5.0f, -5.0f, -11.0f), glm::vec3(5.0f, 5.0f, -10.0f))), glm::mat4(1.0f));
+    culler.Rasterize();
+    if (culler.Visible(box(glm::vec3(-1.0f, -1.0f, -21.0f), glm::vec3(1.0f, 1.0f, -19.0f)))   // behind
+        || culler.Visible(box(glm::vec3(-0.1f, -0.1f, -10.6f), glm::vec3(0.1f, 0.1f, -10.4f))) // inside
+        || !culler.Visible(box(glm::vec3(-1.0f, -1.0f, -6.0f), glm::vec3(1.0f, 1.0f, -4.0f)))  // in front
+        || !culler.Visible(box(glm::vec3(9.0f, -1.0f, -21.0f), glm::vec3(11.0f, 1.0f, -19.0f))) // behind, peeking past the edge
+        || !culler.Visible(box(glm::vec3(-1.0f, -1.0f, -11.0f), glm::vec3(1.0f, 1.0f, 1.0f)))) // around the camera
+    {
+        std::cout << "ERROR::BENCHMARK::OCCLUSION_WRONG_RESULT" << std::endl;
+        return;
+    }
+
+    // 20 x 20 blocks of 8 x 8 buildings, 4 wide streets between them
+    std::mt19937 random(1357);
+    std::uniform_real_distribution<float> height(5.0f, 30.0f), unit(0.0f, 1.0f), size(0.2f, 1.0f);
+    const unsigned int blocks = 20;
+    const float spacing = 12.0f, extent = blocks * spacing * 0.5f;
+    vector<Bounds> buildings;
+    vector<OccluderMesh> occluders;
+    for (unsigned int z = 0; z < blocks; z++)
+        for (unsigned int x = 0; x < blocks; x++)
+        {
+            glm::vec3 min(x * spacing - extent + 2.0f, 0.0f, z * spacing - extent + 2.0f);
+            buildings.push_back(box(min, min + glm::vec3(8.0f, height(random), 8.0f)));
+            occluders.push_back(boxOccluder(buildings.back()));
+        }
+    vector<Bounds> scene(props);
+    for (unsigned int i = 0; i < props; i++)
+    {
+        glm::vec3 corner;
+        if (i % 4 == 0)
+        {
+            // on a roof
+            const Bounds &building = buildings[random() % buildings.size()];
+            corner = glm::vec3(building.min.x + unit(random) * 7.0f, building.max.y, building.min.z + unit(random) * 7.0f);
+        }
+        else if (i % 2 == 0)
+            corner = glm::vec3(unit(random) * 2.0f * extent - extent, 0.0f, (random() % blocks) * spacing - extent + unit(random) * 1.0f);
+        else
+            corner = glm::vec3((random() % blocks) * spacing - extent + unit(random) * 1.0f, 0.0f, unit(random) * 2.0f * extent - extent);
+        scene[i] = box(corner, corner + glm::vec3(size(random), size(random), size(random)));
+    }
+
+    // walking down a street, looking around
+    FrustumCuller frustumCuller;
+    unsigned int inFrustum = 0, occluded = 0, triangles = 0;
+    double rasterize = 0.0, test = 0.0;
+    for (unsigned int frame = 0; frame < frames; frame++)
+    {
+        glm::vec3 eye(-extent + 1.0f + frame * 5.0f, 1.7f, 1.0f);
+        glm::vec3 direction(std::cos(frame * 0.7f), 0.0f, std::sin(frame * 0.7f));
+        glm::mat4 viewProjection = projection * glm::lookAt(eye, eye + direction, glm::vec3(0.0f, 1.0f, 0.0f));
+        frustumCuller.Clear();
+        for (unsigned int i = 0; i < props; i++)
+            frustumCuller.Add(scene[i]);
+        frustumCuller.Cull(Frustum(viewProjection));
+
+        culler.Begin(viewProjection);
+        for (unsigned int i = 0; i < occluders.size(); i++)
+            culler.AddOccluder(occluders[i], glm::mat4(1.0f));
+        culler.Rasterize();
+        rasterize += culler.GetStats().milliseconds;
+        triangles += culler.GetStats().triangles;
+
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < props; i++)
+            if (frustumCuller.Visible(i))
+            {
+                inFrustum++;
+                occluded += !culler.Visible(scene[i]);
+            }
+        test += milliseconds(start);
+    }
+
+    std::cout << "Occlusion culling, " << occluders.size() << " box occluders and " << props << " props: " << 100.0 * occluded / std::max(inFrustum, 1u)
+              << "% of " << inFrustum / frames << " props in the frustum occluded per frame" << std::endl;
+    std::cout << "Occlusion culling: " << triangles / frames << " triangles rasterized at " << OCCLUSION_WIDTH << "x" << OCCLUSION_HEIGHT << " in "
+              << rasterize / frames << " ms, tested in " << test / frames << " ms per frame" << std::endl;
+}
+
+// simplifies a torus into an occluder and tests boxes behind it from a few directions against the simplified
+// and the source mesh: the simplified one may hide less, but never a box the source mesh leaves visible, like
+// one seen through the hole
+inline void BenchmarkOccluderSimplification(unsigned int maxTriangles = OCCLUDER_TRIANGLES)
+{
+    auto box = [](const glm::vec3 &min, const glm::vec3 &max) {
+        Bounds bounds;
+        bounds.Extend(min);
+        bounds.Extend(max);
+        return bounds;
+    };
+    // 96 x 48 quads, 9216 triangles, counter clockwise from outside
+    const unsigned int rings = 96, sides = 48;
+    const float radius = 1.0f, tube = 0.35f;
+    vector<Vertex> vertices;
+    vector<unsigned int> indices;
+    for (unsigned int i = 0; i < rings; i++)
+        for (unsigned int j = 0; j < sides; j++)
+        {
+            float u = 6.2831853f * i / rings, v = 6.2831853f * j / sides;
+            Vertex vertex = {};
+            vertex.Normal = glm::vec3(std::cos(v) * std::cos(u), std::sin(v), std::cos(v) * std::sin(u));
+            vertex.Position = glm::vec3(radius * std::cos(u), 0.0f, radius * std::sin(u)) + tube * vertex.Normal;
+            vertices.push_back(vertex);
+        }
+    for (unsigned int i = 0; i < rings; i++)
+        for (unsigned int j = 0; j < sides; j++)
+        {
+            unsigned int a = i * sides + j, b = (i + 1) % rings * sides + j, c = i * sides + (j + 1) % sides, d = (i + 1) % rings * sides + (j + 1) % sides;
+            indices.insert(indices.end(), { a, c, b, b, c, d });
+        }
+    OccluderMesh source;
+    for (unsigned int i = 0; i < vertices.size(); i++)
+        source.vertices.push_back(vertices[i].Position);
+    source.indices = indices;
+
+    auto start = std::chrono::steady_clock::now();
+    OccluderMesh simplified = SimplifyOccluder(vertices, indices, maxTriangles);
+    double simplify = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (simplified.Triangles() > maxTriangles)
+    {
+        std::cout << "ERROR::BENCHMARK::OCCLUDER_OVER_BUDGET " << simplified.Triangles() << " triangles" << std::endl;
+        return;
+    }
+
+    // from above, then at an angle and from the side; boxes on a plane behind the torus, across its outline
+    const glm::vec3 eyes[] = { glm::vec3(0.0f, 5.0f, 0.01f), glm::vec3(0.0f, 3.0f, 3.0f), glm::vec3(4.0f, 1.0f, 0.5f) };
+    glm::mat4 projection = glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, 100.0f);
+    OcclusionCuller sourceCuller, simplifiedCuller;
+    unsigned int tested = 0, sourceOccluded = 0, bothOccluded = 0;
+    for (const glm::vec3 &eye : eyes)
+    {
+        glm::mat4 viewProjection = projection * glm::lookAt(eye, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+        sourceCuller.Begin(viewProjection);
+        sourceCuller.AddOccluder(source, glm::mat4(1.0f));
+        sourceCuller.Rasterize();
+        simplifiedCuller.Begin(viewProjection);
+        simplifiedCuller.AddOccluder(simplified, glm::mat4(1.0f));
+        simplifiedCuller.Rasterize();
+        glm::vec3 forward = -glm::normalize(eye);
+        glm::vec3 right = glm::normalize(glm::cross(forward, glm::abs(forward.y) > 0.9f ? glm::vec3(1.0f, 0.0f, 0.0f) : glm::vec3(0.0f, 1.0f, 0.0f)));
+        glm::vec3 up = glm::cross(right, forward);
+        for (float x = -1.6f; x <= 1.6f; x += 0.02f)
+            for (float y = -1.6f; y <= 1.6f; y += 0.02f)
+            {
+                glm::vec3 center = forward * 2.0f + right * x + up * y;
+                Bounds bounds = box(center - glm::vec3(0.02f), center + glm::vec3(0.02f));
+                bool sourceVisible = sourceCuller.Visible(bounds), simplifiedVisible = simplifiedCuller.Visible(bounds);
+                if (sourceVisible && !simplifiedVisible)
+                {
+                    std::cout << "ERROR::BENCHMARK::OCCLUDER_HIDES_VISIBLE box at " << center.x << ", " << center.y << ", " << center.z << std::endl;
+                    return;
+                }
+                tested++;
+                sourceOccluded += !sourceVisible;
+                bothOccluded += !simplifiedVisible;
+            }
+    }
+    std::cout << "Occluder simplification: " << indices.size() / 3 << " triangles simplified to " << simplified.Triangles() << " (budget " << maxTriangles
+              << ") in " << simplify << " ms, occluding " << 100.0 * bothOccluded / std::max(sourceOccluded, 1u) << "% of the " << sourceOccluded
+              << " boxes the source mesh occludes out of " << tested << std::endl;
+}
+
+// the per draw normal matrices: the batched cofactor kernel against the inverse transpose lighting.vs used
+// to compute per vertex, one glm::inverse per matrix
+inline void BenchmarkNormalMatrices(unsigned int objects = 1000000, unsigned int frames = 20)
+{
+    auto milliseconds = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    std::mt19937 random(9753);
+    std::uniform_real_distribution<float> angle(0.0f, 6.2831853f), scale(0.25f, 4.0f), position(-100.0f, 100.0f);
+    vector<glm::mat4> models(objects);
+    for (unsigned int i = 0; i < objects; i++)
+    {
+        glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(position(random), position(random), position(random)));
+        model = glm::rotate(model, angle(random), glm::normalize(glm::vec3(position(random), position(random), position(random)) + glm::vec3(0.001f)));
+        models[i] = glm::scale(model, glm::vec3(scale(random), scale(random), scale(random)));
+    }
+
+    vector<glm::vec4> normals(objects * 3);
+    vector<glm::mat3> reference(objects);
+    double batched = 0.0, inverse = 0.0;
+    for (unsigned int frame = 0; frame < frames; frame++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        ComputeNormalMatrices(models.data(), objects, normals.data());
+        batched += milliseconds(start);
+
+        start = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < objects; i++)
+            reference[i] = glm::mat3(glm::transpose(glm::inverse(models[i])));
+        inverse += milliseconds(start);
+    }
+
+    float worst = 0.0f;
+    for (unsigned int i = 0; i < objects; i++)
+        for (int c = 0; c < 3; c++)
+        {
+            glm::vec3 expected = reference[i][c];
+            worst = std::max(worst, glm::length(glm::vec3(normals[3 * i + c]) - expected) / std::max(glm::length(expected), 1e-6f));
+        }
+    if (worst > 1e-4f)
+    {
+        std::cout << "ERROR::BENCHMARK::NORMAL_MATRIX_MISMATCH relative error " << worst << std::endl;
+        return;
+    }
+    std::cout << "Normal matrices, " << objects << " objects: batched "
+#ifdef NORMAL_MATRIX_SSE
+              << "(SSE) "
+#endif
+              << batched / frames << " ms per frame, glm::inverse per object " << inverse / frames << " ms (largest relative difference "
+              << worst << ")" << std::endl;
+}
+
+// the CPU side of Model::DrawInstanced() for a field of copies: culling their transformed bounds, the normal
+// matrices and filling the instance attributes, which InstanceBuffer::Upload() writes into its mapped buffer
+inline void BenchmarkInstancing(unsigned int copies = 100000, unsigned int frames = 20)
+{
+    auto milliseconds = [](std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    };
+    std::mt19937 random(8642);
+    std::uniform_real_distribution<float> angle(0.0f, 6.2831853f), position(-150.0f, 150.0f);
+    vector<glm::mat4> transforms(copies);
+    for (unsigned int i = 0; i < copies; i++)
+    {
+        glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(position(random), position(random) * 0.1f, position(random)));
+        transforms[i] = glm::rotate(model, angle(random), glm::vec3(0.0f, 1.0f, 0.0f));
+    }
+    // the donut's bounds
+    Bounds bounds;
+    bounds.Extend(glm::vec3(-1.35f, -0.35f, -1.35f));
+    bounds.Extend(glm::vec3(1.35f, 0.35f, 1.35f));
+
+    FrustumCuller culler;
+    vector<glm::mat4> visible;
+    vector<glm::vec4> normals;
+    vector<InstanceAttributes> instances(copies);
+    auto fill = [&](const glm::mat4 *transforms, unsigned int count) {
+        normals.resize(count * 3);
+        ComputeNormalMatrices(transforms, count, normals.data());
+        for (unsigned int i = 0; i < count; i++)
+        {
+            instances[i].model = transforms[i];
+            instances[i].data = glm::vec4(1.0f);
+            std::memcpy(instances[i].normalMatrix, &normals[3 * i], sizeof(instances[i].normalMatrix));
+        }
+    };
+    double cull = 0.0, upload = 0.0, uploadAll = 0.0;
+    unsigned int drawn = 0;
+    for (unsigned int frame = 0; frame < frames; frame++)
+    {
+        glm::vec3 direction(std::sin(frame * 0.3f), 0.0f, -std::cos(frame * 0.3f));
+        Frustum frustum(glm::perspective(glm::radians(45.0f), 4.0f / 3.0f, 0.1f, 100.0f)
+                        * glm::lookAt(glm::vec3(0.0f), direction, glm::vec3(0.0f, 1.0f, 0.0f)));
+        auto start = std::chrono::steady_clock::now();
+        culler.Clear();
+        for (unsigned int i = 0; i < copies; i++)
+            culler.Add(bounds.Transformed(transforms[i]));
+        culler.Cull(frustum);
+        visible.clear();
+        for (unsigned int i = 0; i < copies; i++)
+            if (culler.Visible(i))
+                visible.push_back(transforms[i]);
+        cull += milliseconds(start);
+
+        start = std::chrono::steady_clock::now();
+        fill(visible.data(), (unsigned int)visible.size());
+        upload += milliseconds(start);
+        drawn += (unsigned int)visible.size();
+
+        // without a frustum every copy is drawn
+        start = std::chrono::steady_clock::now();
+        fill(transforms.data(), copies);
+        uploadAll += milliseconds(start);
+    }
+    std::cout << "Instancing, " << copies << " copies: " << drawn / frames << " in the frustum per frame, culled in " << cull / frames
+              << " ms, their instance attributes filled in " << upload / frames << " ms per frame; all of them unculled in "
+              << uploadAll / frames << " ms" << std::endl;
+}
+
+inline void RunBenchmarks()
+{
+    BenchmarkRenderQueue();
+    BenchmarkFrustumCulling();
+    BenchmarkSceneBVH();
+    BenchmarkOcclusionCulling();
+    BenchmarkOccluderSimplification();
+    BenchmarkNormalMatrices();
+    BenchmarkInstancing();
+}
+#endif
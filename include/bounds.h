@@ -0,0 +1,66 @@
+#ifndef BOUNDS_H
+#define BOUNDS_H
+
+#include <glm/glm.hpp>
+
+#include <cfloat>
+#include <cmath>
+#include <algorithm>
+
+// An axis aligned box and a bounding sphere around the same geometry. Meshes keep theirs in model space
+// (Mesh::bounds), draws carry them transformed to world space for culling. Default constructed bounds are
+// empty, and empty bounds are never culled.
+struct Bounds {
+    glm::vec3 min = glm::vec3(FLT_MAX);
+    glm::vec3 max = glm::vec3(-FLT_MAX);
+    glm::vec3 center = glm::vec3(0.0f); // of the sphere
+    float radius = 0.0f;
+
+    bool Empty() const { return min.x > max.x; }
+
+    // grows the box to contain point; the sphere is left to the caller
+    void Extend(const glm::vec3 &point)
+    {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+
+    // grows both to contain other
+    void Merge(const Bounds &other)
+    {
+        if (other.Empty())
+            return;
+        if (Empty())
+        {
+            *this = other;
+            return;
+        }
+        min = glm::min(min, other.min);
+        max = glm::max(max, other.max);
+        glm::vec3 merged = (min + max) * 0.5f;
+        radius = std::max(glm::length(center - merged) + radius, glm::length(other.center - merged) + other.radius);
+        center = merged;
+    }
+
+    // the bounds of the geometry once transformed: the box around the transformed box (Arvo), and the sphere
+    // scaled by the largest axis scale
+    Bounds Transformed(const glm::mat4 &transform) const
+    {
+        if (Empty())
+            return *this;
+        glm::vec3 boxCenter = (min + max) * 0.5f;
+        glm::vec3 extent = (max - min) * 0.5f;
+        glm::vec3 worldCenter = glm::vec3(transform * glm::vec4(boxCenter, 1.0f));
+        glm::mat3 linear(transform);
+        glm::vec3 worldExtent = glm::abs(linear[0]) * extent.x + glm::abs(linear[1]) * extent.y + glm::abs(linear[2]) * extent.z;
+
+        Bounds result;
+        result.min = worldCenter - worldExtent;
+        result.max = worldCenter + worldExtent;
+        result.center = glm::vec3(transform * glm::vec4(center, 1.0f));
+        float scale = std::max(glm::length(linear[0]), std::max(glm::length(linear[1]), glm::length(linear[2])));
+        result.radius = radius * scale;
+        return result;
+    }
+};
+#endif
@@ -62,6 +62,12 @@ public:
         updateCameraVectors();
     }
 
+    // returns the perspective projection of the camera's zoom
+    glm::mat4 GetProjectionMatrix(float aspect, float nearPlane, float farPlane)
+    {
+        return glm::perspective(glm::radians(Zoom), aspect, nearPlane, farPlane);
+    }
+
     // returns the view matrix calculated using Euler Angles and the LookAt Matrix
     glm::mat4 GetViewMatrix()
     {
@@ -0,0 +1,218 @@
+#ifndef DEBUG_RENDERER_H
+#define DEBUG_RENDERER_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <shader.h>
+#include <shader_compiler.h>
+#include <render_state.h>
+#include <instance_buffer.h>
+
+#include <vector>
+#include <cmath>
+using namespace std;
+
+const unsigned int DEBUG_SPHERE_SLICES = 16; // around the axis
+const unsigned int DEBUG_SPHERE_STACKS = 12; // pole to pole
+
+// Immediate mode debug drawing: light gizmos, bounds, view volumes. Primitives are queued anywhere during the
+// frame and Flush() draws them all with one instanced draw per shape (solid cubes, solid spheres, wire boxes)
+// streamed through the InstanceBuffer, plus a single GL_LINES draw for the lines, so thousands of them cost
+// a handful of calls. Everything is flat colored, depth tested and uses the Camera block.
+class DebugRenderer
+{
+public:
+    struct Stats {
+        unsigned int primitives = 0;
+        unsigned int draws = 0;
+    };
+
+    DebugRenderer(bool useProgramCache = true, ShaderCompiler *compiler = nullptr)
+        : shapeShader("src/shaders/debug.vs", "src/shaders/debug.fs", useProgramCache, "", compiler),
+          lineShader("src/shaders/debug.vs", "src/shaders/debug.fs", useProgramCache, "#define DEBUG_LINES 1\n", compiler)
+    {
+        createShapes();
+        glGenVertexArrays(1, &lineVAO);
+        glGenBuffers(1, &lineVBO);
+        RenderState &state = GetRenderState();
+        state.BindVertexArray(lineVAO);
+        state.BindBuffer(GL_ARRAY_BUFFER, lineVBO);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(LineVertex), (void*)0);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(LineVertex), (void*)offsetof(LineVertex, color));
+        state.BindVertexArray(0);
+    }
+
+    DebugRenderer(const DebugRenderer&) = delete;
+    DebugRenderer& operator=(const DebugRenderer&) = delete;
+
+    // solid cube of edge size around center
+    void Cube(const glm::vec3 &center, float size, const glm::vec3 &color)
+    {
+        cubes.Add(glm::scale(glm::translate(glm::mat4(1.0f), center), glm::vec3(size * 0.5f)), color);
+    }
+
+    void Sphere(const glm::vec3 &center, float radius, const glm::vec3 &color)
+    {
+        spheres.Add(glm::scale(glm::translate(glm::mat4(1.0f), center), glm::vec3(radius)), color);
+    }
+
+    void Line(const glm::vec3 &from, const glm::vec3 &to, const glm::vec3 &color)
+    {
+        lines.push_back({ from, glm::vec4(color, 1.0f) });
+        lines.push_back({ to, glm::vec4(color, 1.0f) });
+    }
+
+    // wireframe axis aligned box
+    void Box(const glm::vec3 &min, const glm::vec3 &max, const glm::vec3 &color)
+    {
+        boxes.Add(glm::scale(glm::translate(glm::mat4(1.0f), (min + max) * 0.5f), (max - min) * 0.5f), color);
+    }
+
+    // wireframe of the volume a view projection matrix sees; the box's corners are its clip space corners,
+    // brought back by the inverse and divided by w in debug.vs
+    void Frustum(const glm::mat4 &viewProjection, const glm::vec3 &color)
+    {
+        boxes.Add(glm::inverse(viewProjection), color);
+    }
+
+    // draws and clears everything queued since the last Flush()
+    void Flush()
+    {
+        stats = Stats();
+        stats.primitives = cubes.Count() + spheres.Count() + boxes.Count() + (unsigned int)lines.size() / 2;
+        if (cubes.Count() + spheres.Count() + boxes.Count() > 0)
+        {
+            shapeShader.use();
+            drawShapes(cubes, GL_TRIANGLES, cubeRange);
+            drawShapes(spheres, GL_TRIANGLES, sphereRange);
+            drawShapes(boxes, GL_LINES, boxRange);
+        }
+        if (!lines.empty())
+        {
+            RenderState &state = GetRenderState();
+            lineShader.use();
+            state.BindVertexArray(lineVAO);
+            state.BindBuffer(GL_ARRAY_BUFFER, lineVBO);
+            // orphan the previous frame's lines
+            glBufferData(GL_ARRAY_BUFFER, lines.size() * sizeof(LineVertex), lines.data(), GL_STREAM_DRAW);
+            glDrawArrays(GL_LINES, 0, (GLsizei)lines.size());
+            stats.draws++;
+            lines.clear();
+        }
+    }
+
+    // of the last Flush()
+    const Stats& GetStats() const { return stats; }
+
+private:
+    struct LineVertex {
+        glm::vec3 position;
+        glm::vec4 color;
+    };
+
+    // the instances of one shape, as InstanceBuffer::Upload() takes them
+    struct Instances {
+        vector<glm::mat4> transforms;
+        vector<glm::vec4> colors;
+
+        void Add(const glm::mat4 &transform, const glm::vec3 &color)
+        {
+            transforms.push_back(transform);
+            colors.push_back(glm::vec4(color, 1.0f));
+        }
+        unsigned int Count() const { return (unsigned int)transforms.size(); }
+    };
+
+    // indices of a shape in the shared index buffer
+    struct ShapeRange {
+        unsigned int firstIndex = 0, count = 0;
+        int baseVertex = 0;
+    };
+
+    Shader shapeShader, lineShader;
+    unsigned int shapeVAO = 0, shapeVBO = 0, shapeEBO = 0;
+    unsigned int lineVAO = 0, lineVBO = 0;
+    ShapeRange cubeRange, sphereRange, boxRange;
+    Instances cubes, spheres, boxes;
+    vector<LineVertex> lines;
+    Stats stats;
+
+    void drawShapes(Instances &instances, GLenum mode, const ShapeRange &range)
+    {
+        if (instances.Count() == 0)
+            return;
+        InstanceBuffer &buffer = GetInstanceBuffer();
+        buffer.Upload(instances.transforms.data(), instances.colors.data(), instances.Count());
+        GetRenderState().BindVertexArray(shapeVAO);
+        glDrawElementsInstancedBaseVertex(mode, range.count, GL_UNSIGNED_INT, (void*)(range.firstIndex * sizeof(unsigned int)),
+                                          instances.Count(), range.baseVertex);
+        stats.draws++;
+        instances.transforms.clear();
+        instances.colors.clear();
+    }
+
+    // unit shapes around the origin in one vertex and index buffer: the cube and box span -1..1, the sphere has radius 1
+    void createShapes()
+    {
+        vector<glm::vec3> vertices;
+        vector<unsigned int> indices;
+        // cube corners, shared by the solid cube and the wire box
+        for (unsigned int i = 0; i < 8; i++)
+            vertices.push_back(glm::vec3(i & 1 ? 1.0f : -1.0f, i & 2 ? 1.0f : -1.0f, i & 4 ? 1.0f : -1.0f));
+        const unsigned int cubeTriangles[] = {
+            0, 2, 1, 1, 2, 3,  4, 5, 6, 5, 7, 6,  // -z, +z
+            0, 1, 4, 1, 5, 4,  2, 6, 3, 3, 6, 7,  // -y, +y
+            0, 4, 2, 2, 4, 6,  1, 3, 5, 3, 7, 5,  // -x, +x
+        };
+        cubeRange.firstIndex = (unsigned int)indices.size();
+        cubeRange.count = 36;
+        indices.insert(indices.end(), cubeTriangles, cubeTriangles + 36);
+        const unsigned int boxLines[] = {
+            0, 1, 2, 3, 4, 5, 6, 7,  // along x
+            0, 2, 1, 3, 4, 6, 5, 7,  // along y
+            0, 4, 1, 5, 2, 6, 3, 7,  // along z
+        };
+        boxRange.firstIndex = (unsigned int)indices.size();
+        boxRange.count = 24;
+        indices.insert(indices.end(), boxLines, boxLines + 24);
+
+        sphereRange.firstIndex = (unsigned int)indices.size();
+        sphereRange.baseVertex = (int)vertices.size();
+        for (unsigned int stack = 0; stack <= DEBUG_SPHERE_STACKS; stack++)
+        {
+            float polar = 3.14159265f * stack / DEBUG_SPHERE_STACKS;
+            for (unsigned int slice = 0; slice <= DEBUG_SPHERE_SLICES; slice++)
+            {
+                float azimuth = 2.0f * 3.14159265f * slice / DEBUG_SPHERE_SLICES;
+                vertices.push_back(glm::vec3(std::sin(polar) * std::cos(azimuth), std::cos(polar), std::sin(polar) * std::sin(azimuth)));
+            }
+        }
+        for (unsigned int stack = 0; stack < DEBUG_SPHERE_STACKS; stack++)
+            for (unsigned int slice = 0; slice < DEBUG_SPHERE_SLICES; slice++)
+            {
+                unsigned int a = stack * (DEBUG_SPHERE_SLICES + 1) + slice, b = a + DEBUG_SPHERE_SLICES + 1;
+                const unsigned int quad[] = { a, a + 1, b, b, a + 1, b + 1 };
+                indices.insert(indices.end(), quad, quad + 6);
+            }
+        sphereRange.count = (unsigned int)indices.size() - sphereRange.firstIndex;
+
+        glGenVertexArrays(1, &shapeVAO);
+        glGenBuffers(1, &shapeVBO);
+        glGenBuffers(1, &shapeEBO);
+        RenderState &state = GetRenderState();
+        state.BindVertexArray(shapeVAO);
+        state.BindBuffer(GL_ARRAY_BUFFER, shapeVBO);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(glm::vec3), vertices.data(), GL_STATIC_DRAW);
+        state.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, shapeEBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+        state.BindVertexArray(0);
+        GetInstanceBuffer().Attach(shapeVAO);
+    }
+};
+#endif
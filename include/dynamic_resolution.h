@@ -0,0 +1,255 @@
+#ifndef DYNAMIC_RESOLUTION_H
+#define DYNAMIC_RESOLUTION_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <shader.h>
+#include <shader_compiler.h>
+#include <render_state.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+using namespace std;
+
+const float DYNAMIC_RESOLUTION_TARGET_MS = 16.0f;    // GPU time the scene should take per frame
+const float DYNAMIC_RESOLUTION_MIN_SCALE = 0.5f;     // of the window's width and height
+const float DYNAMIC_RESOLUTION_STEP = 0.05f;         // the scale moves in steps, each one reallocates the scene's targets
+const float DYNAMIC_RESOLUTION_HEADROOM = 0.9f;      // scaled up only if the next step should take less than this much of the target
+const float DYNAMIC_RESOLUTION_SMOOTHING = 0.25f;    // weight of a new frame time in the filtered one
+const unsigned int DYNAMIC_RESOLUTION_SETTLE = 8;    // frames timed at a scale before the controller moves away from it
+const unsigned int DYNAMIC_RESOLUTION_QUERIES = 4;   // frames in flight before a frame has to go untimed
+const float UPSCALE_SHARPNESS = 0.6f;                // sharpening at the minimum scale, less closer to the window's resolution
+
+// Renders the scene into an offscreen target whose resolution follows the GPU's load, and scales it up to
+// the window. Every frame's scene is timed with a pair of GL_TIMESTAMP queries (timestamps rather than a
+// GpuTimer, so the GpuTimer spans of the passes inside can still be measured) and read back a few frames late.
+// A controller filters the frame times measured at the current scale and picks the scale that should bring
+// them down to DYNAMIC_RESOLUTION_TARGET_MS, assuming the cost goes with the pixel count. It scales down as soon
+// as the target is exceeded, but up only one step at a time and only when that step should still leave
+// DYNAMIC_RESOLUTION_HEADROOM, so it doesn't oscillate between two steps.
+//
+// Each frame: Begin() before the scene (binds the target at RenderWidth() x RenderHeight()), End() after it,
+// then Present() to the window. A new scale is settled on in End() but only applied by the next Begin(), so
+// the frame being presented is never in a target that was just reallocated. RenderWidth() and RenderHeight()
+// are the resolution of the next Begin() from End() on; everything sized by the scene's resolution (the
+// G-buffer, light clusters) has to follow them, read before Begin(). Resize() to the window's framebuffer size
+// before them; like a new scale, the target follows it in the next Begin().
+class DynamicResolution
+{
+public:
+    struct Stats {
+        unsigned int frames = 0;   // timed frames since ResetStats()
+        unsigned int changes = 0;  // resolution changes since ResetStats()
+        float minScale = 0.0f, maxScale = 0.0f, averageScale = 0.0f;
+        float minMilliseconds = 0.0f, maxMilliseconds = 0.0f, averageMilliseconds = 0.0f;
+    };
+
+    DynamicResolution(unsigned int windowWidth, unsigned int windowHeight, bool useProgramCache = true, ShaderCompiler *compiler = nullptr)
+        : windowWidth(windowWidth), windowHeight(windowHeight),
+          upscaleShader("src/shaders/deferred.vs", "src/shaders/upscale.fs", useProgramCache, "", compiler)
+    {
+        glGenQueries(2 * DYNAMIC_RESOLUTION_QUERIES, queries);
+        RenderState &state = GetRenderState();
+        glGenTextures(1, &color);
+        glGenRenderbuffers(1, &depth);
+        glGenFramebuffers(1, &FBO);
+        allocate();
+        state.BindFramebuffer(GL_FRAMEBUFFER, FBO);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depth);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "ERROR::DYNAMIC_RESOLUTION::FRAMEBUFFER_INCOMPLETE" << std::endl;
+        state.BindFramebuffer(GL_FRAMEBUFFER, 0);
+        glGenVertexArrays(1, &emptyVAO);
+    }
+
+    ~DynamicResolution()
+    {
+        glDeleteQueries(2 * DYNAMIC_RESOLUTION_QUERIES, queries);
+        RenderState &state = GetRenderState();
+        state.DeleteFramebuffer(FBO);
+        state.DeleteTexture(color);
+        glDeleteRenderbuffers(1, &depth);
+        state.DeleteVertexArray(emptyVAO);
+    }
+
+    DynamicResolution(const DynamicResolution&) = delete;
+    DynamicResolution& operator=(const DynamicResolution&) = delete;
+
+    // applies the scale the controller settled on, redirects the scene into the target and starts timing it
+    void Begin()
+    {
+        if (nextScale != scale)
+        {
+            std::cout << "Dynamic resolution: " << renderWidth << "x" << renderHeight << " -> ";
+            scale = nextScale;
+            allocate();
+            std::cout << renderWidth << "x" << renderHeight << " (" << filtered << " ms GPU, target " << DYNAMIC_RESOLUTION_TARGET_MS << ")" << std::endl;
+            measured = 0;
+            stats.changes++;
+        }
+        else if (RenderWidth() != renderWidth || RenderHeight() != renderHeight)
+        {
+            // the window was resized: the same scale of its new size, timed afresh
+            allocate();
+            measured = 0;
+        }
+        GetRenderState().BindFramebuffer(GL_FRAMEBUFFER, FBO);
+        glViewport(0, 0, renderWidth, renderHeight);
+        timing = issued - retired < DYNAMIC_RESOLUTION_QUERIES;
+        if (timing)
+        {
+            unsigned int slot = issued % DYNAMIC_RESOLUTION_QUERIES;
+            glQueryCounter(queries[2 * slot], GL_TIMESTAMP);
+            scales[slot] = scale;
+        }
+    }
+
+    // ends the scene's timing and feeds the controller the frames that finished since
+    void End()
+    {
+        if (timing)
+        {
+            glQueryCounter(queries[2 * (issued % DYNAMIC_RESOLUTION_QUERIES) + 1], GL_TIMESTAMP);
+            issued++;
+            timing = false;
+        }
+        collect();
+    }
+
+    // scales the scene up to the window, into the default framebuffer
+    void Present()
+    {
+        RenderState &state = GetRenderState();
+        state.BindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, windowWidth, windowHeight);
+        state.Disable(GL_DEPTH_TEST);
+        upscaleShader.use();
+        state.BindTexture(0, GL_TEXTURE_2D, color);
+        upscaleShader.setInt("sceneColor"_uniform, 0);
+        upscaleShader.setVec2("windowSize"_uniform, (float)windowWidth, (float)windowHeight);
+        float sharpness = (1.0f - scale) / (1.0f - DYNAMIC_RESOLUTION_MIN_SCALE) * UPSCALE_SHARPNESS;
+        upscaleShader.setFloat("sharpness"_uniform, sharpness);
+        state.BindVertexArray(emptyVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        state.Enable(GL_DEPTH_TEST);
+    }
+
+    // the window's framebuffer size, in pixels, which the scene is scaled from and presented to
+    void Resize(unsigned int width, unsigned int height)
+    {
+        windowWidth = std::max(1u, width);
+        windowHeight = std::max(1u, height);
+    }
+
+    float Scale() const { return scale; }
+    // the resolution the next Begin() renders at; the current one until End() settles on another
+    unsigned int RenderWidth() const { return scaled(windowWidth, nextScale); }
+    unsigned int RenderHeight() const { return scaled(windowHeight, nextScale); }
+
+    // scales and frame times of the frames timed since the last ResetStats()
+    Stats GetStats() const
+    {
+        Stats result = stats;
+        if (result.frames > 0)
+        {
+            result.averageScale = (float)(scaleTotal / result.frames);
+            result.averageMilliseconds = (float)(millisecondsTotal / result.frames);
+        }
+        return result;
+    }
+
+    void ResetStats()
+    {
+        stats = Stats();
+        scaleTotal = millisecondsTotal = 0.0;
+    }
+
+private:
+    unsigned int windowWidth, windowHeight;
+    unsigned int renderWidth = 0, renderHeight = 0;   // of the target, at scale
+    float scale = 1.0f, nextScale = 1.0f;
+    float filtered = 0.0f;          // smoothed frame time at the current scale
+    unsigned int measured = 0;      // frames timed at the current scale
+    Shader upscaleShader;
+    unsigned int FBO = 0, color = 0, depth = 0, emptyVAO = 0;
+
+    unsigned int queries[2 * DYNAMIC_RESOLUTION_QUERIES]; // begin and end timestamp per frame in flight
+    float scales[DYNAMIC_RESOLUTION_QUERIES] = {};        // the scale each of them rendered at
+    unsigned int issued = 0, retired = 0;
+    bool timing = false;
+
+    Stats stats;
+    double scaleTotal = 0.0, millisecondsTotal = 0.0;
+
+    static unsigned int scaled(unsigned int size, float scale)
+    {
+        return std::max(1u, (unsigned int)std::lround(size * scale));
+    }
+
+    // (re)specifies the target at the current scale
+    void allocate()
+    {
+        renderWidth = scaled(windowWidth, scale);
+        renderHeight = scaled(windowHeight, scale);
+        RenderState &state = GetRenderState();
+        state.BindTexture(GL_TEXTURE_2D, color);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, renderWidth, renderHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindRenderbuffer(GL_RENDERBUFFER, depth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, renderWidth, renderHeight);
+    }
+
+    // reads back every finished frame, oldest first, and feeds the controller with it
+    void collect()
+    {
+        while (retired < issued)
+        {
+            unsigned int slot = retired % DYNAMIC_RESOLUTION_QUERIES;
+            GLint available = 0;
+            glGetQueryObjectiv(queries[2 * slot + 1], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                break;
+            GLuint64 begin = 0, end = 0;
+            glGetQueryObjectui64v(queries[2 * slot], GL_QUERY_RESULT, &begin);
+            glGetQueryObjectui64v(queries[2 * slot + 1], GL_QUERY_RESULT, &end);
+            retired++;
+            record(scales[slot], (float)((end - begin) * 1e-6));
+        }
+    }
+
+    // adds a timed frame to the stats, and to the controller if it was rendered at the current scale
+    void record(float frameScale, float milliseconds)
+    {
+        stats.minScale = stats.frames > 0 ? std::min(stats.minScale, frameScale) : frameScale;
+        stats.maxScale = stats.frames > 0 ? std::max(stats.maxScale, frameScale) : frameScale;
+        stats.minMilliseconds = stats.frames > 0 ? std::min(stats.minMilliseconds, milliseconds) : milliseconds;
+        stats.maxMilliseconds = stats.frames > 0 ? std::max(stats.maxMilliseconds, milliseconds) : milliseconds;
+        stats.frames++;
+        scaleTotal += frameScale;
+        millisecondsTotal += milliseconds;
+
+        // frames still in flight from before the last change say nothing about the current scale
+        if (frameScale != scale || nextScale != scale)
+            return;
+        filtered = measured > 0 ? filtered + (milliseconds - filtered) * DYNAMIC_RESOLUTION_SMOOTHING : milliseconds;
+        if (++measured < DYNAMIC_RESOLUTION_SETTLE || filtered <= 0.0f)
+            return;
+        // in whole steps; the frame's cost goes with its pixels, the square of the scale
+        int step = (int)std::lround(scale / DYNAMIC_RESOLUTION_STEP);
+        int ideal = (int)std::floor(scale * std::sqrt(DYNAMIC_RESOLUTION_TARGET_MS / filtered) / DYNAMIC_RESOLUTION_STEP + 1e-3f);
+        int next = step;
+        if (filtered > DYNAMIC_RESOLUTION_TARGET_MS)
+            next = std::min(ideal, step - 1);
+        else if (filtered * (step + 1) * (step + 1) / (step * step) < DYNAMIC_RESOLUTION_TARGET_MS * DYNAMIC_RESOLUTION_HEADROOM)
+            next = step + 1;
+        next = glm::clamp(next, (int)std::lround(DYNAMIC_RESOLUTION_MIN_SCALE / DYNAMIC_RESOLUTION_STEP), (int)std::lround(1.0f / DYNAMIC_RESOLUTION_STEP));
+        nextScale = next * DYNAMIC_RESOLUTION_STEP;
+    }
+};
+#endif
@@ -0,0 +1,76 @@
+#ifndef FIXED_TIMESTEP_H
+#define FIXED_TIMESTEP_H
+
+#include <algorithm>
+
+const double SIMULATION_STEP = 1.0 / 60.0;       // seconds of simulation per update
+const unsigned int MAX_SIMULATION_STEPS = 8;     // updates per frame; a longer frame slows the simulation down instead
+
+// Runs the simulation in fixed steps, decoupled from the render rate. Frame times from a double precision
+// clock go into an accumulator, and every whole step in it is one update, so an update always advances the
+// same time however fast frames come, and its cost doesn't depend on them. What's left over is Alpha(), how
+// far the frame is between the last two updates: the renderer interpolates their states by it instead of
+// showing the latest one, which would stutter whenever a frame ran a different number of steps.
+//
+// Each frame: Advance(now), then Steps() updates of Step() seconds each, then render with Alpha().
+class FixedTimestep
+{
+public:
+    struct Stats {
+        unsigned int frames = 0;        // since ResetStats()
+        unsigned int steps = 0;
+        unsigned int maxSteps = 0;      // in one frame
+        double droppedSeconds = 0.0;    // frame time beyond MAX_SIMULATION_STEPS, not simulated
+    };
+
+    explicit FixedTimestep(double step = SIMULATION_STEP)
+        : step(step)
+    {
+    }
+
+    // adds the time since the last call to the accumulator; the first call only starts the clock
+    void Advance(double now)
+    {
+        if (started)
+            accumulator += now - last;
+        last = now;
+        started = true;
+        steps = (unsigned int)(accumulator / step);
+        if (steps > MAX_SIMULATION_STEPS)
+        {
+            double dropped = (steps - MAX_SIMULATION_STEPS) * step;
+            stats.droppedSeconds += dropped;
+            accumulator -= dropped;
+            steps = MAX_SIMULATION_STEPS;
+        }
+        accumulator -= steps * step;
+        time += steps * step;
+        stats.frames++;
+        stats.steps += steps;
+        stats.maxSteps = std::max(stats.maxSteps, steps);
+    }
+
+    // updates to run this frame, and the seconds each one simulates
+    unsigned int Steps() const { return steps; }
+    double Step() const { return step; }
+
+    // simulated time after this frame's updates
+    double Time() const { return time; }
+    // how far the frame is from the previous update (0) to the latest one (1)
+    double Alpha() const { return accumulator / step; }
+    // simulated time to render at, between the last two updates
+    double InterpolatedTime() const { return time - step + accumulator; }
+
+    const Stats& GetStats() const { return stats; }
+    void ResetStats() { stats = Stats(); }
+
+private:
+    double step;
+    double accumulator = 0.0;   // unsimulated time, less than a step after Advance()
+    double last = 0.0;
+    double time = 0.0;
+    unsigned int steps = 0;
+    bool started = false;
+    Stats stats;
+};
+#endif
@@ -0,0 +1,204 @@
+#ifndef FRUSTUM_CULLER_H
+#define FRUSTUM_CULLER_H
+
+#include <glm/glm.hpp>
+
+#include <bounds.h>
+#include <job_system.h>
+
+#include <vector>
+#include <cstdint>
+#include <chrono>
+#include <algorithm>
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define FRUSTUM_CULLER_SSE 1
+#endif
+#if defined(__AVX__)
+#include <immintrin.h>
+#define FRUSTUM_CULLER_AVX 1
+#endif
+using namespace std;
+
+// boxes per culling job; fewer than this are culled on the calling thread. A multiple of 8 so every job
+// starts on a full SIMD group.
+const unsigned int FRUSTUM_CULL_JOB_BOXES = 4096;
+
+// The six planes of a view volume, extracted from its view projection matrix (Gribb and Hartmann). Normals
+// point inwards and are normalized: a point is inside when dot(plane.xyz, point) + plane.w >= 0 for every plane.
+struct Frustum {
+    glm::vec4 planes[6]; // left, right, bottom, top, near, far
+
+    Frustum() = default;
+
+    explicit Frustum(const glm::mat4 &viewProjection)
+    {
+        glm::vec4 row[4];
+        for (int i = 0; i < 4; i++)
+            row[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+        planes[0] = row[3] + row[0];
+        planes[1] = row[3] - row[0];
+        planes[2] = row[3] + row[1];
+        planes[3] = row[3] - row[1];
+        planes[4] = row[3] + row[2];
+        planes[5] = row[3] - row[2];
+        for (int i = 0; i < 6; i++)
+            planes[i] /= glm::length(glm::vec3(planes[i]));
+    }
+
+    // false if the box is entirely outside one of the planes; conservative near the frustum's corners
+    bool Intersects(const Bounds &bounds) const
+    {
+        if (bounds.Empty())
+            return true;
+        glm::vec3 center = (bounds.min + bounds.max) * 0.5f;
+        glm::vec3 extent = (bounds.max - bounds.min) * 0.5f;
+        for (int i = 0; i < 6; i++)
+        {
+            // the box's furthest reach along the normal, in the same order as the SIMD kernels
+            const glm::vec4 &plane = planes[i];
+            float distance = center.x * plane.x + center.y * plane.y + center.z * plane.z
+                           + extent.x * std::abs(plane.x) + extent.y * std::abs(plane.y) + extent.z * std::abs(plane.z) + plane.w;
+            if (distance < 0.0f)
+                return false;
+        }
+        return true;
+    }
+
+    bool Intersects(const glm::vec3 &center, float radius) const
+    {
+        for (int i = 0; i < 6; i++)
+            if (glm::dot(glm::vec3(planes[i]), center) + planes[i].w < -radius)
+                return false;
+        return true;
+    }
+};
+
+// Culls a batch of world space boxes against a frustum. Boxes are Add()ed as a structure of arrays of centers
+// and half extents, so the kernel tests 4 boxes per SSE (8 per AVX) instruction against each plane; large
+// batches are split over the job system. Add() every box of the frame, Cull(), then ask Visible().
+class FrustumCuller
+{
+public:
+    struct Stats {
+        unsigned int tested = 0;
+        unsigned int culled = 0;
+        double milliseconds = 0.0;
+    };
+
+    void Clear()
+    {
+        count = 0;
+        centerX.clear(); centerY.clear(); centerZ.clear();
+        extentX.clear(); extentY.clear(); extentZ.clear();
+    }
+
+    // returns the box's index for Visible(); empty bounds always pass
+    unsigned int Add(const Bounds &bounds)
+    {
+        glm::vec3 center(0.0f), extent(1e30f);
+        if (!bounds.Empty())
+        {
+            center = (bounds.min + bounds.max) * 0.5f;
+            extent = (bounds.max - bounds.min) * 0.5f;
+        }
+        centerX.push_back(center.x); centerY.push_back(center.y); centerZ.push_back(center.z);
+        extentX.push_back(extent.x); extentY.push_back(extent.y); extentZ.push_back(extent.z);
+        return count++;
+    }
+
+    // tests every added box, returns how many are visible
+    unsigned int Cull(const Frustum &frustum)
+    {
+        auto start = std::chrono::steady_clock::now();
+        // pad to whole SIMD groups; the padding's results are never read
+        unsigned int padded = (count + 7) & ~7u;
+        for (vector<float> *array : { &centerX, &centerY, &centerZ, &extentX, &extentY, &extentZ })
+            array->resize(padded, 0.0f);
+        visible.resize(padded);
+        if (padded > FRUSTUM_CULL_JOB_BOXES)
+            GetJobSystem().ParallelFor(padded, FRUSTUM_CULL_JOB_BOXES, [this, &frustum](unsigned int begin, unsigned int end) {
+                cullRange(frustum, begin, end);
+            });
+        else
+            cullRange(frustum, 0, padded);
+
+        stats.tested = count;
+        stats.culled = 0;
+        for (unsigned int i = 0; i < count; i++)
+            stats.culled += !visible[i];
+        stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return count - stats.culled;
+    }
+
+    bool Visible(unsigned int index) const { return visible[index] != 0; }
+    unsigned int Count() const { return count; }
+    // of the last Cull()
+    const Stats& GetStats() const { return stats; }
+
+private:
+    unsigned int count = 0;
+    vector<float> centerX, centerY, centerZ, extentX, extentY, extentZ;
+    vector<uint8_t> visible;
+    Stats stats;
+
+    // begin is a multiple of 8
+    void cullRange(const Frustum &frustum, unsigned int begin, unsigned int end)
+    {
+        unsigned int i = begin;
+#if defined(FRUSTUM_CULLER_AVX)
+        for (; i + 8 <= end; i += 8)
+        {
+            __m256 outside = _mm256_setzero_ps();
+            __m256 cx = _mm256_loadu_ps(&centerX[i]), cy = _mm256_loadu_ps(&centerY[i]), cz = _mm256_loadu_ps(&centerZ[i]);
+            __m256 ex = _mm256_loadu_ps(&extentX[i]), ey = _mm256_loadu_ps(&extentY[i]), ez = _mm256_loadu_ps(&extentZ[i]);
+            for (int p = 0; p < 6; p++)
+            {
+                const glm::vec4 &plane = frustum.planes[p];
+                __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+                    _mm256_mul_ps(cx, _mm256_set1_ps(plane.x)), _mm256_mul_ps(cy, _mm256_set1_ps(plane.y))),
+                    _mm256_mul_ps(cz, _mm256_set1_ps(plane.z))), _mm256_mul_ps(ex, _mm256_set1_ps(std::abs(plane.x)))),
+                    _mm256_mul_ps(ey, _mm256_set1_ps(std::abs(plane.y)))), _mm256_mul_ps(ez, _mm256_set1_ps(std::abs(plane.z)))),
+                    _mm256_set1_ps(plane.w));
+                outside = _mm256_or_ps(outside, _mm256_cmp_ps(distance, _mm256_setzero_ps(), _CMP_LT_OQ));
+            }
+            int mask = _mm256_movemask_ps(outside);
+            for (unsigned int lane = 0; lane < 8; lane++)
+                visible[i + lane] = !(mask & (1 << lane));
+        }
+#elif defined(FRUSTUM_CULLER_SSE)
+        for (; i + 4 <= end; i += 4)
+        {
+            __m128 outside = _mm_setzero_ps();
+            __m128 cx = _mm_loadu_ps(&centerX[i]), cy = _mm_loadu_ps(&centerY[i]), cz = _mm_loadu_ps(&centerZ[i]);
+            __m128 ex = _mm_loadu_ps(&extentX[i]), ey = _mm_loadu_ps(&extentY[i]), ez = _mm_loadu_ps(&extentZ[i]);
+            for (int p = 0; p < 6; p++)
+            {
+                const glm::vec4 &plane = frustum.planes[p];
+                __m128 distance = _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_add_ps(
+                    _mm_mul_ps(cx, _mm_set1_ps(plane.x)), _mm_mul_ps(cy, _mm_set1_ps(plane.y))),
+                    _mm_mul_ps(cz, _mm_set1_ps(plane.z))), _mm_mul_ps(ex, _mm_set1_ps(std::abs(plane.x)))),
+                    _mm_mul_ps(ey, _mm_set1_ps(std::abs(plane.y)))), _mm_mul_ps(ez, _mm_set1_ps(std::abs(plane.z)))),
+                    _mm_set1_ps(plane.w));
+                outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, _mm_setzero_ps()));
+            }
+            int mask = _mm_movemask_ps(outside);
+            for (unsigned int lane = 0; lane < 4; lane++)
+                visible[i + lane] = !(mask & (1 << lane));
+        }
+#endif
+        for (; i < end; i++)
+        {
+            bool inside = true;
+            for (int p = 0; p < 6 && inside; p++)
+            {
+                const glm::vec4 &plane = frustum.planes[p];
+                float distance = centerX[i] * plane.x + centerY[i] * plane.y + centerZ[i] * plane.z
+                               + extentX[i] * std::abs(plane.x) + extentY[i] * std::abs(plane.y) + extentZ[i] * std::abs(plane.z) + plane.w;
+                inside = distance >= 0.0f;
+            }
+            visible[i] = inside;
+        }
+    }
+};
+#endif
@@ -0,0 +1,127 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <shader.h>
+#include <render_state.h>
+
+#include <iostream>
+using namespace std;
+
+// The G-buffer of the deferred path: what a HAS_GBUFFER_OUTPUT variant of lighting.fs writes per pixel, and a
+// HAS_GBUFFER_INPUT variant lights in a single full-screen pass. 14 bytes a pixel:
+//   albedo    RGBA8   rgb: albedo, a: ambient occlusion
+//   normal    RG16    octahedral encoded world space normal
+//   material  RG8     r: specular intensity, g: log2(shininess) / GBUFFER_SHININESS_LOG2 (lighting.fs)
+//   depth     DEPTH24_STENCIL8, positions are reconstructed from it
+//
+// BeginGeometry(), draw the opaque scene with the output variants, EndGeometry(); then Bind() the input
+// variant and DrawFullscreen(). The resolve writes the scene's depth to the framebuffer it lights into, so
+// anything drawn forward afterwards (debug primitives) is still depth tested against it.
+class GBuffer
+{
+public:
+    GBuffer(unsigned int width, unsigned int height)
+        : width(width), height(height)
+    {
+        RenderState &state = GetRenderState();
+        glGenFramebuffers(1, &FBO);
+        state.BindFramebuffer(GL_FRAMEBUFFER, FBO);
+        glGenTextures(4, textures);
+        allocate();
+        const GLenum attachments[4] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_DEPTH_STENCIL_ATTACHMENT };
+        for (unsigned int i = 0; i < 4; i++)
+            glFramebufferTexture2D(GL_FRAMEBUFFER, attachments[i], GL_TEXTURE_2D, textures[i], 0);
+        glDrawBuffers(3, attachments);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "ERROR::GBUFFER::FRAMEBUFFER_INCOMPLETE" << std::endl;
+        state.BindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        // the full-screen triangle is generated from gl_VertexID, but the core profile still wants a vertex array
+        glGenVertexArrays(1, &emptyVAO);
+    }
+
+    ~GBuffer()
+    {
+        RenderState &state = GetRenderState();
+        state.DeleteFramebuffer(FBO);
+        for (unsigned int i = 0; i < 4; i++)
+            state.DeleteTexture(textures[i]);
+        state.DeleteVertexArray(emptyVAO);
+    }
+
+    GBuffer(const GBuffer&) = delete;
+    GBuffer& operator=(const GBuffer&) = delete;
+
+    // reallocates the buffers when the scene's resolution changes
+    void Resize(unsigned int width, unsigned int height)
+    {
+        if (width == this->width && height == this->height)
+            return;
+        this->width = width;
+        this->height = height;
+        allocate();
+    }
+
+    // redirects rendering into the G-buffer and clears it; draw the opaque scene until EndGeometry(), which
+    // goes back to the framebuffer bound before
+    void BeginGeometry()
+    {
+        glGetIntegerv(GL_VIEWPORT, savedViewport);
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &savedFramebuffer);
+        GetRenderState().BindFramebuffer(GL_FRAMEBUFFER, FBO);
+        glViewport(0, 0, width, height);
+        // depth 1 marks the background, the resolve skips it
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+
+    void EndGeometry()
+    {
+        GetRenderState().BindFramebuffer(GL_FRAMEBUFFER, (unsigned int)savedFramebuffer);
+        glViewport(savedViewport[0], savedViewport[1], savedViewport[2], savedViewport[3]);
+    }
+
+    // binds the G-buffer to a resolve program; the inverse view projection takes its depth back to world space
+    void Bind(Shader &shader, const glm::mat4 &viewProjection) const
+    {
+        RenderState &state = GetRenderState();
+        for (unsigned int i = 0; i < 4; i++)
+            state.BindTexture(GBUFFER_ALBEDO_TEXTURE_UNIT + i, GL_TEXTURE_2D, textures[i]);
+        shader.setMat4("gbufferInverseViewProjection"_uniform, glm::inverse(viewProjection));
+    }
+
+    // one triangle over the whole viewport, for the resolve
+    void DrawFullscreen() const
+    {
+        GetRenderState().BindVertexArray(emptyVAO);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+    }
+
+private:
+    unsigned int width, height;
+    unsigned int FBO = 0;
+    unsigned int textures[4] = {}; // albedo, normal, material, depth
+    unsigned int emptyVAO = 0;
+    GLint savedViewport[4];
+    GLint savedFramebuffer = 0;
+
+    // (re)specifies the four textures at the current size, the framebuffer keeps them attached
+    void allocate()
+    {
+        RenderState &state = GetRenderState();
+        const GLenum internalFormats[4] = { GL_RGBA8, GL_RG16, GL_RG8, GL_DEPTH24_STENCIL8 };
+        const GLenum formats[4] = { GL_RGBA, GL_RG, GL_RG, GL_DEPTH_STENCIL };
+        const GLenum types[4] = { GL_UNSIGNED_BYTE, GL_UNSIGNED_SHORT, GL_UNSIGNED_BYTE, GL_UNSIGNED_INT_24_8 };
+        for (unsigned int i = 0; i < 4; i++)
+        {
+            state.BindTexture(GL_TEXTURE_2D, textures[i]);
+            glTexImage2D(GL_TEXTURE_2D, 0, internalFormats[i], width, height, 0, formats[i], types[i], NULL);
+            // only ever read with texelFetch
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        }
+    }
+};
+#endif
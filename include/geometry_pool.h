@@ -0,0 +1,155 @@
+#ifndef GEOMETRY_POOL_H
+#define GEOMETRY_POOL_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <render_state.h>
+
+#include <vector>
+#include <cstddef>
+using namespace std;
+
+const unsigned int MAX_INDIRECT_DRAWS = 65536; // draws per glMultiDrawElementsIndirect, size of the draw id buffer
+const unsigned int DRAW_ID_ATTRIBUTE = 5;      // aDrawID in lighting.vs
+
+struct Vertex {
+    // position
+    glm::vec3 Position;
+    // normal
+    glm::vec3 Normal;
+    // texCoords
+    glm::vec2 TexCoords;
+    // tangent
+    glm::vec3 Tangent;
+    // bitangent
+    glm::vec3 Bitangent;
+};
+
+// the attribute layout of Vertex, for the vertex array bound with the vertex buffer
+inline void SetupVertexAttributes()
+{
+    // vertex Positions
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
+    // vertex normals
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Normal));
+    // vertex texture coords
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, TexCoords));
+    // vertex tangent
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Tangent));
+    // vertex bitangent
+    glEnableVertexAttribArray(4);
+    glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Bitangent));
+}
+
+// the attribute layout of a position stream: tightly packed positions only, for depth and shadow passes that
+// don't need the rest of Vertex's 56 bytes
+inline void SetupPositionAttribute()
+{
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+}
+
+// where a mesh lives in a GeometryPool, as glDrawElementsBaseVertex/DrawElementsIndirectCommand want it
+struct GeometryRange {
+    unsigned int firstIndex = 0;
+    unsigned int count = 0;
+    int baseVertex = 0;
+};
+
+// The vertices and indices of many meshes in one vertex buffer, one index buffer and one vertex array, so
+// that draws of different meshes don't change any binding and can be merged into multi-draw indirect calls.
+// Meshes are added while loading and uploaded by Upload(). The vertex array also carries aDrawID, an
+// instanced attribute that reads 0, 1, 2, ... from a static buffer: indirect commands set their baseInstance
+// to their draw index, which gives every draw of a multi-draw its index without GL 4.6's gl_DrawID.
+// Instanced draws go through a second vertex array without aDrawID: it would read one id per instance, past
+// the MAX_INDIRECT_DRAWS of its buffer with more copies than that. A third one reads the positions alone from
+// their own buffer, with the same indices and ranges.
+class GeometryPool
+{
+public:
+    GeometryPool()
+    {
+        glGenVertexArrays(1, &VAO);
+        glGenVertexArrays(1, &instancedVAO);
+        glGenVertexArrays(1, &positionVAO);
+        glGenBuffers(1, &VBO);
+        glGenBuffers(1, &positionVBO);
+        glGenBuffers(1, &EBO);
+        glGenBuffers(1, &drawIDs);
+
+        vector<unsigned int> ids(MAX_INDIRECT_DRAWS);
+        for (unsigned int i = 0; i < MAX_INDIRECT_DRAWS; i++)
+            ids[i] = i;
+        RenderState &state = GetRenderState();
+        state.BindVertexArray(VAO);
+        state.BindBuffer(GL_ARRAY_BUFFER, drawIDs);
+        glBufferData(GL_ARRAY_BUFFER, ids.size() * sizeof(unsigned int), ids.data(), GL_STATIC_DRAW);
+        glEnableVertexAttribArray(DRAW_ID_ATTRIBUTE);
+        glVertexAttribIPointer(DRAW_ID_ATTRIBUTE, 1, GL_UNSIGNED_INT, sizeof(unsigned int), (void*)0);
+        glVertexAttribDivisor(DRAW_ID_ATTRIBUTE, 1);
+        state.BindVertexArray(0);
+    }
+
+    GeometryPool(const GeometryPool&) = delete;
+    GeometryPool& operator=(const GeometryPool&) = delete;
+
+    // appends a mesh, available for drawing after the next Upload()
+    GeometryRange Add(const vector<Vertex> &meshVertices, const vector<unsigned int> &meshIndices)
+    {
+        GeometryRange range;
+        range.firstIndex = (unsigned int)indices.size();
+        range.count = (unsigned int)meshIndices.size();
+        range.baseVertex = (int)vertices.size();
+        vertices.insert(vertices.end(), meshVertices.begin(), meshVertices.end());
+        indices.insert(indices.end(), meshIndices.begin(), meshIndices.end());
+        dirty = true;
+        return range;
+    }
+
+    // (re)uploads everything added so far
+    void Upload()
+    {
+        if (!dirty)
+            return;
+        RenderState &state = GetRenderState();
+        state.BindVertexArray(VAO);
+        state.BindBuffer(GL_ARRAY_BUFFER, VBO);
+        glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+        state.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), indices.data(), GL_STATIC_DRAW);
+        SetupVertexAttributes();
+        state.BindVertexArray(instancedVAO);
+        state.BindBuffer(GL_ARRAY_BUFFER, VBO);
+        state.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        SetupVertexAttributes();
+
+        vector<glm::vec3> positions(vertices.size());
+        for (size_t i = 0; i < vertices.size(); i++)
+            positions[i] = vertices[i].Position;
+        state.BindVertexArray(positionVAO);
+        state.BindBuffer(GL_ARRAY_BUFFER, positionVBO);
+        glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(glm::vec3), positions.data(), GL_STATIC_DRAW);
+        state.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        SetupPositionAttribute();
+        state.BindVertexArray(0);
+        dirty = false;
+    }
+
+    unsigned int VertexArray() const { return VAO; }
+    unsigned int InstancedArray() const { return instancedVAO; }
+    unsigned int PositionArray() const { return positionVAO; }
+
+private:
+    unsigned int VAO = 0, VBO = 0, EBO = 0, drawIDs = 0;
+    unsigned int instancedVAO = 0;
+    unsigned int positionVAO = 0, positionVBO = 0;
+    vector<Vertex> vertices;
+    vector<unsigned int> indices;
+    bool dirty = false;
+};
+#endif
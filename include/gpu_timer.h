@@ -0,0 +1,79 @@
+#ifndef GPU_TIMER_H
+#define GPU_TIMER_H
+
+#include <glad/glad.h>
+
+const unsigned int GPU_TIMER_QUERIES = 4; // frames in flight before a timing has to be dropped
+
+// Measures the GPU time of a span of commands with GL_TIME_ELAPSED queries. Results are read back a few
+// frames late from a small ring of queries, so timing never stalls the pipeline; a span that would have to
+// wait for a result is skipped instead. Begin/End spans of different timers must not nest.
+class GpuTimer
+{
+public:
+    GpuTimer()
+    {
+        glGenQueries(GPU_TIMER_QUERIES, queries);
+    }
+
+    ~GpuTimer()
+    {
+        glDeleteQueries(GPU_TIMER_QUERIES, queries);
+    }
+
+    GpuTimer(const GpuTimer&) = delete;
+    GpuTimer& operator=(const GpuTimer&) = delete;
+
+    void Begin()
+    {
+        collect();
+        timing = issued - retired < GPU_TIMER_QUERIES;
+        if (timing)
+            glBeginQuery(GL_TIME_ELAPSED, queries[issued % GPU_TIMER_QUERIES]);
+    }
+
+    void End()
+    {
+        if (!timing)
+            return;
+        glEndQuery(GL_TIME_ELAPSED);
+        issued++;
+        timing = false;
+    }
+
+    // average over the spans measured since the last Reset()
+    double AverageMilliseconds() const { return samples > 0 ? totalNanoseconds / samples * 1e-6 : 0.0; }
+    unsigned int Samples() const { return samples; }
+
+    void Reset()
+    {
+        totalNanoseconds = 0.0;
+        samples = 0;
+    }
+
+private:
+    unsigned int queries[GPU_TIMER_QUERIES];
+    unsigned int issued = 0, retired = 0;
+    bool timing = false;
+    double totalNanoseconds = 0.0;
+    unsigned int samples = 0;
+
+    // reads back every finished query, oldest first
+    void collect()
+    {
+        while (retired < issued)
+        {
+            unsigned int query = queries[retired % GPU_TIMER_QUERIES];
+            GLint available = 0;
+            glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available)
+                break;
+            GLuint64 elapsed = 0;
+            glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+            totalNanoseconds += (double)elapsed;
+            samples++;
+            retired++;
+        }
+    }
+};
+#endif
@@ -0,0 +1,120 @@
+#ifndef INSTANCE_BUFFER_H
+#define INSTANCE_BUFFER_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <render_state.h>
+#include <normal_matrix.h>
+
+#include <vector>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+#include <iostream>
+using namespace std;
+
+const unsigned int INSTANCE_MODEL_ATTRIBUTE = 6;   // aInstanceModel in lighting.vs, a mat4 taking locations 6 to 9
+const unsigned int INSTANCE_DATA_ATTRIBUTE  = 10;  // aInstanceData
+const unsigned int INSTANCE_NORMAL_ATTRIBUTE = 11; // aInstanceNormalMatrix, a mat3 taking locations 11 to 13
+const unsigned int INSTANCE_BUFFER_INITIAL  = 1024; // instances the buffer starts with, it grows as needed
+
+// what one instance streams, interleaved
+struct InstanceAttributes {
+    glm::mat4 model;
+    glm::vec4 data;
+    glm::vec4 normalMatrix[3]; // columns, w unused
+};
+
+// Streaming vertex buffer of per instance attributes (divisor 1) for instanced draws. Every vertex array that
+// is drawn instanced is pointed at it once with Attach(); Upload() then replaces the instances through an
+// invalidating map, so an upload never waits on draws still reading the previous ones. Instanced draws have
+// to be issued before the next Upload().
+class InstanceBuffer
+{
+public:
+    InstanceBuffer() = default;
+    InstanceBuffer(const InstanceBuffer&) = delete;
+    InstanceBuffer& operator=(const InstanceBuffer&) = delete;
+
+    // points the instance attributes of vao at the buffer, once per vertex array
+    void Attach(unsigned int vao)
+    {
+        if (std::find(attached.begin(), attached.end(), vao) != attached.end())
+            return;
+        if (!vbo)
+            allocate(INSTANCE_BUFFER_INITIAL);
+        RenderState &state = GetRenderState();
+        state.BindVertexArray(vao);
+        state.BindBuffer(GL_ARRAY_BUFFER, vbo);
+        for (unsigned int column = 0; column < 4; column++)
+        {
+            glEnableVertexAttribArray(INSTANCE_MODEL_ATTRIBUTE + column);
+            glVertexAttribPointer(INSTANCE_MODEL_ATTRIBUTE + column, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceAttributes),
+                                  (void*)(column * sizeof(glm::vec4)));
+            glVertexAttribDivisor(INSTANCE_MODEL_ATTRIBUTE + column, 1);
+        }
+        glEnableVertexAttribArray(INSTANCE_DATA_ATTRIBUTE);
+        glVertexAttribPointer(INSTANCE_DATA_ATTRIBUTE, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceAttributes), (void*)offsetof(InstanceAttributes, data));
+        glVertexAttribDivisor(INSTANCE_DATA_ATTRIBUTE, 1);
+        for (unsigned int column = 0; column < 3; column++)
+        {
+            glEnableVertexAttribArray(INSTANCE_NORMAL_ATTRIBUTE + column);
+            glVertexAttribPointer(INSTANCE_NORMAL_ATTRIBUTE + column, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceAttributes),
+                                  (void*)(offsetof(InstanceAttributes, normalMatrix) + column * sizeof(glm::vec4)));
+            glVertexAttribDivisor(INSTANCE_NORMAL_ATTRIBUTE + column, 1);
+        }
+        attached.push_back(vao);
+    }
+
+    // replaces the instances; data is optional, instances without it get defaultData. The normal matrices
+    // are computed from the transforms in one batch.
+    void Upload(const glm::mat4 *transforms, const glm::vec4 *data, unsigned int count, const glm::vec4 &defaultData = glm::vec4(1.0f))
+    {
+        if (count == 0)
+            return;
+        normalMatrices.resize(count * 3);
+        ComputeNormalMatrices(transforms, count, normalMatrices.data());
+        if (count > capacity)
+            allocate(std::max(count, capacity * 2));
+        GetRenderState().BindBuffer(GL_ARRAY_BUFFER, vbo);
+        InstanceAttributes *instances = (InstanceAttributes*)glMapBufferRange(GL_ARRAY_BUFFER, 0, count * sizeof(InstanceAttributes),
+                                                                              GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (!instances)
+        {
+            std::cout << "ERROR::INSTANCE_BUFFER::MAP_FAILED" << std::endl;
+            return;
+        }
+        for (unsigned int i = 0; i < count; i++)
+        {
+            instances[i].model = transforms[i];
+            instances[i].data = data ? data[i] : defaultData;
+            std::memcpy(instances[i].normalMatrix, &normalMatrices[3 * i], sizeof(instances[i].normalMatrix));
+        }
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+
+private:
+    unsigned int vbo = 0;
+    unsigned int capacity = 0;
+    vector<unsigned int> attached;
+    vector<glm::vec4> normalMatrices;
+
+    // the attribute pointers refer to the buffer object, so reallocating its storage keeps them valid
+    void allocate(unsigned int instances)
+    {
+        if (!vbo)
+            glGenBuffers(1, &vbo);
+        capacity = instances;
+        GetRenderState().BindBuffer(GL_ARRAY_BUFFER, vbo);
+        glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(InstanceAttributes), NULL, GL_STREAM_DRAW);
+    }
+};
+
+// instances for the main context's instanced draws
+inline InstanceBuffer& GetInstanceBuffer()
+{
+    static InstanceBuffer buffer;
+    return buffer;
+}
+#endif
@@ -0,0 +1,134 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <memory>
+
+// A small pool of worker threads shared by the engine's CPU side work (texture decoding, light binning,
+// culling). Jobs are plain std::functions pulled from a single FIFO queue.
+class JobSystem
+{
+public:
+    // threads == 0 uses one worker per hardware thread, minus the main thread
+    JobSystem(unsigned int threads = 0)
+    {
+        if (threads == 0)
+        {
+            // hardware_concurrency() is 0 when it can't tell
+            unsigned int cores = std::thread::hardware_concurrency();
+            threads = cores > 1 ? cores - 1 : 1;
+        }
+        for (unsigned int i = 0; i < threads; i++)
+            workers.emplace_back(&JobSystem::workerMain, this);
+    }
+
+    ~JobSystem()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (unsigned int i = 0; i < workers.size(); i++)
+            workers[i].join();
+    }
+
+    JobSystem(const JobSystem&) = delete;
+    JobSystem& operator=(const JobSystem&) = delete;
+
+    unsigned int WorkerCount() const { return (unsigned int)workers.size(); }
+
+    // queues a job and returns immediately
+    void Run(std::function<void()> job)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.push_back(std::move(job));
+        }
+        wake.notify_one();
+    }
+
+    // calls body(begin, end) over [0, count) in chunks of at most grain items and returns once all chunks are done.
+    // The calling thread works on chunks too, so this is safe to call with every worker busy.
+    void ParallelFor(unsigned int count, unsigned int grain, const std::function<void(unsigned int, unsigned int)> &body)
+    {
+        if (count == 0)
+            return;
+        grain = std::max(1u, grain);
+        unsigned int chunks = (count + grain - 1) / grain;
+        if (chunks == 1)
+        {
+            body(0, count);
+            return;
+        }
+
+        // helpers may only get to run after everything is done, so the shared state outlives this call
+        auto batch = std::make_shared<Batch>();
+        batch->count = count;
+        batch->grain = grain;
+        batch->chunks = chunks;
+        batch->body = &body;
+        auto work = [batch]() {
+            unsigned int chunk;
+            while ((chunk = batch->next.fetch_add(1)) < batch->chunks)
+            {
+                unsigned int begin = chunk * batch->grain;
+                (*batch->body)(begin, std::min(batch->count, begin + batch->grain));
+                batch->finished.fetch_add(1);
+            }
+        };
+        unsigned int helpers = std::min(chunks - 1, WorkerCount());
+        for (unsigned int i = 0; i < helpers; i++)
+            Run(work);
+        work();
+        // the remaining chunks are already running on workers, wait for them to drain
+        while (batch->finished.load() < chunks)
+            std::this_thread::yield();
+    }
+
+private:
+    struct Batch {
+        std::atomic<unsigned int> next{0};
+        std::atomic<unsigned int> finished{0};
+        unsigned int count, grain, chunks;
+        const std::function<void(unsigned int, unsigned int)> *body;
+    };
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    void workerMain()
+    {
+        while (true)
+        {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+                if (stopping && jobs.empty())
+                    return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+};
+
+// the engine wide pool
+inline JobSystem& GetJobSystem()
+{
+    static JobSystem jobSystem;
+    return jobSystem;
+}
+#endif
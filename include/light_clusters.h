@@ -0,0 +1,355 @@
+#ifndef LIGHT_CLUSTERS_H
+#define LIGHT_CLUSTERS_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <shader.h>
+#include <render_state.h>
+#include <uniform_buffer.h>
+#include <job_system.h>
+
+#include <vector>
+#include <cmath>
+#include <chrono>
+#include <algorithm>
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define LIGHT_CLUSTERS_SSE 1
+#endif
+using namespace std;
+
+// the cluster grid, CLUSTER_X/Y/Z in lighting.fs
+const unsigned int CLUSTER_X = 16; // screen tiles across
+const unsigned int CLUSTER_Y = 9;  // screen tiles down
+const unsigned int CLUSTER_Z = 24; // depth slices, exponentially spaced between the near and far plane
+const unsigned int CLUSTER_COUNT = CLUSTER_X * CLUSTER_Y * CLUSTER_Z;
+const unsigned int CLUSTER_LIGHT_TEXELS = 5; // texels of a light in the lights buffer texture, see Build()
+// lights are cut off where their attenuated intensity drops below this
+const float CLUSTER_LIGHT_THRESHOLD = 1.0f / 256.0f;
+
+// Clustered forward lighting. The view frustum is split into CLUSTER_X * CLUSTER_Y screen tiles times
+// CLUSTER_Z depth slices; every frame the point and spot lights are binned into the clusters their range
+// touches, on the job system with one job per depth slice. The lights, each cluster's range of the light
+// index list and the list itself go to buffer textures, and a fragment of a HAS_CLUSTERED_LIGHTS variant
+// only evaluates the lights of its own cluster.
+//
+// Begin() the frame with the camera, add its lights, Build(), then Bind() every program that shades with them.
+class LightClusters
+{
+public:
+    struct Stats {
+        unsigned int lights = 0;
+        unsigned int indices = 0;  // light references over all clusters
+        double binMilliseconds = 0.0;
+    };
+
+    LightClusters()
+    {
+        glGenBuffers(3, buffers);
+        glGenTextures(3, textures);
+        const GLenum formats[3] = { GL_RGBA32F, GL_RG32UI, GL_R32UI };
+        RenderState &state = GetRenderState();
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            state.BindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+            glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_STREAM_DRAW);
+            state.BindTexture(CLUSTER_LIGHTS_TEXTURE_UNIT + i, GL_TEXTURE_BUFFER, textures[i]);
+            glTexBuffer(GL_TEXTURE_BUFFER, formats[i], buffers[i]);
+        }
+    }
+
+    ~LightClusters()
+    {
+        RenderState &state = GetRenderState();
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            state.DeleteTexture(textures[i]);
+            state.DeleteBuffer(buffers[i]);
+        }
+    }
+
+    LightClusters(const LightClusters&) = delete;
+    LightClusters& operator=(const LightClusters&) = delete;
+
+    // starts a frame, dropping last frame's lights. The cluster bounds are only rebuilt when the projection changes.
+    void Begin(const glm::mat4 &view, const glm::mat4 &projection, float nearPlane, float farPlane, unsigned int width, unsigned int height)
+    {
+        this->view = view;
+        this->width = width;
+        this->height = height;
+        if (projection != this->projection || nearPlane != this->nearPlane || farPlane != this->farPlane)
+        {
+            this->projection = projection;
+            this->nearPlane = nearPlane;
+            this->farPlane = farPlane;
+            buildBounds();
+        }
+        lights.clear();
+    }
+
+    void AddPointLight(const PointLightBlock &light)
+    {
+        Light added;
+        added.block.position = light.position;
+        added.block.constant = light.constant;
+        added.block.linear = light.linear;
+        added.block.quadratic = light.quadratic;
+        added.block.ambient = light.ambient;
+        added.block.diffuse = light.diffuse;
+        added.block.specular = light.specular;
+        added.block.cutOff = 2.0f; // no cone
+        added.range = lightRange(added.block);
+        lights.push_back(added);
+    }
+
+    void AddSpotLight(const SpotLightBlock &light)
+    {
+        Light added;
+        added.block = light;
+        added.spot = true;
+        added.range = lightRange(light);
+        lights.push_back(added);
+    }
+
+    // bins the lights into the clusters and uploads everything
+    void Build()
+    {
+        auto start = std::chrono::steady_clock::now();
+        prepareLights();
+        GetJobSystem().ParallelFor(CLUSTER_Z, 1, [this](unsigned int begin, unsigned int end) {
+            for (unsigned int slice = begin; slice < end; slice++)
+                binSlice(slice);
+        });
+
+        // the slices' lists back to back, with every cluster's range in the grid
+        grid.resize(CLUSTER_COUNT * 2);
+        indices.clear();
+        for (unsigned int slice = 0; slice < CLUSTER_Z; slice++)
+        {
+            const SliceBins &bins = slices[slice];
+            unsigned int base = (unsigned int)indices.size();
+            for (unsigned int tile = 0; tile < CLUSTER_X * CLUSTER_Y; tile++)
+            {
+                grid[(slice * CLUSTER_X * CLUSTER_Y + tile) * 2] = base + bins.offsets[tile];
+                grid[(slice * CLUSTER_X * CLUSTER_Y + tile) * 2 + 1] = bins.counts[tile];
+            }
+            indices.insert(indices.end(), bins.indices.begin(), bins.indices.end());
+        }
+        stats.lights = (unsigned int)lights.size();
+        stats.indices = (unsigned int)indices.size();
+        stats.binMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        // per light: position, constant | ambient, linear | diffuse, quadratic | specular, cutOff | direction, outerCutOff
+        // (cutOff 2 for point lights), the members of the light structs in lighting.fs
+        texels.resize(std::max<size_t>(lights.size(), 1) * CLUSTER_LIGHT_TEXELS);
+        for (unsigned int i = 0; i < lights.size(); i++)
+        {
+            const SpotLightBlock &light = lights[i].block;
+            glm::vec4 *texel = &texels[i * CLUSTER_LIGHT_TEXELS];
+            texel[0] = glm::vec4(light.position, light.constant);
+            texel[1] = glm::vec4(light.ambient, light.linear);
+            texel[2] = glm::vec4(light.diffuse, light.quadratic);
+            texel[3] = glm::vec4(light.specular, light.cutOff);
+            texel[4] = glm::vec4(light.direction, light.outerCutOff);
+        }
+        if (indices.empty())
+            indices.push_back(0);
+        upload(0, texels.data(), texels.size() * sizeof(glm::vec4));
+        upload(1, grid.data(), grid.size() * sizeof(unsigned int));
+        upload(2, indices.data(), indices.size() * sizeof(unsigned int));
+    }
+
+    // binds the buffer textures and sets the cluster lookup of shader, which has to be in use
+    void Bind(Shader &shader) const
+    {
+        RenderState &state = GetRenderState();
+        for (unsigned int i = 0; i < 3; i++)
+            state.BindTexture(CLUSTER_LIGHTS_TEXTURE_UNIT + i, GL_TEXTURE_BUFFER, textures[i]);
+        // tile from gl_FragCoord, slice = log(view depth) * z + w
+        float depthScale = CLUSTER_Z / std::log(farPlane / nearPlane);
+        shader.setVec4("clusterScale"_uniform, (float)CLUSTER_X / width, (float)CLUSTER_Y / height, depthScale, -std::log(nearPlane) * depthScale);
+    }
+
+    const Stats& GetStats() const { return stats; }
+
+private:
+    struct Light {
+        SpotLightBlock block = {}; // point lights leave the cone members unused
+        float range = 0.0f;
+        bool spot = false;
+    };
+
+    // view space bounds of a cluster
+    struct ClusterBounds {
+        glm::vec3 min, max;
+        glm::vec3 center;
+        float radius;
+    };
+
+    // the lights of one depth slice: every tile's count and offset into indices
+    struct SliceBins {
+        unsigned int counts[CLUSTER_X * CLUSTER_Y];
+        unsigned int offsets[CLUSTER_X * CLUSTER_Y];
+        vector<unsigned int> indices;
+        vector<unsigned int> candidates; // lights overlapping the slice's depth range
+    };
+
+    glm::mat4 view = glm::mat4(1.0f), projection = glm::mat4(0.0f);
+    float nearPlane = 0.0f, farPlane = 0.0f;
+    unsigned int width = 1, height = 1;
+    unsigned int buffers[3] = {}, textures[3] = {}; // lights, grid, indices
+    vector<Light> lights;
+    vector<ClusterBounds> bounds = vector<ClusterBounds>(CLUSTER_COUNT);
+    SliceBins slices[CLUSTER_Z];
+    // the lights in view space, structure of arrays for the SSE tests
+    vector<float> lightX, lightY, lightZ, lightRadius;
+    vector<glm::vec3> lightDirection; // view space spot direction
+    vector<glm::vec4> texels;
+    vector<unsigned int> grid, indices;
+    Stats stats;
+
+    // distance at which the attenuated diffuse or specular intensity falls below CLUSTER_LIGHT_THRESHOLD
+    static float lightRange(const SpotLightBlock &light)
+    {
+        glm::vec3 peak = glm::max(light.diffuse, light.specular);
+        float intensity = std::max(peak.r, std::max(peak.g, peak.b));
+        // constant + linear * d + quadratic * d^2 = intensity / threshold
+        float c = light.constant - intensity / CLUSTER_LIGHT_THRESHOLD;
+        if (c >= 0.0f)
+            return 0.0f;
+        if (light.quadratic <= 0.0f)
+            return light.linear > 0.0f ? -c / light.linear : 1e30f;
+        return (-light.linear + std::sqrt(light.linear * light.linear - 4.0f * light.quadratic * c)) / (2.0f * light.quadratic);
+    }
+
+    static float sliceDepth(unsigned int slice, float nearPlane, float farPlane)
+    {
+        return nearPlane * std::pow(farPlane / nearPlane, (float)slice / CLUSTER_Z);
+    }
+
+    // view space bounding boxes of every cluster, from the corners of its tile at the slice's depths
+    void buildBounds()
+    {
+        glm::mat4 inverseProjection = glm::inverse(projection);
+        for (unsigned int slice = 0; slice < CLUSTER_Z; slice++)
+        {
+            float nearDepth = sliceDepth(slice, nearPlane, farPlane);
+            float farDepth = sliceDepth(slice + 1, nearPlane, farPlane);
+            for (unsigned int y = 0; y < CLUSTER_Y; y++)
+                for (unsigned int x = 0; x < CLUSTER_X; x++)
+                {
+                    ClusterBounds &cluster = bounds[(slice * CLUSTER_Y + y) * CLUSTER_X + x];
+                    cluster.min = glm::vec3(1e30f);
+                    cluster.max = glm::vec3(-1e30f);
+                    for (unsigned int corner = 0; corner < 4; corner++)
+                    {
+                        float ndcX = -1.0f + 2.0f * (x + (corner & 1)) / CLUSTER_X;
+                        float ndcY = -1.0f + 2.0f * (y + (corner >> 1)) / CLUSTER_Y;
+                        glm::vec4 onNear = inverseProjection * glm::vec4(ndcX, ndcY, -1.0f, 1.0f);
+                        glm::vec3 ray = glm::vec3(onNear) / onNear.w;
+                        ray /= -ray.z; // at view depth 1
+                        for (float depth : { nearDepth, farDepth })
+                        {
+                            cluster.min = glm::min(cluster.min, ray * depth);
+                            cluster.max = glm::max(cluster.max, ray * depth);
+                        }
+                    }
+                    cluster.center = (cluster.min + cluster.max) * 0.5f;
+                    cluster.radius = glm::length(cluster.max - cluster.center);
+                }
+        }
+    }
+
+    void prepareLights()
+    {
+        lightX.resize(lights.size());
+        lightY.resize(lights.size());
+        lightZ.resize(lights.size());
+        lightRadius.resize(lights.size());
+        lightDirection.resize(lights.size());
+        for (unsigned int i = 0; i < lights.size(); i++)
+        {
+            glm::vec3 position = glm::vec3(view * glm::vec4(lights[i].block.position, 1.0f));
+            lightX[i] = position.x;
+            lightY[i] = position.y;
+            lightZ[i] = position.z;
+            lightRadius[i] = lights[i].range;
+            if (lights[i].spot)
+                lightDirection[i] = glm::normalize(glm::mat3(view) * lights[i].block.direction);
+        }
+    }
+
+    // false if the cone of spot light i certainly misses the cluster's bounding sphere
+    bool coneOverlaps(unsigned int i, const ClusterBounds &cluster) const
+    {
+        const SpotLightBlock &light = lights[i].block;
+        glm::vec3 toCluster = cluster.center - glm::vec3(lightX[i], lightY[i], lightZ[i]);
+        float lengthSquared = glm::dot(toCluster, toCluster);
+        float along = glm::dot(toCluster, lightDirection[i]);
+        float cosine = light.outerCutOff;
+        float sine = std::sqrt(std::max(0.0f, 1.0f - cosine * cosine));
+        // distance from the cluster center to the cone's side
+        float distance = cosine * std::sqrt(std::max(0.0f, lengthSquared - along * along)) - along * sine;
+        return !(distance > cluster.radius || along > cluster.radius + lights[i].range || along < -cluster.radius);
+    }
+
+    void binSlice(unsigned int slice)
+    {
+        SliceBins &bins = slices[slice];
+        bins.indices.clear();
+        bins.candidates.clear();
+        // only lights reaching into the slice's depth range are tested against its tiles
+        float nearDepth = sliceDepth(slice, nearPlane, farPlane);
+        float farDepth = sliceDepth(slice + 1, nearPlane, farPlane);
+        for (unsigned int i = 0; i < lights.size(); i++)
+            if (-lightZ[i] + lightRadius[i] >= nearDepth && -lightZ[i] - lightRadius[i] <= farDepth)
+                bins.candidates.push_back(i);
+
+        for (unsigned int tile = 0; tile < CLUSTER_X * CLUSTER_Y; tile++)
+        {
+            const ClusterBounds &cluster = bounds[slice * CLUSTER_X * CLUSTER_Y + tile];
+            bins.offsets[tile] = (unsigned int)bins.indices.size();
+            unsigned int c = 0;
+#ifdef LIGHT_CLUSTERS_SSE
+            // sphere against box, four candidates at a time: squared distance from the center to the box
+            __m128 minX = _mm_set1_ps(cluster.min.x), minY = _mm_set1_ps(cluster.min.y), minZ = _mm_set1_ps(cluster.min.z);
+            __m128 maxX = _mm_set1_ps(cluster.max.x), maxY = _mm_set1_ps(cluster.max.y), maxZ = _mm_set1_ps(cluster.max.z);
+            __m128 zero = _mm_setzero_ps();
+            for (; c + 4 <= bins.candidates.size(); c += 4)
+            {
+                const unsigned int *index = &bins.candidates[c];
+                __m128 x = _mm_setr_ps(lightX[index[0]], lightX[index[1]], lightX[index[2]], lightX[index[3]]);
+                __m128 y = _mm_setr_ps(lightY[index[0]], lightY[index[1]], lightY[index[2]], lightY[index[3]]);
+                __m128 z = _mm_setr_ps(lightZ[index[0]], lightZ[index[1]], lightZ[index[2]], lightZ[index[3]]);
+                __m128 r = _mm_setr_ps(lightRadius[index[0]], lightRadius[index[1]], lightRadius[index[2]], lightRadius[index[3]]);
+                __m128 dx = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minX, x), _mm_sub_ps(x, maxX)), zero);
+                __m128 dy = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minY, y), _mm_sub_ps(y, maxY)), zero);
+                __m128 dz = _mm_max_ps(_mm_max_ps(_mm_sub_ps(minZ, z), _mm_sub_ps(z, maxZ)), zero);
+                __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+                int hits = _mm_movemask_ps(_mm_cmple_ps(distance, _mm_mul_ps(r, r)));
+                for (unsigned int lane = 0; lane < 4; lane++)
+                    if ((hits & (1 << lane)) && (!lights[index[lane]].spot || coneOverlaps(index[lane], cluster)))
+                        bins.indices.push_back(index[lane]);
+            }
+#endif
+            for (; c < bins.candidates.size(); c++)
+            {
+                unsigned int i = bins.candidates[c];
+                glm::vec3 center(lightX[i], lightY[i], lightZ[i]);
+                glm::vec3 delta = glm::max(glm::max(cluster.min - center, center - cluster.max), glm::vec3(0.0f));
+                if (glm::dot(delta, delta) <= lightRadius[i] * lightRadius[i] && (!lights[i].spot || coneOverlaps(i, cluster)))
+                    bins.indices.push_back(i);
+            }
+            bins.counts[tile] = (unsigned int)bins.indices.size() - bins.offsets[tile];
+        }
+    }
+
+    // replaces the contents of buffer i, orphaning the storage the GPU may still read
+    void upload(unsigned int i, const void *data, size_t size)
+    {
+        GetRenderState().BindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STREAM_DRAW);
+    }
+};
+#endif
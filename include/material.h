@@ -0,0 +1,113 @@
+#ifndef MATERIAL_H
+#define MATERIAL_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <shader.h>
+#include <render_state.h>
+#include <uniform_buffer.h>
+
+#include <string>
+#include <vector>
+using namespace std;
+
+struct Texture {
+    unsigned int id;
+    string type;
+    string path;
+    int virtualRegion = -1; // region in the VirtualTexture when the texture is streamed instead of resident
+};
+
+// The textures and constants a group of meshes is drawn with, resolved once at import. Every texture has a
+// fixed slot whose unit every program's sampler is pointed at when it links (see *_TEXTURE_UNIT in shader.h),
+// and the scalar parameters live in a MaterialBlock in the model's uniform buffer. Applying a material is
+// then just its binding list, with nothing looked up or compared per draw.
+class Material
+{
+public:
+    Material() : sortID(nextSortID()) {}
+
+    // a texture in one of the slots; virtual textures are sampled through the page table instead
+    void SetTexture(unsigned int unit, const Texture &texture)
+    {
+        if (texture.virtualRegion >= 0)
+        {
+            if (unit == DIFFUSE_TEXTURE_UNIT)
+                diffuseRegion = texture.virtualRegion;
+            else if (unit == PACKED_TEXTURE_UNIT)
+                packedRegion = texture.virtualRegion;
+        }
+        else if (texture.id != 0)
+            bindings.push_back({ unit, texture.id });
+        normalMap = normalMap || unit == NORMAL_TEXTURE_UNIT;
+        packedMap = packedMap || unit == PACKED_TEXTURE_UNIT;
+    }
+
+    // the MaterialBlock of this material, at offset in buffer
+    void SetBlock(unsigned int buffer, GLintptr offset, const MaterialBlock &block)
+    {
+        blockBuffer = buffer;
+        blockOffset = offset;
+        this->block = block;
+    }
+
+    // binds everything the material needs to shader, which has to be in use
+    void Apply(Shader &shader) const
+    {
+        RenderState &state = GetRenderState();
+        for (unsigned int i = 0; i < bindings.size(); i++)
+            state.BindTexture(bindings[i].unit, GL_TEXTURE_2D, bindings[i].texture);
+        if (blockBuffer)
+            state.BindBufferRange(GL_UNIFORM_BUFFER, MATERIAL_BLOCK_BINDING, blockBuffer, blockOffset, sizeof(MaterialBlock));
+        shader.setInt("vtDiffuseRegion"_uniform, diffuseRegion);
+        shader.setInt("vtPackedRegion"_uniform, packedRegion);
+    }
+
+    // the uniforms Apply() sets, as the material part of a multi-draw record: x, y virtual texture regions,
+    // z shininess, w specular (see HAS_DRAW_RECORDS in lighting.fs)
+    glm::vec4 DrawRecord() const
+    {
+        return glm::vec4((float)diffuseRegion, (float)packedRegion, block.shininess, block.specular);
+    }
+
+    // true if both materials bind the same textures, so draws of either can share one multi-draw
+    bool SameBindings(const Material &other) const
+    {
+        if (bindings.size() != other.bindings.size())
+            return false;
+        for (unsigned int i = 0; i < bindings.size(); i++)
+            if (bindings[i].unit != other.bindings[i].unit || bindings[i].texture != other.bindings[i].texture)
+                return false;
+        return true;
+    }
+
+    // which maps the material has, for picking its shader variant
+    bool HasNormalMap() const { return normalMap; }
+    bool HasPackedMap() const { return packedMap; }
+    // small number identifying the material in render queue sort keys
+    unsigned int SortID() const { return sortID; }
+
+private:
+    struct Binding {
+        unsigned int unit;
+        unsigned int texture;
+    };
+
+    vector<Binding> bindings;
+    unsigned int blockBuffer = 0;
+    GLintptr blockOffset = 0;
+    MaterialBlock block = {};
+    int diffuseRegion = -1; // virtual texture regions, -1 when the texture is bound regularly
+    int packedRegion  = -1;
+    bool normalMap = false;
+    bool packedMap = false;
+    unsigned int sortID;
+
+    static unsigned int nextSortID()
+    {
+        static unsigned int next = 1; // 0 is no material
+        return next++;
+    }
+};
+#endif
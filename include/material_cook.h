@@ -0,0 +1,159 @@
+#ifndef MATERIAL_COOK_H
+#define MATERIAL_COOK_H
+
+#include <others/stb_image.h>
+#include <glm/glm.hpp>
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+using namespace std;
+
+// Channel layout of the packed material texture (texture_packed1 in lighting.fs):
+//   R: specular intensity, G: ambient occlusion, B: roughness, A: unused
+// so the lighting shader gets every scalar material input from a single fetch.
+const int PACKED_SPECULAR  = 0;
+const int PACKED_OCCLUSION = 1;
+const int PACKED_ROUGHNESS = 2;
+
+// the scalar maps of one material, any of which may be missing
+struct PackedMaterialSources {
+    string specular;          // specular intensity, converted to luminance
+    string occlusion;         // ambient occlusion, red channel
+    string roughness;         // roughness (or glossiness, see roughnessIsGloss), red channel
+    bool roughnessIsGloss = false;
+    float defaultSpecular = 1.0f; // used when there's no specular map
+};
+
+// A cooked packed material: RGBA8 pixels in the same row order stb_image produced for the sources.
+struct PackedMaterial {
+    int width = 0;
+    int height = 0;
+    vector<unsigned char> pixels;
+};
+
+namespace detail
+{
+    // one channel of an image, bilinearly resampled to width x height
+    inline bool loadChannel(const string &path, int channel, bool luminance, int width, int height, vector<unsigned char> &out)
+    {
+        int w, h, n;
+        unsigned char *data = stbi_load(path.c_str(), &w, &h, &n, 4);
+        if (!data)
+        {
+            std::cout << "Texture failed to load at path: " << path << std::endl;
+            return false;
+        }
+        out.resize((size_t)width * height);
+        for (int y = 0; y < height; y++)
+        {
+            float sy = ((float)y + 0.5f) * h / height - 0.5f;
+            int y0 = std::max(0, (int)std::floor(sy)), y1 = std::min(h - 1, y0 + 1);
+            float fy = glm::clamp(sy - (float)y0, 0.0f, 1.0f);
+            for (int x = 0; x < width; x++)
+            {
+                float sx = ((float)x + 0.5f) * w / width - 0.5f;
+                int x0 = std::max(0, (int)std::floor(sx)), x1 = std::min(w - 1, x0 + 1);
+                float fx = glm::clamp(sx - (float)x0, 0.0f, 1.0f);
+                auto sample = [&](int px, int py) {
+                    const unsigned char *p = data + ((size_t)py * w + px) * 4;
+                    return luminance ? 0.2126f * p[0] + 0.7152f * p[1] + 0.0722f * p[2] : (float)p[channel];
+                };
+                float top = glm::mix(sample(x0, y0), sample(x1, y0), fx);
+                float bottom = glm::mix(sample(x0, y1), sample(x1, y1), fx);
+                out[(size_t)y * width + x] = (unsigned char)(glm::mix(top, bottom, fy) + 0.5f);
+            }
+        }
+        stbi_image_free(data);
+        return true;
+    }
+
+    inline bool isStale(const string &cooked, const PackedMaterialSources &sources)
+    {
+        std::error_code error;
+        if (!std::filesystem::exists(cooked, error))
+            return true;
+        auto cookedTime = std::filesystem::last_write_time(cooked, error);
+        for (const string *source : { &sources.specular, &sources.occlusion, &sources.roughness })
+            if (!source->empty() && std::filesystem::exists(*source, error) && std::filesystem::last_write_time(*source, error) > cookedTime)
+                return true;
+        return false;
+    }
+}
+
+// Cooks a material's scalar maps into one channel packed texture, cached at cookedPath ("EMT1" header,
+// width, height, then RGBA8 rows). The cache is reused until one of the sources is newer.
+inline bool CookPackedMaterial(const PackedMaterialSources &sources, const string &cookedPath, PackedMaterial &material)
+{
+    if (!detail::isStale(cookedPath, sources))
+    {
+        std::ifstream file(cookedPath, std::ios::binary);
+        char magic[4];
+        int32_t size[2] = { 0, 0 };
+        file.read(magic, 4);
+        file.read((char*)size, sizeof(size));
+        if (file && std::memcmp(magic, "EMT1", 4) == 0 && size[0] > 0 && size[1] > 0)
+        {
+            material.width = size[0];
+            material.height = size[1];
+            material.pixels.resize((size_t)size[0] * size[1] * 4);
+            file.read((char*)material.pixels.data(), material.pixels.size());
+            if (file)
+                return true;
+        }
+    }
+
+    // the packed texture is as large as the largest source, constant materials are a single texel
+    std::cout << "Cooking packed material: " << cookedPath << std::endl;
+    material.width = 1;
+    material.height = 1;
+    for (const string *source : { &sources.specular, &sources.occlusion, &sources.roughness })
+    {
+        int w, h, n;
+        if (!source->empty() && stbi_info(source->c_str(), &w, &h, &n))
+        {
+            material.width = std::max(material.width, w);
+            material.height = std::max(material.height, h);
+        }
+    }
+
+    size_t texels = (size_t)material.width * material.height;
+    vector<unsigned char> specular, occlusion, roughness;
+    if (sources.specular.empty() || !detail::loadChannel(sources.specular, 0, true, material.width, material.height, specular))
+        specular.assign(texels, (unsigned char)(glm::clamp(sources.defaultSpecular, 0.0f, 1.0f) * 255.0f + 0.5f));
+    if (sources.occlusion.empty() || !detail::loadChannel(sources.occlusion, 0, false, material.width, material.height, occlusion))
+        occlusion.assign(texels, 255);
+    if (sources.roughness.empty() || !detail::loadChannel(sources.roughness, 0, false, material.width, material.height, roughness))
+        roughness.assign(texels, sources.roughnessIsGloss ? 255 : 0);
+    if (sources.roughnessIsGloss)
+        for (size_t i = 0; i < texels; i++)
+            roughness[i] = 255 - roughness[i];
+
+    material.pixels.resize(texels * 4);
+    for (size_t i = 0; i < texels; i++)
+    {
+        material.pixels[i * 4 + PACKED_SPECULAR] = specular[i];
+        material.pixels[i * 4 + PACKED_OCCLUSION] = occlusion[i];
+        material.pixels[i * 4 + PACKED_ROUGHNESS] = roughness[i];
+        material.pixels[i * 4 + 3] = 255;
+    }
+
+    // without a cache the freshly cooked pixels are used all the same
+    std::error_code error;
+    std::filesystem::create_directories(std::filesystem::path(cookedPath).parent_path(), error);
+    std::ofstream file(cookedPath, std::ios::binary | std::ios::trunc);
+    int32_t size[2] = { material.width, material.height };
+    file.write("EMT1", 4);
+    file.write((const char*)size, sizeof(size));
+    file.write((const char*)material.pixels.data(), material.pixels.size());
+    if (!file)
+        std::cout << "ERROR::MATERIAL_COOK::WRITE_FAILED: " << cookedPath << std::endl;
+    return true;
+}
+#endif
@@ -6,91 +6,81 @@
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
-#include <shader.h>
+#include <render_state.h>
+#include <geometry_pool.h>
+#include <bounds.h>
 
 #include <string>
 #include <vector>
 using namespace std;
 
-struct Vertex {
-    // position
-    glm::vec3 Position;
-    // normal
-    glm::vec3 Normal;
-    // texCoords
-    glm::vec2 TexCoords;
-    // tangent
-    glm::vec3 Tangent;
-    // bitangent
-    glm::vec3 Bitangent;
-};
-
-struct Texture {
-    unsigned int id;
-    string type;
-    string path;
-};
-
 class Mesh {
 public:
     // mesh Data
     vector<Vertex>       vertices;
     vector<unsigned int> indices;
-    vector<Texture>      textures;
+    unsigned int materialIndex; // the model's Material this mesh is drawn with
     unsigned int VAO;
+    unsigned int instancedVAO;  // VAO, or in a pool its twin without aDrawID: for instanced draws
+    unsigned int positionVAO;   // positions only, same indices and range: for depth and shadow passes
+    GeometryRange range;        // the mesh's indices in VAO's buffers
+    Bounds bounds;              // model space, set by the loader
 
-    // constructor
-    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, vector<Texture> textures)
+    // constructor, with a pool the mesh is appended to its buffers instead of getting its own
+    Mesh(vector<Vertex> vertices, vector<unsigned int> indices, unsigned int materialIndex = 0, GeometryPool *pool = nullptr)
     {
         this->vertices = vertices;
         this->indices = indices;
-        this->textures = textures;
+        this->materialIndex = materialIndex;
 
+        if (pool)
+        {
+            range = pool->Add(vertices, indices);
+            VAO = pool->VertexArray();
+            instancedVAO = pool->InstancedArray();
+            positionVAO = pool->PositionArray();
+            VBO = EBO = positionVBO = 0;
+            return;
+        }
         // now that we have all the required data, set the vertex buffers and its attribute pointers.
+        range.count = (unsigned int)indices.size();
         setupMesh();
+        instancedVAO = VAO;
     }
 
-    // render the mesh
-    void Draw(Shader &shader) 
+    // render the mesh with whatever program and material are applied. The vertex array is left bound for the next draw.
+    void Draw() 
     {
-        // bind appropriate textures
-        unsigned int diffuseNr  = 1;
-        unsigned int specularNr = 1;
-        unsigned int normalNr   = 1;
-        unsigned int heightNr   = 1;
-        for(unsigned int i = 0; i < textures.size(); i++)
-        {
-            glActiveTexture(GL_TEXTURE0 + i); // active proper texture unit before binding
-            // retrieve texture number (the N in diffuse_textureN)
-            string number;
-            string name = textures[i].type;
-            if(name == "texture_diffuse")
-                number = std::to_string(diffuseNr++);
-            else if(name == "texture_specular")
-                number = std::to_string(specularNr++); // transfer unsigned int to stream
-            else if(name == "texture_normal")
-                number = std::to_string(normalNr++); // transfer unsigned int to stream
-             else if(name == "texture_height")
-                number = std::to_string(heightNr++); // transfer unsigned int to stream
-
-            // now set the sampler to the correct texture unit
-            glUniform1i(glGetUniformLocation(shader.ID, (name + number).c_str()), i);
-            // and finally bind the texture
-            glBindTexture(GL_TEXTURE_2D, textures[i].id);
-        }
-        
-        // draw mesh
-        glBindVertexArray(VAO);
-        glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_INT, 0);
-        glBindVertexArray(0);
-
-        // always good practice to set everything back to defaults once configured.
-        glActiveTexture(GL_TEXTURE0);
+        GetRenderState().BindVertexArray(VAO);
+        glDrawElementsBaseVertex(GL_TRIANGLES, range.count, GL_UNSIGNED_INT, (void*)(range.firstIndex * sizeof(unsigned int)), range.baseVertex);
+    }
+
+    // depth only: the mesh through its position stream, with whatever depth program is in use
+    void DrawDepth()
+    {
+        GetRenderState().BindVertexArray(positionVAO);
+        glDrawElementsBaseVertex(GL_TRIANGLES, range.count, GL_UNSIGNED_INT, (void*)(range.firstIndex * sizeof(unsigned int)), range.baseVertex);
+    }
+
+    // depth only, instances copies; the position array has to be attached to the InstanceBuffer
+    void DrawDepthInstanced(unsigned int instances)
+    {
+        GetRenderState().BindVertexArray(positionVAO);
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, range.count, GL_UNSIGNED_INT, (void*)(range.firstIndex * sizeof(unsigned int)),
+                                          instances, range.baseVertex);
+    }
+
+    // renders instances copies of the mesh, instancedVAO has to be attached to the InstanceBuffer
+    void DrawInstanced(unsigned int instances)
+    {
+        GetRenderState().BindVertexArray(instancedVAO);
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, range.count, GL_UNSIGNED_INT, (void*)(range.firstIndex * sizeof(unsigned int)),
+                                          instances, range.baseVertex);
     }
 
 private:
     // render data 
-    unsigned int VBO, EBO;
+    unsigned int VBO, EBO, positionVBO;
 
     // initializes all the buffer objects/arrays
     void setupMesh()
@@ -100,35 +90,35 @@ private:
         glGenBuffers(1, &VBO);
         glGenBuffers(1, &EBO);
 
-        glBindVertexArray(VAO);
+        RenderState &state = GetRenderState();
+        state.BindVertexArray(VAO);
         // load data into vertex buffers
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        state.BindBuffer(GL_ARRAY_BUFFER, VBO);
         // A great thing about structs is that their memory layout is sequential for all its items.
         // The effect is that we can simply pass a pointer to the struct and it translates perfectly to a glm::vec3/2 array which
         // again translates to 3/2 floats which translates to a byte array.
         glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), &vertices[0], GL_STATIC_DRAW);  
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        state.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
         glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
 
         // set the vertex attribute pointers
-        // vertex Positions
-        glEnableVertexAttribArray(0);	
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)0);
-        // vertex normals
-        glEnableVertexAttribArray(1);	
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Normal));
-        // vertex texture coords
-        glEnableVertexAttribArray(2);	
-        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, TexCoords));
-        // vertex tangent
-        glEnableVertexAttribArray(3);
-        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Tangent));
-        // vertex bitangent
-        glEnableVertexAttribArray(4);
-        glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Bitangent));
-
-        glBindVertexArray(0);
+        SetupVertexAttributes();
+
+        // the position stream, sharing the index buffer
+        vector<glm::vec3> positions(vertices.size());
+        for (size_t i = 0; i < vertices.size(); i++)
+            positions[i] = vertices[i].Position;
+        glGenVertexArrays(1, &positionVAO);
+        glGenBuffers(1, &positionVBO);
+        state.BindVertexArray(positionVAO);
+        state.BindBuffer(GL_ARRAY_BUFFER, positionVBO);
+        glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(glm::vec3), positions.data(), GL_STATIC_DRAW);
+        state.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+        SetupPositionAttribute();
+
+        // so that no later GL_ELEMENT_ARRAY_BUFFER bind can end up in this vertex array
+        state.BindVertexArray(0);
     }
 };
 #endif
\ No newline at end of file
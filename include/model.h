@@ -11,7 +11,19 @@
 #include <assimp/postprocess.h>
 
 #include <mesh.h>
+#include <material.h>
 #include <shader.h>
+#include <render_state.h>
+#include <virtual_texture.h>
+#include <texture_uploader.h>
+#include <material_cook.h>
+#include <uniform_buffer.h>
+#include <shader_variants.h>
+#include <render_queue.h>
+#include <instance_buffer.h>
+#include <bounds.h>
+#include <frustum_culler.h>
+#include <occlusion_culler.h>
 
 #include <string>
 #include <fstream>
@@ -19,21 +31,41 @@
 #include <iostream>
 #include <map>
 #include <vector>
+#include <chrono>
+#include <functional>
 using namespace std;
 
-unsigned int TextureFromFile(const char *path, const string &directory, bool gamma = false);
+// cooked packed material textures are cached here
+const char *const MATERIAL_CACHE_DIRECTORY = "data/cache/materials";
+// specular exponent of materials that don't define one
+const float DEFAULT_SHININESS = 32.0f;
+
+unsigned int TextureFromFile(const char *path, const string &directory, bool gamma = false, TextureUploader *uploader = nullptr);
+unsigned int TextureFromPixels(const unsigned char *pixels, int width, int height);
 
 class Model 
 {
 public:
     // model data 
     vector<Texture> textures_loaded;	// stores all the textures loaded so far, optimization to make sure textures aren't loaded more than once.
+    map<unsigned int, Texture> packed_loaded; // packed material texture per assimp material index
+    map<unsigned int, float> materialSpecular; // specular intensity of materials without a packed texture
+    vector<Material> materials; // per assimp material index
     vector<Mesh>    meshes;
+    Bounds bounds;                    // model space, around every mesh
+    vector<OccluderMesh> occluders;   // per mesh, simplified for the OcclusionCuller; empty until BuildOccluders()
     string directory;
     bool gammaCorrection;
+    VirtualTexture *virtualTexture;   // when set, diffuse and specular maps are streamed through it instead of loaded
+    TextureUploader *textureUploader; // when set, textures are decoded and uploaded asynchronously through its PBO ring
+    GeometryPool *geometryPool;       // when set, meshes are appended to its buffers and can be drawn by multi-draw indirect
+    unsigned int materialUBO = 0;     // one MaterialBlock per assimp material, materialStride bytes apart
+    size_t materialStride = 0;
 
     // constructor, expects a filepath to a 3D model.
-    Model(string const &path, bool gamma = false) : gammaCorrection(gamma)
+    Model(string const &path, bool gamma = false, VirtualTexture *virtualTexture = nullptr, TextureUploader *textureUploader = nullptr,
+          GeometryPool *geometryPool = nullptr)
+        : gammaCorrection(gamma), virtualTexture(virtualTexture), textureUploader(textureUploader), geometryPool(geometryPool)
     {
         loadModel(path);
     }
@@ -41,11 +73,189 @@ public:
     // draws the model, and thus all its meshes
     void Draw(Shader &shader)
     {
+        unsigned int appliedMaterial = ~0u;
+        for(unsigned int i = 0; i < meshes.size(); i++)
+        {
+            // consecutive meshes of one material share its bindings
+            if(meshes[i].materialIndex != appliedMaterial && meshes[i].materialIndex < materials.size())
+            {
+                appliedMaterial = meshes[i].materialIndex;
+                materials[appliedMaterial].Apply(shader);
+            }
+            meshes[i].Draw();
+        }
+    }
+
+    // queues every mesh with the cheapest variant matching the scene's lights and the mesh's maps. Pooled
+    // meshes use the draw record variants when the queue draws them with multi-draw indirect.
+    void Submit(RenderQueue &queue, ShaderVariants &variants, ShaderPermutation scene, const glm::mat4 &model)
+    {
+        scene.drawRecords = geometryPool && queue.MultiDrawIndirect();
+        for(unsigned int i = 0; i < meshes.size(); i++)
+        {
+            DrawPacket packet;
+            packet.shader = &variants.Get(permutation(meshes[i], scene));
+            packet.material = meshes[i].materialIndex < materials.size() ? &materials[meshes[i].materialIndex] : nullptr;
+            packet.vao = meshes[i].VAO;
+            packet.positionVAO = meshes[i].positionVAO;
+            packet.count = meshes[i].range.count;
+            packet.firstIndex = meshes[i].range.firstIndex;
+            packet.baseVertex = meshes[i].range.baseVertex;
+            packet.drawRecord = scene.drawRecords;
+            packet.model = model;
+            packet.bounds = meshes[i].bounds.Transformed(model);
+            queue.Submit(packet);
+        }
+    }
+
+    // draws count copies of the model with one instanced draw per mesh: transforms[i] places copy i and
+    // instanceData[i] tints it (white without instanceData). Meshes use the instanced variant of their
+    // permutation; prepare is called after every program change, like in RenderQueue::Execute(). With a
+    // frustum, copies whose bounds lie outside it are dropped first. Returns the number of copies drawn.
+    unsigned int DrawInstanced(ShaderVariants &variants, ShaderPermutation scene, const glm::mat4 *transforms, unsigned int count,
+                               const glm::vec4 *instanceData, const function<void(Shader&)> &prepare, const Frustum *frustum = nullptr)
+    {
+        if(frustum)
+            cullInstances(*frustum, transforms, instanceData, count);
+        if(count == 0)
+            return 0;
+        InstanceBuffer &instances = GetInstanceBuffer();
+        for(unsigned int i = 0; i < meshes.size(); i++)
+            instances.Attach(meshes[i].instancedVAO);
+        instances.Upload(transforms, instanceData, count);
+
+        scene.drawRecords = false;
+        scene.instanced = true;
+        Shader *shader = nullptr;
+        unsigned int appliedMaterial = ~0u;
+        for(unsigned int i = 0; i < meshes.size(); i++)
+        {
+            Shader &meshShader = variants.Get(permutation(meshes[i], scene));
+            if(&meshShader != shader)
+            {
+                shader = &meshShader;
+                shader->use();
+                prepare(*shader);
+                appliedMaterial = ~0u;
+            }
+            if(meshes[i].materialIndex != appliedMaterial && meshes[i].materialIndex < materials.size())
+            {
+                appliedMaterial = meshes[i].materialIndex;
+                materials[appliedMaterial].Apply(*shader);
+            }
+            meshes[i].DrawInstanced(count);
+        }
+        return count;
+    }
+
+    // depth only, for shadow and depth passes: every mesh placed by model with depthShader, skipping meshes
+    // outside frustum when one is given. Returns the number of meshes drawn.
+    unsigned int DrawDepth(Shader &depthShader, const glm::mat4 &model, const Frustum *frustum = nullptr)
+    {
+        depthShader.use();
+        depthShader.setMat4("model"_uniform, model);
+        unsigned int drawn = 0;
+        for(unsigned int i = 0; i < meshes.size(); i++)
+        {
+            if(frustum && !frustum->Intersects(meshes[i].bounds.Transformed(model)))
+                continue;
+            meshes[i].DrawDepth();
+            drawn++;
+        }
+        return drawn;
+    }
+
+    // depth only, count copies placed by transforms with an instanced depthShader; copies outside frustum
+    // are dropped first, like DrawInstanced(). Returns the number of copies drawn.
+    unsigned int DrawDepthInstanced(Shader &depthShader, const glm::mat4 *transforms, unsigned int count, const Frustum *frustum = nullptr)
+    {
+        const glm::vec4 *instanceData = nullptr;
+        if(frustum)
+            cullInstances(*frustum, transforms, instanceData, count);
+        if(count == 0)
+            return 0;
+        InstanceBuffer &instances = GetInstanceBuffer();
+        for(unsigned int i = 0; i < meshes.size(); i++)
+            instances.Attach(meshes[i].positionVAO);
+        instances.Upload(transforms, nullptr, count);
+        depthShader.use();
+        for(unsigned int i = 0; i < meshes.size(); i++)
+            meshes[i].DrawDepthInstanced(count);
+        return count;
+    }
+
+    // makes the model an occluder: simplifies every mesh to at most maxTriangles for SubmitOccluders()
+    void BuildOccluders(unsigned int maxTriangles = OCCLUDER_TRIANGLES)
+    {
+        occluders.clear();
+        for(unsigned int i = 0; i < meshes.size(); i++)
+            occluders.push_back(SimplifyOccluder(meshes[i].vertices, meshes[i].indices, maxTriangles));
+    }
+
+    // adds the simplified meshes to a frame of the occlusion culler, placed by model
+    void SubmitOccluders(OcclusionCuller &culler, const glm::mat4 &model) const
+    {
+        for(unsigned int i = 0; i < occluders.size(); i++)
+            culler.AddOccluder(occluders[i], model);
+    }
+
+    // the distinct variants Submit() (DrawInstanced() with scene.instanced) will use for a scene, to prewarm them
+    vector<ShaderPermutation> Permutations(const ShaderPermutation &scene) const
+    {
+        vector<ShaderPermutation> permutations;
         for(unsigned int i = 0; i < meshes.size(); i++)
-            meshes[i].Draw(shader);
+        {
+            ShaderPermutation mesh = permutation(meshes[i], scene);
+            bool known = false;
+            for(unsigned int j = 0; j < permutations.size() && !known; j++)
+                known = permutations[j].Key() == mesh.Key();
+            if(!known)
+                permutations.push_back(mesh);
+        }
+        return permutations;
     }
     
 private:
+    // DrawInstanced()'s and DrawDepthInstanced()'s culling
+    FrustumCuller instanceCuller;
+    vector<glm::mat4> visibleTransforms;
+    vector<glm::vec4> visibleData;
+
+    // keeps the copies whose bounds intersect frustum, pointing transforms and instanceData (when set) at them
+    void cullInstances(const Frustum &frustum, const glm::mat4 *&transforms, const glm::vec4 *&instanceData, unsigned int &count)
+    {
+        if(count == 0)
+            return;
+        instanceCuller.Clear();
+        for(unsigned int i = 0; i < count; i++)
+            instanceCuller.Add(bounds.Transformed(transforms[i]));
+        instanceCuller.Cull(frustum);
+        visibleTransforms.clear();
+        visibleData.clear();
+        for(unsigned int i = 0; i < count; i++)
+            if(instanceCuller.Visible(i))
+            {
+                visibleTransforms.push_back(transforms[i]);
+                if(instanceData)
+                    visibleData.push_back(instanceData[i]);
+            }
+        transforms = visibleTransforms.data();
+        instanceData = instanceData ? visibleData.data() : nullptr;
+        count = (unsigned int)visibleTransforms.size();
+    }
+
+    ShaderPermutation permutation(const Mesh &mesh, ShaderPermutation scene) const
+    {
+        if(mesh.materialIndex < materials.size())
+        {
+            scene.normalMap = materials[mesh.materialIndex].HasNormalMap();
+            scene.packedMap = materials[mesh.materialIndex].HasPackedMap();
+        }
+        else
+            scene.normalMap = scene.packedMap = false;
+        return scene;
+    }
+
     // loads a model with supported ASSIMP extensions from file and stores the resulting meshes in the meshes vector.
     void loadModel(string const &path)
     {
@@ -61,8 +271,64 @@ private:
         // retrieve the directory path of the filepath
         directory = path.substr(0, path.find_last_of('/'));
 
+        // resolve the materials once, meshes only refer to them
+        loadMaterials(scene);
+        loadMaterialBlocks(scene);
         // process ASSIMP's root node recursively
         processNode(scene->mRootNode, scene);
+        if(geometryPool)
+            geometryPool->Upload();
+    }
+
+    // loads the textures of every material and assigns them to its slots
+    void loadMaterials(const aiScene *scene)
+    {
+        // we assume a convention for sampler names in the shaders, one per slot:
+        // diffuse: texture_diffuse1
+        // packed scalar maps (specular, ambient occlusion, roughness): texture_packed1
+        // normal: texture_normal1
+        materials.resize(scene->mNumMaterials);
+        for(unsigned int i = 0; i < scene->mNumMaterials; i++)
+        {
+            aiMaterial *material = scene->mMaterials[i];
+            // 1. diffuse maps
+            vector<Texture> diffuseMaps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
+            if(!diffuseMaps.empty())
+                materials[i].SetTexture(DIFFUSE_TEXTURE_UNIT, diffuseMaps[0]);
+            // 2. scalar maps, cooked into a single channel packed texture (none for constant materials)
+            Texture packed = loadPackedMaterial(material, i);
+            if(packed.id != 0 || packed.virtualRegion >= 0)
+                materials[i].SetTexture(PACKED_TEXTURE_UNIT, packed);
+            // 3. normal maps
+            vector<Texture> normalMaps = loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal");
+            if(!normalMaps.empty())
+                materials[i].SetTexture(NORMAL_TEXTURE_UNIT, normalMaps[0]);
+            // ambient maps are not loaded as height maps, they end up in the packed texture as ambient occlusion
+        }
+    }
+
+    // uploads the uniform block of every material once, drawing only binds them
+    void loadMaterialBlocks(const aiScene *scene)
+    {
+        if(scene->mNumMaterials == 0)
+            return;
+        materialStride = UniformBlockStride(sizeof(MaterialBlock));
+        vector<unsigned char> data(materialStride * scene->mNumMaterials, 0);
+        glGenBuffers(1, &materialUBO);
+        for(unsigned int i = 0; i < scene->mNumMaterials; i++)
+        {
+            MaterialBlock block = {};
+            block.shininess = DEFAULT_SHININESS;
+            float shininess;
+            if(scene->mMaterials[i]->Get(AI_MATKEY_SHININESS, shininess) == aiReturn_SUCCESS && shininess > 0.0f)
+                block.shininess = shininess;
+            auto specular = materialSpecular.find(i);
+            block.specular = specular != materialSpecular.end() ? specular->second : 1.0f;
+            memcpy(&data[i * materialStride], &block, sizeof(block));
+            materials[i].SetBlock(materialUBO, i * materialStride, block);
+        }
+        GetRenderState().BindBuffer(GL_UNIFORM_BUFFER, materialUBO);
+        glBufferData(GL_UNIFORM_BUFFER, data.size(), data.data(), GL_STATIC_DRAW);
     }
 
     // processes a node in a recursive fashion. Processes each individual mesh located at the node and repeats this process on its children nodes (if any).
@@ -74,7 +340,8 @@ private:
             // the node object only contains indices to index the actual objects in the scene. 
             // the scene contains all the data, node is just to keep stuff organized (like relations between nodes).
             aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
-            meshes.push_back(processMesh(mesh, scene));
+            meshes.push_back(processMesh(mesh));
+            bounds.Merge(meshes.back().bounds);
         }
         // after we've processed all of the meshes (if any) we then recursively process each of the children nodes
         for(unsigned int i = 0; i < node->mNumChildren; i++)
@@ -84,12 +351,11 @@ private:
 
     }
 
-    Mesh processMesh(aiMesh *mesh, const aiScene *scene)
+    Mesh processMesh(aiMesh *mesh)
     {
         // data to fill
         vector<Vertex> vertices;
         vector<unsigned int> indices;
-        vector<Texture> textures;
 
         // walk through each of the mesh's vertices
         for(unsigned int i = 0; i < mesh->mNumVertices; i++)
@@ -142,30 +408,17 @@ private:
             for(unsigned int j = 0; j < face.mNumIndices; j++)
                 indices.push_back(face.mIndices[j]);        
         }
-        // process materials
-        aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];    
-        // we assume a convention for sampler names in the shaders. Each diffuse texture should be named
-        // as 'texture_diffuseN' where N is a sequential number ranging from 1 to MAX_SAMPLER_NUMBER. 
-        // Same applies to other texture as the following list summarizes:
-        // diffuse: texture_diffuseN
-        // specular: texture_specularN
-        // normal: texture_normalN
-
-        // 1. diffuse maps
-        vector<Texture> diffuseMaps = loadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
-        textures.insert(textures.end(), diffuseMaps.begin(), diffuseMaps.end());
-        // 2. specular maps
-        vector<Texture> specularMaps = loadMaterialTextures(material, aiTextureType_SPECULAR, "texture_specular");
-        textures.insert(textures.end(), specularMaps.begin(), specularMaps.end());
-        // 3. normal maps
-        std::vector<Texture> normalMaps = loadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal");
-        textures.insert(textures.end(), normalMaps.begin(), normalMaps.end());
-        // 4. height maps
-        std::vector<Texture> heightMaps = loadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height");
-        textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
-        
+        // bounds: the box around the vertices, and the sphere around its center that reaches the farthest one
+        Bounds meshBounds;
+        for(unsigned int i = 0; i < vertices.size(); i++)
+            meshBounds.Extend(vertices[i].Position);
+        meshBounds.center = (meshBounds.min + meshBounds.max) * 0.5f;
+        for(unsigned int i = 0; i < vertices.size(); i++)
+            meshBounds.radius = std::max(meshBounds.radius, glm::length(vertices[i].Position - meshBounds.center));
         // return a mesh object created from the extracted mesh data
-        return Mesh(vertices, indices, textures);
+        Mesh result(vertices, indices, mesh->mMaterialIndex, geometryPool);
+        result.bounds = meshBounds;
+        return result;
     }
 
     // checks all material textures of a given type and loads the textures if they're not loaded yet.
@@ -191,7 +444,13 @@ private:
             if(!skip)
             {   // if texture hasn't been loaded already, load it
                 Texture texture;
-                texture.id = TextureFromFile(str.C_Str(), this->directory);
+                if(virtualTexture && typeName == "texture_diffuse")
+                {
+                    texture.id = 0;
+                    texture.virtualRegion = virtualTexture->Register(this->directory + '/' + str.C_Str());
+                }
+                if(texture.virtualRegion < 0)
+                    texture.id = TextureFromFile(str.C_Str(), this->directory, false, textureUploader);
                 texture.type = typeName;
                 texture.path = str.C_Str();
                 textures.push_back(texture);
@@ -200,15 +459,86 @@ private:
         }
         return textures;
     }
+
+    // full path of the first texture of a given type, empty if the material has none
+    string firstTexturePath(aiMaterial *mat, aiTextureType type)
+    {
+        if(mat->GetTextureCount(type) == 0)
+            return string();
+        aiString str;
+        mat->GetTexture(type, 0, &str);
+        return this->directory + '/' + str.C_Str();
+    }
+
+    // cooks (or loads the cooked) packed texture holding the material's specular, ambient occlusion and roughness maps
+    Texture loadPackedMaterial(aiMaterial *mat, unsigned int materialIndex)
+    {
+        auto loaded = packed_loaded.find(materialIndex);
+        if(loaded != packed_loaded.end())
+            return loaded->second;
+
+        PackedMaterialSources sources;
+        sources.specular = firstTexturePath(mat, aiTextureType_SPECULAR);
+        // obj files have no ambient occlusion slot, ambient maps (map_Ka) are used as such
+        sources.occlusion = firstTexturePath(mat, aiTextureType_AMBIENT_OCCLUSION);
+        if(sources.occlusion.empty())
+            sources.occlusion = firstTexturePath(mat, aiTextureType_LIGHTMAP);
+        if(sources.occlusion.empty())
+            sources.occlusion = firstTexturePath(mat, aiTextureType_AMBIENT);
+        sources.roughness = firstTexturePath(mat, aiTextureType_DIFFUSE_ROUGHNESS);
+        if(sources.roughness.empty())
+        {
+            // obj shininess maps (map_Ns) are glossiness
+            sources.roughness = firstTexturePath(mat, aiTextureType_SHININESS);
+            sources.roughnessIsGloss = !sources.roughness.empty();
+        }
+        aiColor3D specularColor;
+        if(mat->Get(AI_MATKEY_COLOR_SPECULAR, specularColor) == aiReturn_SUCCESS)
+            sources.defaultSpecular = 0.2126f * specularColor.r + 0.7152f * specularColor.g + 0.0722f * specularColor.b;
+
+        // the cache name covers the inputs, so editing the material re-cooks it
+        string key = sources.specular + '|' + sources.occlusion + '|' + sources.roughness + '|' + to_string(sources.roughnessIsGloss) + '|' + to_string(sources.defaultSpecular);
+        string name = directory + '_' + to_string(materialIndex);
+        for(unsigned int i = 0; i < name.size(); i++)
+            if(name[i] == '/' || name[i] == '\\' || name[i] == ':' || name[i] == '.')
+                name[i] = '_';
+        string cookedPath = string(MATERIAL_CACHE_DIRECTORY) + '/' + name + '_' + to_string(std::hash<string>()(key) & 0xFFFFFFFF) + ".emt";
+
+        PackedMaterial packed;
+        CookPackedMaterial(sources, cookedPath, packed);
+        Texture texture;
+        texture.id = 0;
+        texture.type = "texture_packed";
+        texture.path = cookedPath;
+        // constant materials don't need the texture, the shader variant without a packed map reads the
+        // specular intensity from the material block instead
+        if(packed.width == 1 && packed.height == 1 && packed.pixels[PACKED_OCCLUSION] == 255 && packed.pixels[PACKED_ROUGHNESS] == 0)
+        {
+            materialSpecular[materialIndex] = packed.pixels[PACKED_SPECULAR] / 255.0f;
+            packed_loaded[materialIndex] = texture;
+            return texture;
+        }
+        if(virtualTexture)
+            texture.virtualRegion = virtualTexture->Register(cookedPath, packed.pixels.data(), packed.width, packed.height);
+        if(texture.virtualRegion < 0)
+            texture.id = TextureFromPixels(packed.pixels.data(), packed.width, packed.height);
+        packed_loaded[materialIndex] = texture;
+        return texture;
+    }
 };
 
 
-unsigned int TextureFromFile(const char *path, const string &directory, bool gamma)
+unsigned int TextureFromFile(const char *path, const string &directory, bool gamma, TextureUploader *uploader)
 {
     std::cout << "Loading Texture: " << path << std::endl;
     string filename = string(path);
     filename = directory + '/' + filename;
 
+    if (uploader && uploader->Available())
+        return uploader->Load(filename);
+
+    auto start = std::chrono::steady_clock::now();
+
     unsigned int textureID;
     glGenTextures(1, &textureID);
 
@@ -224,7 +554,7 @@ unsigned int TextureFromFile(const char *path, const string &directory, bool gam
         else if (nrComponents == 4)
             format = GL_RGBA;
 
-        glBindTexture(GL_TEXTURE_2D, textureID);
+        GetRenderState().BindTexture(GL_TEXTURE_2D, textureID);
         glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
         glGenerateMipmap(GL_TEXTURE_2D);
 
@@ -234,6 +564,11 @@ unsigned int TextureFromFile(const char *path, const string &directory, bool gam
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
         stbi_image_free(data);
+
+        UploadStats &stats = SynchronousUploadStats();
+        stats.textures++;
+        stats.bytes += (size_t)width * height * nrComponents;
+        stats.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
     }
     else
     {
@@ -243,4 +578,19 @@ unsigned int TextureFromFile(const char *path, const string &directory, bool gam
 
     return textureID;
 }
+unsigned int TextureFromPixels(const unsigned char *pixels, int width, int height)
+{
+    unsigned int textureID;
+    glGenTextures(1, &textureID);
+    GetRenderState().BindTexture(GL_TEXTURE_2D, textureID);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+    glGenerateMipmap(GL_TEXTURE_2D);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    return textureID;
+}
 #endif
\ No newline at end of file
@@ -0,0 +1,72 @@
+#ifndef NORMAL_MATRIX_H
+#define NORMAL_MATRIX_H
+
+#include <glm/glm.hpp>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define NORMAL_MATRIX_SSE 1
+#endif
+
+// Normal matrices, the inverse transpose of a model matrix's upper 3x3, computed on the CPU once per object
+// instead of per vertex in lighting.vs. For columns a, b, c it's [b x c, c x a, a x b] / det, the cofactors
+// over the determinant; singular matrices keep the cofactors. Results are three vec4 columns (w 0) per
+// matrix, the layout of the draw records and the instance buffer.
+
+inline glm::mat3 NormalMatrix(const glm::mat4 &model)
+{
+    glm::vec3 a(model[0]), b(model[1]), c(model[2]);
+    glm::vec3 bc = glm::cross(b, c);
+    float det = glm::dot(a, bc);
+    float scale = det != 0.0f ? 1.0f / det : 1.0f;
+    return glm::mat3(bc * scale, glm::cross(c, a) * scale, glm::cross(a, b) * scale);
+}
+
+// normals[3 * i + column] for models[i]; 4 matrices per SSE instruction, the rest one at a time
+inline void ComputeNormalMatrices(const glm::mat4 *models, unsigned int count, glm::vec4 *normals)
+{
+    unsigned int i = 0;
+#ifdef NORMAL_MATRIX_SSE
+    for (; i + 4 <= count; i += 4)
+    {
+        // a column of four matrices, transposed into x, y, z (and w) of all four
+        __m128 column[3][4];
+        for (int c = 0; c < 3; c++)
+        {
+            for (int m = 0; m < 4; m++)
+                column[c][m] = _mm_loadu_ps(&models[i + m][c][0]);
+            _MM_TRANSPOSE4_PS(column[c][0], column[c][1], column[c][2], column[c][3]);
+        }
+        const __m128 *a = column[0], *b = column[1], *c = column[2];
+        auto cross = [](const __m128 *u, const __m128 *v, __m128 *out) {
+            out[0] = _mm_sub_ps(_mm_mul_ps(u[1], v[2]), _mm_mul_ps(u[2], v[1]));
+            out[1] = _mm_sub_ps(_mm_mul_ps(u[2], v[0]), _mm_mul_ps(u[0], v[2]));
+            out[2] = _mm_sub_ps(_mm_mul_ps(u[0], v[1]), _mm_mul_ps(u[1], v[0]));
+            out[3] = _mm_setzero_ps();
+        };
+        __m128 result[3][4];
+        cross(b, c, result[0]);
+        cross(c, a, result[1]);
+        cross(a, b, result[2]);
+        __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(a[0], result[0][0]), _mm_mul_ps(a[1], result[0][1])), _mm_mul_ps(a[2], result[0][2]));
+        __m128 nonSingular = _mm_cmpneq_ps(det, _mm_setzero_ps());
+        __m128 one = _mm_set1_ps(1.0f);
+        __m128 scale = _mm_or_ps(_mm_and_ps(nonSingular, _mm_div_ps(one, det)), _mm_andnot_ps(nonSingular, one));
+        for (int c = 0; c < 3; c++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+                result[c][axis] = _mm_mul_ps(result[c][axis], scale);
+            _MM_TRANSPOSE4_PS(result[c][0], result[c][1], result[c][2], result[c][3]);
+            for (int m = 0; m < 4; m++)
+                _mm_storeu_ps(&normals[3 * (i + m) + c][0], result[c][m]);
+        }
+    }
+#endif
+    for (; i < count; i++)
+    {
+        glm::mat3 normal = NormalMatrix(models[i]);
+        for (int c = 0; c < 3; c++)
+            normals[3 * i + c] = glm::vec4(normal[c], 0.0f);
+    }
+}
+#endif
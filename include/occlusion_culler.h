@@ -0,0 +1,383 @@
+#ifndef OCCLUSION_CULLER_H
+#define OCCLUSION_CULLER_H
+
+#include <glm/glm.hpp>
+
+#include <bounds.h>
+#include <geometry_pool.h>
+#include <job_system.h>
+
+#include <vector>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define OCCLUSION_CULLER_SSE 1
+#endif
+using namespace std;
+
+const unsigned int OCCLUSION_WIDTH = 256;     // depth buffer resolution, both multiples of OCCLUSION_TILE
+const unsigned int OCCLUSION_HEIGHT = 192;
+const unsigned int OCCLUSION_TILE = 32;       // pixels of a rasterization job, and of the coarsest depth level
+const unsigned int OCCLUSION_LEVELS = 6;      // full resolution plus max depth levels down to one texel per tile
+const unsigned int OCCLUDER_TRIANGLES = 512;  // default triangle budget of a simplified occluder
+
+// The triangles a mesh occludes with: positions only, usually far fewer than the mesh draws
+struct OccluderMesh {
+    vector<glm::vec3> vertices;
+    vector<unsigned int> indices;
+
+    unsigned int Triangles() const { return (unsigned int)indices.size() / 3; }
+};
+
+// Simplifies a mesh into an occluder of at most maxTriangles by vertex clustering: the vertices are snapped
+// to a grid of cubic cells over the mesh's bounds, each cell's vertices merge into one and triangles that
+// collapse are dropped. The grid coarsens an eighth at a time until the budget is met, so the occluder keeps
+// as much of the budget as it can. A cell's vertex is its original vertex nearest to their average, moved
+// against their averaged normal by as far as the cell's vertices stand off its tangent plane: the coarser
+// triangles between them then stay inside the mesh instead of cutting across its concave parts, where they
+// would hide what's visible through them.
+// Meshes already within the budget are used as they are.
+inline OccluderMesh SimplifyOccluder(const vector<Vertex> &vertices, const vector<unsigned int> &indices, unsigned int maxTriangles = OCCLUDER_TRIANGLES)
+{
+    OccluderMesh occluder;
+    if (indices.size() / 3 <= maxTriangles)
+    {
+        for (unsigned int i = 0; i < vertices.size(); i++)
+            occluder.vertices.push_back(vertices[i].Position);
+        occluder.indices = indices;
+        return occluder;
+    }
+    Bounds bounds;
+    for (unsigned int i = 0; i < vertices.size(); i++)
+        bounds.Extend(vertices[i].Position);
+    glm::vec3 size = glm::max(bounds.max - bounds.min, glm::vec3(1e-6f));
+    float extent = std::max(size.x, std::max(size.y, size.z));
+
+    vector<unsigned int> remap(vertices.size());
+    vector<glm::vec3> sums, normals;
+    vector<unsigned int> counts;
+    unordered_map<uint64_t, unsigned int> cells;
+    for (unsigned int resolution = 64; ; resolution = std::min(resolution - 1, resolution * 7 / 8))
+    {
+        // cells per axis along the largest extent, fewer along the others
+        float cellSize = extent / resolution;
+        cells.clear();
+        sums.clear();
+        normals.clear();
+        counts.clear();
+        for (unsigned int i = 0; i < vertices.size(); i++)
+        {
+            glm::uvec3 cell = glm::uvec3(glm::min(glm::vec3(resolution - 1), (vertices[i].Position - bounds.min) / cellSize));
+            uint64_t key = ((uint64_t)cell.x << 42) | ((uint64_t)cell.y << 21) | cell.z;
+            auto found = cells.find(key);
+            if (found == cells.end())
+            {
+                found = cells.emplace(key, (unsigned int)sums.size()).first;
+                sums.push_back(glm::vec3(0.0f));
+                normals.push_back(glm::vec3(0.0f));
+                counts.push_back(0);
+            }
+            remap[i] = found->second;
+            sums[found->second] += vertices[i].Position;
+            normals[found->second] += vertices[i].Normal;
+            counts[found->second]++;
+        }
+        occluder.indices.clear();
+        for (unsigned int i = 0; i + 2 < indices.size(); i += 3)
+        {
+            unsigned int a = remap[indices[i]], b = remap[indices[i + 1]], c = remap[indices[i + 2]];
+            if (a != b && b != c && c != a)
+            {
+                occluder.indices.push_back(a);
+                occluder.indices.push_back(b);
+                occluder.indices.push_back(c);
+            }
+        }
+        if (occluder.Triangles() <= maxTriangles || resolution == 2)
+            break;
+    }
+
+    // every cell's original vertex nearest to the average
+    vector<float> nearest(sums.size(), FLT_MAX);
+    occluder.vertices.resize(sums.size());
+    for (unsigned int i = 0; i < vertices.size(); i++)
+    {
+        unsigned int cell = remap[i];
+        glm::vec3 offset = vertices[i].Position - sums[cell] / (float)counts[cell];
+        float distance = glm::dot(offset, offset);
+        if (distance < nearest[cell])
+        {
+            nearest[cell] = distance;
+            occluder.vertices[cell] = vertices[i].Position;
+        }
+    }
+    // pushed inwards by the most any of the cell's vertices lies in front of or behind it along the normal
+    vector<float> depths(sums.size(), 0.0f);
+    for (unsigned int i = 0; i < sums.size(); i++)
+    {
+        float length = glm::length(normals[i]);
+        normals[i] = length > 1e-6f ? normals[i] / length : glm::vec3(0.0f);
+    }
+    for (unsigned int i = 0; i < vertices.size(); i++)
+    {
+        unsigned int cell = remap[i];
+        depths[cell] = std::max(depths[cell], std::abs(glm::dot(vertices[i].Position - occluder.vertices[cell], normals[cell])));
+    }
+    for (unsigned int i = 0; i < occluder.vertices.size(); i++)
+        occluder.vertices[i] -= normals[i] * depths[i];
+    return occluder;
+}
+
+// Software occlusion culling. Every frame the occluders are rasterized on the CPU into a small depth buffer,
+// and objects whose bounds are behind it everywhere are skipped before they're submitted to GL.
+//
+// Begin() with the camera, AddOccluder() the chosen occluder meshes (clipped against the near plane,
+// backfaces dropped, binned into OCCLUSION_TILE sized tiles), Rasterize(), which fills every tile on the
+// job system, four pixels per SSE instruction, and builds a max depth pyramid per tile. Visible() then
+// tests an object's box: its nearest depth against the farthest occluder depth over its screen rectangle,
+// at the pyramid level where the rectangle spans at most 4x4 texels.
+class OcclusionCuller
+{
+public:
+    struct Stats {
+        unsigned int occluders = 0;
+        unsigned int triangles = 0;    // binned after clipping and backface culling
+        double milliseconds = 0.0;     // binning and rasterizing
+    };
+
+    OcclusionCuller()
+    {
+        for (unsigned int level = 0; level < OCCLUSION_LEVELS; level++)
+            depth[level].resize((OCCLUSION_WIDTH >> level) * (OCCLUSION_HEIGHT >> level));
+        bins.resize(TILES_X * TILES_Y);
+    }
+
+    // starts a frame seen through viewProjection, with nothing occluded
+    void Begin(const glm::mat4 &viewProjection)
+    {
+        this->viewProjection = viewProjection;
+        triangles.clear();
+        for (unsigned int i = 0; i < bins.size(); i++)
+            bins[i].clear();
+        stats = Stats();
+    }
+
+    void AddOccluder(const OccluderMesh &occluder, const glm::mat4 &model)
+    {
+        auto start = std::chrono::steady_clock::now();
+        glm::mat4 transform = viewProjection * model;
+        clip.resize(occluder.vertices.size());
+        for (unsigned int i = 0; i < occluder.vertices.size(); i++)
+            clip[i] = transform * glm::vec4(occluder.vertices[i], 1.0f);
+        for (unsigned int i = 0; i + 2 < occluder.indices.size(); i += 3)
+        {
+            const glm::vec4 corners[3] = { clip[occluder.indices[i]], clip[occluder.indices[i + 1]], clip[occluder.indices[i + 2]] };
+            if (corners[0].z >= -corners[0].w && corners[1].z >= -corners[1].w && corners[2].z >= -corners[2].w)
+            {
+                addTriangle(corners[0], corners[1], corners[2]);
+                continue;
+            }
+            // clip against the near plane (z = -w), leaving up to a quad
+            glm::vec4 polygon[4];
+            unsigned int count = 0;
+            for (unsigned int v = 0; v < 3; v++)
+            {
+                const glm::vec4 &a = corners[v], &b = corners[(v + 1) % 3];
+                float da = a.z + a.w, db = b.z + b.w;
+                if (da >= 0.0f)
+                    polygon[count++] = a;
+                if ((da >= 0.0f) != (db >= 0.0f))
+                    polygon[count++] = a + (b - a) * (da / (da - db));
+            }
+            for (unsigned int v = 2; v < count; v++)
+                addTriangle(polygon[0], polygon[v - 1], polygon[v]);
+        }
+        stats.occluders++;
+        stats.milliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // rasterizes everything added since Begin(), one job per tile
+    void Rasterize()
+    {
+        auto start = std::chrono::steady_clock::now();
+        GetJobSystem().ParallelFor(TILES_X * TILES_Y, 1, [this](unsigned int begin, unsigned int end) {
+            for (unsigned int tile = begin; tile < end; tile++)
+                rasterizeTile(tile);
+        });
+        stats.triangles = (unsigned int)triangles.size();
+        stats.milliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // false if the box is certainly hidden behind the occluders; boxes reaching behind the camera are visible
+    bool Visible(const Bounds &bounds) const
+    {
+        if (bounds.Empty())
+            return true;
+        glm::vec2 screenMin(FLT_MAX), screenMax(-FLT_MAX);
+        float nearest = FLT_MAX;
+        for (unsigned int i = 0; i < 8; i++)
+        {
+            glm::vec3 corner(i & 1 ? bounds.max.x : bounds.min.x, i & 2 ? bounds.max.y : bounds.min.y, i & 4 ? bounds.max.z : bounds.min.z);
+            glm::vec4 projected = viewProjection * glm::vec4(corner, 1.0f);
+            if (projected.z < -projected.w || projected.w <= 0.0f)
+                return true;
+            glm::vec3 ndc = glm::vec3(projected) / projected.w;
+            glm::vec2 screen = (glm::vec2(ndc) * 0.5f + 0.5f) * glm::vec2(OCCLUSION_WIDTH, OCCLUSION_HEIGHT);
+            screenMin = glm::min(screenMin, screen);
+            screenMax = glm::max(screenMax, screen);
+            nearest = std::min(nearest, ndc.z * 0.5f + 0.5f);
+        }
+        if (screenMax.x < 0.0f || screenMax.y < 0.0f || screenMin.x >= OCCLUSION_WIDTH || screenMin.y >= OCCLUSION_HEIGHT)
+            return true; // off screen, that's the frustum culler's call
+
+        int x0 = std::max(0, (int)std::floor(screenMin.x)), x1 = std::min((int)OCCLUSION_WIDTH - 1, (int)std::floor(screenMax.x));
+        int y0 = std::max(0, (int)std::floor(screenMin.y)), y1 = std::min((int)OCCLUSION_HEIGHT - 1, (int)std::floor(screenMax.y));
+        unsigned int level = 0;
+        while (level + 1 < OCCLUSION_LEVELS && ((x1 >> level) - (x0 >> level) > 3 || (y1 >> level) - (y0 >> level) > 3))
+            level++;
+        const vector<float> &levelDepth = depth[level];
+        unsigned int levelWidth = OCCLUSION_WIDTH >> level;
+        for (int y = y0 >> level; y <= (y1 >> level); y++)
+            for (int x = x0 >> level; x <= (x1 >> level); x++)
+                if (levelDepth[y * levelWidth + x] >= nearest)
+                    return true;
+        return false;
+    }
+
+    const Stats& GetStats() const { return stats; }
+
+private:
+    static const unsigned int TILES_X = OCCLUSION_WIDTH / OCCLUSION_TILE;
+    static const unsigned int TILES_Y = OCCLUSION_HEIGHT / OCCLUSION_TILE;
+
+    // a triangle set up for rasterization: edge functions e = a * x + b * y + c, non-negative inside, the
+    // depth plane, and the pixel bounds
+    struct Triangle {
+        float edgeA[3], edgeB[3], edgeC[3];
+        float depthA, depthB, depthC;
+        int minX, minY, maxX, maxY;
+    };
+
+    glm::mat4 viewProjection = glm::mat4(1.0f);
+    vector<float> depth[OCCLUSION_LEVELS]; // 0..1 window depth, level 0 is full resolution, each next the max of 2x2
+    vector<Triangle> triangles;
+    vector<vector<unsigned int>> bins;     // per tile, the triangles overlapping it
+    vector<glm::vec4> clip;
+    Stats stats;
+
+    void addTriangle(const glm::vec4 &a, const glm::vec4 &b, const glm::vec4 &c)
+    {
+        glm::vec3 v[3];
+        const glm::vec4 *corners[3] = { &a, &b, &c };
+        for (unsigned int i = 0; i < 3; i++)
+        {
+            glm::vec3 ndc = glm::vec3(*corners[i]) / corners[i]->w;
+            v[i] = glm::vec3((ndc.x * 0.5f + 0.5f) * OCCLUSION_WIDTH, (ndc.y * 0.5f + 0.5f) * OCCLUSION_HEIGHT, ndc.z * 0.5f + 0.5f);
+        }
+        // counter clockwise triangles face the camera, like GL's default
+        float area = (v[1].x - v[0].x) * (v[2].y - v[0].y) - (v[2].x - v[0].x) * (v[1].y - v[0].y);
+        if (area <= 0.0f || (v[0].z > 1.0f && v[1].z > 1.0f && v[2].z > 1.0f))
+            return;
+        Triangle triangle;
+        float minX = std::min(v[0].x, std::min(v[1].x, v[2].x)), maxX = std::max(v[0].x, std::max(v[1].x, v[2].x));
+        float minY = std::min(v[0].y, std::min(v[1].y, v[2].y)), maxY = std::max(v[0].y, std::max(v[1].y, v[2].y));
+        // pixels whose centers may be covered
+        triangle.minX = std::max(0, (int)std::ceil(minX - 0.5f));
+        triangle.maxX = std::min((int)OCCLUSION_WIDTH - 1, (int)std::floor(maxX - 0.5f));
+        triangle.minY = std::max(0, (int)std::ceil(minY - 0.5f));
+        triangle.maxY = std::min((int)OCCLUSION_HEIGHT - 1, (int)std::floor(maxY - 0.5f));
+        if (triangle.minX > triangle.maxX || triangle.minY > triangle.maxY)
+            return;
+        for (unsigned int e = 0; e < 3; e++)
+        {
+            const glm::vec3 &from = v[e], &to = v[(e + 1) % 3];
+            triangle.edgeA[e] = from.y - to.y;
+            triangle.edgeB[e] = to.x - from.x;
+            triangle.edgeC[e] = from.x * to.y - to.x * from.y;
+        }
+        // depth = sum of each corner's depth weighted by the edge function opposite it
+        float inverseArea = 1.0f / area;
+        float z[3] = { v[2].z * inverseArea, v[0].z * inverseArea, v[1].z * inverseArea }; // the corner opposite edge e
+        triangle.depthA = triangle.edgeA[0] * z[0] + triangle.edgeA[1] * z[1] + triangle.edgeA[2] * z[2];
+        triangle.depthB = triangle.edgeB[0] * z[0] + triangle.edgeB[1] * z[1] + triangle.edgeB[2] * z[2];
+        triangle.depthC = triangle.edgeC[0] * z[0] + triangle.edgeC[1] * z[1] + triangle.edgeC[2] * z[2];
+
+        unsigned int index = (unsigned int)triangles.size();
+        triangles.push_back(triangle);
+        for (int y = triangle.minY / (int)OCCLUSION_TILE; y <= triangle.maxY / (int)OCCLUSION_TILE; y++)
+            for (int x = triangle.minX / (int)OCCLUSION_TILE; x <= triangle.maxX / (int)OCCLUSION_TILE; x++)
+                bins[y * TILES_X + x].push_back(index);
+    }
+
+    void rasterizeTile(unsigned int tile)
+    {
+        int tileX = (int)(tile % TILES_X * OCCLUSION_TILE), tileY = (int)(tile / TILES_X * OCCLUSION_TILE);
+        float *buffer = depth[0].data();
+        for (int y = tileY; y < tileY + (int)OCCLUSION_TILE; y++)
+            std::fill(buffer + y * OCCLUSION_WIDTH + tileX, buffer + y * OCCLUSION_WIDTH + tileX + OCCLUSION_TILE, 1.0f);
+
+        const vector<unsigned int> &bin = bins[tile];
+        for (unsigned int t = 0; t < bin.size(); t++)
+        {
+            const Triangle &triangle = triangles[bin[t]];
+            int minX = std::max(triangle.minX, tileX) & ~3, maxX = std::min(triangle.maxX, tileX + (int)OCCLUSION_TILE - 1);
+            int minY = std::max(triangle.minY, tileY), maxY = std::min(triangle.maxY, tileY + (int)OCCLUSION_TILE - 1);
+            for (int y = minY; y <= maxY; y++)
+            {
+                float centerY = y + 0.5f;
+                float *row = buffer + y * OCCLUSION_WIDTH;
+                int x = minX;
+#ifdef OCCLUSION_CULLER_SSE
+                // four pixels at a time; minX is 4 aligned and tiles are a multiple of 4 wide, so all four are in the tile
+                __m128 e0Row = _mm_set1_ps(triangle.edgeB[0] * centerY + triangle.edgeC[0]);
+                __m128 e1Row = _mm_set1_ps(triangle.edgeB[1] * centerY + triangle.edgeC[1]);
+                __m128 e2Row = _mm_set1_ps(triangle.edgeB[2] * centerY + triangle.edgeC[2]);
+                __m128 zRow = _mm_set1_ps(triangle.depthB * centerY + triangle.depthC);
+                __m128 a0 = _mm_set1_ps(triangle.edgeA[0]), a1 = _mm_set1_ps(triangle.edgeA[1]), a2 = _mm_set1_ps(triangle.edgeA[2]);
+                __m128 za = _mm_set1_ps(triangle.depthA);
+                __m128 zero = _mm_setzero_ps();
+                for (; x <= maxX; x += 4)
+                {
+                    __m128 centerX = _mm_setr_ps(x + 0.5f, x + 1.5f, x + 2.5f, x + 3.5f);
+                    __m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a0, centerX), e0Row), zero),
+                                                          _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a1, centerX), e1Row), zero)),
+                                               _mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a2, centerX), e2Row), zero));
+                    if (_mm_movemask_ps(inside) == 0)
+                        continue;
+                    __m128 z = _mm_add_ps(_mm_mul_ps(za, centerX), zRow);
+                    __m128 current = _mm_loadu_ps(row + x);
+                    __m128 nearer = _mm_min_ps(current, z);
+                    _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearer), _mm_andnot_ps(inside, current)));
+                }
+#endif
+                for (; x <= maxX; x++)
+                {
+                    float centerX = x + 0.5f;
+                    if (triangle.edgeA[0] * centerX + triangle.edgeB[0] * centerY + triangle.edgeC[0] >= 0.0f
+                        && triangle.edgeA[1] * centerX + triangle.edgeB[1] * centerY + triangle.edgeC[1] >= 0.0f
+                        && triangle.edgeA[2] * centerX + triangle.edgeB[2] * centerY + triangle.edgeC[2] >= 0.0f)
+                        row[x] = std::min(row[x], triangle.depthA * centerX + triangle.depthB * centerY + triangle.depthC);
+                }
+            }
+        }
+
+        // the tile's part of the max depth pyramid
+        for (unsigned int level = 1; level < OCCLUSION_LEVELS; level++)
+        {
+            unsigned int width = OCCLUSION_WIDTH >> level, sourceWidth = OCCLUSION_WIDTH >> (level - 1);
+            unsigned int size = OCCLUSION_TILE >> level;
+            unsigned int x0 = tileX >> level, y0 = tileY >> level;
+            const vector<float> &source = depth[level - 1];
+            for (unsigned int y = y0; y < y0 + size; y++)
+                for (unsigned int x = x0; x < x0 + size; x++)
+                    depth[level][y * width + x] = std::max(std::max(source[2 * y * sourceWidth + 2 * x], source[2 * y * sourceWidth + 2 * x + 1]),
+                                                           std::max(source[(2 * y + 1) * sourceWidth + 2 * x], source[(2 * y + 1) * sourceWidth + 2 * x + 1]));
+        }
+    }
+};
+#endif
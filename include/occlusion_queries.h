@@ -0,0 +1,225 @@
+#ifndef OCCLUSION_QUERIES_H
+#define OCCLUSION_QUERIES_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <shader.h>
+#include <shader_compiler.h>
+#include <render_state.h>
+#include <bounds.h>
+
+#include <vector>
+using namespace std;
+
+const unsigned int OCCLUSION_QUERY_FRAMES = 4; // queries per occludee in flight before one has to be reused
+
+// GPU occlusion culling with hardware queries, the alternative to the CPU OcclusionCuller. Every frame the
+// bounding box of each drawn occludee (a group of instances, a large mesh) is rasterized against the scene's
+// depth inside a GL_ANY_SAMPLES_PASSED query, and the next frame's draws of that occludee are wrapped in
+// conditional rendering on it: the GPU drops them if none of the box's samples passed. The CPU never waits
+// for a result. GL_QUERY_NO_WAIT renders when a result isn't there yet, and results are only read back for
+// the stats, a few frames late, like GpuTimer. An occludee becoming visible shows up a frame late.
+//
+// Each frame: Begin(), then for every occludee BeginDraw(id, bounds), its draws, EndDraw(); then Issue()
+// while the frame's depth buffer is still bound. Occludees not drawn in a frame aren't queried in it, and
+// are drawn unconditionally the next time.
+class OcclusionQueries
+{
+public:
+    struct Stats {
+        unsigned int queries = 0;           // issued this frame
+        unsigned int conditionalDraws = 0;  // occludees drawn under a query this frame
+        unsigned int skippedDraws = 0;      // of those conditional draws whose result has come back, the ones the GPU dropped
+        unsigned int resolvedDraws = 0;     // conditional draws whose result has come back
+        double latencyFrames = 0.0;         // average frames from issuing a query to its result being readable
+    };
+
+    OcclusionQueries(bool useProgramCache = true, ShaderCompiler *compiler = nullptr)
+        : proxyShader("src/shaders/occlusion_proxy.vs", "src/shaders/occlusion_proxy.fs", useProgramCache, "", compiler)
+    {
+        // the unit cube, both faces of every side rasterized so a box is counted from any side
+        const glm::vec3 corners[8] = {
+            glm::vec3(-1, -1, -1), glm::vec3(1, -1, -1), glm::vec3(-1, 1, -1), glm::vec3(1, 1, -1),
+            glm::vec3(-1, -1, 1), glm::vec3(1, -1, 1), glm::vec3(-1, 1, 1), glm::vec3(1, 1, 1),
+        };
+        const unsigned int triangles[36] = {
+            0, 2, 1, 1, 2, 3,  4, 5, 6, 5, 7, 6,
+            0, 1, 4, 1, 5, 4,  2, 6, 3, 3, 6, 7,
+            0, 4, 2, 2, 4, 6,  1, 3, 5, 3, 7, 5,
+        };
+        RenderState &state = GetRenderState();
+        glGenVertexArrays(1, &boxVAO);
+        glGenBuffers(1, &boxVBO);
+        glGenBuffers(1, &boxEBO);
+        state.BindVertexArray(boxVAO);
+        state.BindBuffer(GL_ARRAY_BUFFER, boxVBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(corners), corners, GL_STATIC_DRAW);
+        state.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, boxEBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(triangles), triangles, GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+        state.BindVertexArray(0);
+    }
+
+    ~OcclusionQueries()
+    {
+        for (unsigned int i = 0; i < occludees.size(); i++)
+            glDeleteQueries(OCCLUSION_QUERY_FRAMES, occludees[i].queries);
+        RenderState &state = GetRenderState();
+        state.DeleteVertexArray(boxVAO);
+        state.DeleteBuffer(boxVBO);
+        state.DeleteBuffer(boxEBO);
+    }
+
+    OcclusionQueries(const OcclusionQueries&) = delete;
+    OcclusionQueries& operator=(const OcclusionQueries&) = delete;
+
+    // starts a frame seen from cameraPosition; occludees whose box holds the camera are never gated, their
+    // proxy would be cut open by the near plane
+    void Begin(const glm::vec3 &cameraPosition, float nearPlane)
+    {
+        frame++;
+        this->cameraPosition = cameraPosition;
+        this->nearPlane = nearPlane;
+        stats = Stats();
+        drawn.clear();
+        collect();
+    }
+
+    // starts the draws of occludee id: gated by its query of the last frame, if it had one
+    void BeginDraw(unsigned int id, const Bounds &bounds)
+    {
+        if (id >= occludees.size())
+        {
+            size_t first = occludees.size();
+            occludees.resize(id + 1);
+            for (size_t i = first; i < occludees.size(); i++)
+                glGenQueries(OCCLUSION_QUERY_FRAMES, occludees[i].queries);
+        }
+        Occludee &occludee = occludees[id];
+        occludee.bounds = bounds;
+        drawn.push_back(id);
+        conditional = false;
+        if (occludee.latest >= 0 && occludee.slots[occludee.latest].frame + 1 == frame)
+        {
+            Slot &slot = occludee.slots[occludee.latest];
+            glBeginConditionalRender(occludee.queries[occludee.latest], GL_QUERY_NO_WAIT);
+            slot.gated = true;
+            conditional = true;
+            stats.conditionalDraws++;
+        }
+    }
+
+    void EndDraw()
+    {
+        if (conditional)
+            glEndConditionalRender();
+        conditional = false;
+    }
+
+    // queries the boxes of everything drawn since Begin() against the bound depth buffer, without writing it
+    void Issue()
+    {
+        if (drawn.empty())
+            return;
+        RenderState &state = GetRenderState();
+        proxyShader.use();
+        state.BindVertexArray(boxVAO);
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        state.DepthMask(false);
+        for (unsigned int i = 0; i < drawn.size(); i++)
+        {
+            Occludee &occludee = occludees[drawn[i]];
+            glm::vec3 center = (occludee.bounds.min + occludee.bounds.max) * 0.5f;
+            glm::vec3 extent = (occludee.bounds.max - occludee.bounds.min) * 0.5f;
+            if (occludee.bounds.Empty() || glm::all(glm::lessThanEqual(glm::abs(cameraPosition - center), extent + glm::vec3(nearPlane * 2.0f))))
+            {
+                occludee.latest = -1;
+                continue;
+            }
+            // a slot still unread after OCCLUSION_QUERY_FRAMES frames is given up rather than waited for
+            int index = (int)(frame % OCCLUSION_QUERY_FRAMES);
+            occludee.slots[index] = Slot();
+            occludee.slots[index].frame = frame;
+            occludee.slots[index].pending = true;
+            occludee.latest = index;
+            proxyShader.setVec3("boxCenter"_uniform, center);
+            proxyShader.setVec3("boxExtent"_uniform, extent);
+            glBeginQuery(GL_ANY_SAMPLES_PASSED, occludee.queries[index]);
+            glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
+            glEndQuery(GL_ANY_SAMPLES_PASSED);
+            stats.queries++;
+        }
+        state.DepthMask(true);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    }
+
+    // skipped and resolved draws come from results read back this frame, so they trail the draws by a frame or two
+    const Stats& GetStats() const { return stats; }
+
+private:
+    struct Slot {
+        unsigned int frame = 0;   // issued in
+        bool pending = false;     // issued and not accounted for yet
+        bool resultRead = false;
+        bool visible = true;
+        bool gated = false;       // the next frame's draws were conditional on it
+    };
+
+    struct Occludee {
+        unsigned int queries[OCCLUSION_QUERY_FRAMES];
+        Slot slots[OCCLUSION_QUERY_FRAMES];
+        int latest = -1;          // slot of the last query issued
+        Bounds bounds;
+    };
+
+    Shader proxyShader;
+    unsigned int boxVAO = 0, boxVBO = 0, boxEBO = 0;
+    vector<Occludee> occludees;
+    vector<unsigned int> drawn;   // this frame's occludees, in BeginDraw() order
+    unsigned int frame = 0;
+    glm::vec3 cameraPosition = glm::vec3(0.0f);
+    float nearPlane = 0.1f;
+    bool conditional = false;
+    Stats stats;
+
+    // reads the results that are ready without waiting, and accounts for the draws gated on them once the
+    // frame that used them has been issued
+    void collect()
+    {
+        double latency = 0.0;
+        unsigned int results = 0;
+        for (unsigned int i = 0; i < occludees.size(); i++)
+            for (unsigned int s = 0; s < OCCLUSION_QUERY_FRAMES; s++)
+            {
+                Slot &slot = occludees[i].slots[s];
+                if (!slot.pending)
+                    continue;
+                if (!slot.resultRead)
+                {
+                    GLint available = 0;
+                    glGetQueryObjectiv(occludees[i].queries[s], GL_QUERY_RESULT_AVAILABLE, &available);
+                    if (!available)
+                        continue;
+                    GLint passed = 0;
+                    glGetQueryObjectiv(occludees[i].queries[s], GL_QUERY_RESULT, &passed);
+                    slot.resultRead = true;
+                    slot.visible = passed != 0;
+                    latency += frame - slot.frame;
+                    results++;
+                }
+                if (frame > slot.frame + 1)
+                {
+                    if (slot.gated)
+                    {
+                        stats.resolvedDraws++;
+                        stats.skippedDraws += !slot.visible;
+                    }
+                    slot.pending = false;
+                }
+            }
+        stats.latencyFrames = results > 0 ? latency / results : 0.0;
+    }
+};
+#endif
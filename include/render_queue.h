@@ -0,0 +1,435 @@
+#ifndef RENDER_QUEUE_H
+#define RENDER_QUEUE_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <shader.h>
+#include <material.h>
+#include <render_state.h>
+#include <geometry_pool.h>
+#include <bounds.h>
+#include <frustum_culler.h>
+#include <occlusion_culler.h>
+#include <normal_matrix.h>
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <iostream>
+using namespace std;
+
+// passes in execution order, the top bits of every sort key
+enum RenderPass {
+    PASS_OPAQUE  = 0, // front to back, depth tested and written
+    PASS_BLENDED = 1, // back to front, alpha blended over the opaque pass without depth writes
+};
+
+// One draw call with everything needed to issue it. Packets are collected from every model each frame,
+// sorted, and executed in order.
+struct DrawPacket {
+    Shader *shader = nullptr;
+    const Material *material = nullptr; // nullptr for draws without one
+    unsigned int vao = 0;
+    unsigned int positionVAO = 0;       // the same vertices as a position stream for the depth pre-pass; vao when 0
+    GLenum mode = GL_TRIANGLES;
+    unsigned int count = 0;             // indices, or vertices when not indexed
+    bool indexed = true;
+    unsigned int firstIndex = 0;        // where the mesh starts in a vertex array shared by many (GeometryPool)
+    int baseVertex = 0;
+    bool drawRecord = false;            // the shader reads model and material from the draw records (HAS_DRAW_RECORDS),
+                                        // only drawn by the multi-draw indirect path, from a GeometryPool vertex array
+    glm::mat4 model = glm::mat4(1.0f);
+    Bounds bounds;                      // world space, for frustum culling; draws with empty bounds are never culled
+};
+
+// Sort key layout, most significant bits first:
+//  opaque:  pass 2 | shader 10 | material 12 | mesh 16 | depth 24
+//  blended: pass 2 | inverted depth 24 | shader 10 | material 12 | mesh 16
+// so opaque draws are grouped by program, then material, then vertex array, and front to back within those,
+// while blended draws are strictly back to front.
+inline uint64_t MakeSortKey(RenderPass pass, uint32_t shader, uint32_t material, uint32_t mesh, float depth)
+{
+    uint64_t depthBits = (uint64_t)(std::min(std::max(depth, 0.0f), 1.0f) * 16777215.0f);
+    uint64_t key = (uint64_t)(pass & 0x3) << 62;
+    if (pass == PASS_BLENDED)
+        return key | (16777215ull - depthBits) << 38 | (uint64_t)(shader & 0x3FF) << 28 | (uint64_t)(material & 0xFFF) << 16 | (mesh & 0xFFFF);
+    return key | (uint64_t)(shader & 0x3FF) << 52 | (uint64_t)(material & 0xFFF) << 40 | (uint64_t)(mesh & 0xFFFF) << 24 | depthBits;
+}
+
+// LSD radix sort of (key, index) pairs by key, 8 bits per pass. Passes in which every key has the same
+// digit are skipped, so keys that only differ in a few fields cost only those passes. scratch is resized
+// to match; the result ends up in items.
+struct SortItem {
+    uint64_t key;
+    uint32_t index;
+};
+
+inline void RadixSort(vector<SortItem> &items, vector<SortItem> &scratch)
+{
+    size_t count = items.size();
+    if (count < 2)
+        return;
+    scratch.resize(count);
+    uint32_t histograms[8][256];
+    std::memset(histograms, 0, sizeof(histograms));
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t key = items[i].key;
+        for (int digit = 0; digit < 8; digit++)
+            histograms[digit][(key >> (digit * 8)) & 0xFF]++;
+    }
+    SortItem *source = items.data();
+    SortItem *destination = scratch.data();
+    for (int digit = 0; digit < 8; digit++)
+    {
+        uint32_t *histogram = histograms[digit];
+        if (histogram[(source[0].key >> (digit * 8)) & 0xFF] == count)
+            continue;
+        uint32_t offset = 0;
+        for (int bucket = 0; bucket < 256; bucket++)
+        {
+            uint32_t bucketCount = histogram[bucket];
+            histogram[bucket] = offset;
+            offset += bucketCount;
+        }
+        for (size_t i = 0; i < count; i++)
+            destination[histogram[(source[i].key >> (digit * 8)) & 0xFF]++] = source[i];
+        std::swap(source, destination);
+    }
+    if (source != items.data())
+        std::memcpy(items.data(), source, count * sizeof(SortItem));
+}
+
+// glMultiDrawElementsIndirect's command layout
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint  baseVertex;
+    GLuint baseInstance;
+};
+
+// texels of a draw record in the records buffer texture: the model matrix columns, Material::DrawRecord(),
+// then the normal matrix columns
+const unsigned int DRAW_RECORD_TEXELS = 8;
+
+// Collects the frame's draw packets, sorts them by key and issues them with as few program, material and
+// vertex array changes as the order allows. Begin() each frame with the camera, Submit() packets, Sort(),
+// then Execute(). Given a frustum, Sort() first culls the packets whose bounds lie outside it, all in one
+// FrustumCuller batch; given a rasterized OcclusionCuller, it then drops those hidden behind its occluders.
+//
+// With SetMultiDrawIndirect() on (GL 4.3), sorted runs of drawRecord packets that only differ in mesh, model
+// matrix and material constants are merged: their DrawElementsIndirectCommands and draw records are written
+// to per frame buffers and every run is a single glMultiDrawElementsIndirect call. A frame with more than
+// MAX_INDIRECT_DRAWS of them is written and drawn in several batches, the buffers orphaned between them.
+//
+// ExecuteDepth() before Execute() lays down the opaque pass's depth with a cheap program first; Execute()
+// then shades the opaque pass with GL_EQUAL depth testing, so every covered pixel runs the expensive fragment
+// shader once however much the scene overdraws.
+class RenderQueue
+{
+public:
+    struct Stats {
+        unsigned int draws = 0;
+        unsigned int programChanges = 0;
+        unsigned int materialChanges = 0;
+        unsigned int multiDraws = 0;    // glMultiDrawElementsIndirect calls, included in draws by their commands
+        unsigned int depthDraws = 0;    // of the depth pre-pass
+        unsigned int culled = 0;        // packets outside the frustum
+        unsigned int occluded = 0;      // packets in the frustum but hidden behind the occluders
+        double cullMilliseconds = 0.0;  // frustum and occlusion tests
+        double sortMilliseconds = 0.0;  // including the normal matrices
+    };
+
+    // switches drawRecord packets to multi-draw indirect; stays off without GL 4.3. Returns whether it's on.
+    bool SetMultiDrawIndirect(bool enable)
+    {
+        multiDraw = enable && GLAD_GL_VERSION_4_3;
+        if (multiDraw && !commandBuffer)
+            createIndirectBuffers();
+        return multiDraw;
+    }
+
+    bool MultiDrawIndirect() const { return multiDraw; }
+
+    // starts a frame; depth is the view space distance along the view direction divided by farPlane.
+    // Without a frustum nothing is culled, without an occlusion culler nothing is occluded; the occlusion
+    // culler must stay rasterized until Sort().
+    void Begin(const glm::mat4 &view, float farPlane, const Frustum *frustum = nullptr, const OcclusionCuller *occlusion = nullptr)
+    {
+        this->view = view;
+        inverseFar = farPlane > 0.0f ? 1.0f / farPlane : 0.0f;
+        culling = frustum != nullptr;
+        this->occlusion = occlusion;
+        if (frustum)
+            this->frustum = *frustum;
+        packets.clear();
+        items.clear();
+        runs.clear();
+        culler.Clear();
+        depthPrepass = false;
+        stats = Stats();
+    }
+
+    void Submit(const DrawPacket &packet, RenderPass pass = PASS_OPAQUE)
+    {
+        glm::vec4 position = view * glm::vec4(glm::vec3(packet.model[3]), 1.0f);
+        float depth = -position.z * inverseFar;
+        uint32_t shader = packet.shader ? packet.shader->ID : 0;
+        uint32_t material = packet.material ? packet.material->SortID() : 0;
+        items.push_back({ MakeSortKey(pass, shader, material, packet.vao, depth), (uint32_t)packets.size() });
+        packets.push_back(packet);
+        if (culling)
+            culler.Add(packet.bounds);
+    }
+
+    void Sort()
+    {
+        if (culling && !items.empty())
+        {
+            // packet i is box i of the culler, items are still in submission order
+            culler.Cull(frustum);
+            items.erase(std::remove_if(items.begin(), items.end(), [this](const SortItem &item) { return !culler.Visible(item.index); }),
+                        items.end());
+            stats.culled = culler.GetStats().culled;
+            stats.cullMilliseconds = culler.GetStats().milliseconds;
+        }
+        if (occlusion && !items.empty())
+        {
+            auto start = std::chrono::steady_clock::now();
+            size_t tested = items.size();
+            items.erase(std::remove_if(items.begin(), items.end(), [this](const SortItem &item) { return !occlusion->Visible(packets[item.index].bounds); }),
+                        items.end());
+            stats.occluded = (unsigned int)(tested - items.size());
+            stats.cullMilliseconds += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+        auto start = std::chrono::steady_clock::now();
+        RadixSort(items, scratch);
+        // the normal matrices of the sorted draws, in one batch: 3 columns per item
+        models.resize(items.size());
+        for (unsigned int i = 0; i < items.size(); i++)
+            models[i] = packets[items[i].index].model;
+        normalMatrices.resize(items.size() * 3);
+        ComputeNormalMatrices(models.data(), (unsigned int)models.size(), normalMatrices.data());
+        stats.sortMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // draws the depth of the sorted opaque packets with depthShader (depth.vs), through their position streams.
+    // The opaque packets of the following Execute() are then only shaded where they are the nearest surface.
+    void ExecuteDepth(Shader &depthShader)
+    {
+        RenderState &state = GetRenderState();
+        depthShader.use();
+        state.DepthFunc(GL_LESS);
+        state.DepthMask(true);
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        for (unsigned int i = 0; i < items.size() && (items[i].key >> 62) == PASS_OPAQUE; i++)
+        {
+            const DrawPacket &packet = packets[items[i].index];
+            state.BindVertexArray(packet.positionVAO ? packet.positionVAO : packet.vao);
+            depthShader.setMat4("model"_uniform, packet.model);
+            if (packet.indexed)
+                glDrawElementsBaseVertex(packet.mode, packet.count, GL_UNSIGNED_INT, (void*)(packet.firstIndex * sizeof(unsigned int)), packet.baseVertex);
+            else
+                glDrawArrays(packet.mode, 0, packet.count);
+            stats.depthDraws++;
+        }
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        depthPrepass = true;
+    }
+
+    // issues the sorted packets. prepare is called after every program change, to set that program's
+    // per frame uniforms and textures.
+    void Execute(const function<void(Shader&)> &prepare)
+    {
+        RenderState &state = GetRenderState();
+        Shader *shader = nullptr;
+        const Material *material = nullptr;
+        int pass = -1;
+        runs.clear();
+        unsigned int run = 0, batches = 0;
+        for (unsigned int i = 0; i < items.size(); i++)
+        {
+            const DrawPacket &packet = packets[items[i].index];
+            if (multiDraw && packet.drawRecord && packet.indexed && run == runs.size())
+            {
+                // the previous batch's runs are all drawn, the next batch starts here
+                if (batches++ == 1 && !batchesReported)
+                {
+                    std::cout << "RENDER_QUEUE: more than " << MAX_INDIRECT_DRAWS << " indirect draws in a frame, drawn in batches" << std::endl;
+                    batchesReported = true;
+                }
+                writeIndirectDraws(i);
+                run = 0;
+            }
+            bool multiDrawRun = run < runs.size() && runs[run].firstItem == i;
+            if (packet.drawRecord && !multiDrawRun)
+                continue; // without the indirect path there's no record to draw it with
+            int packetPass = (int)(items[i].key >> 62);
+            if (packetPass != pass)
+            {
+                pass = packetPass;
+                setPassState((RenderPass)pass);
+            }
+            if (packet.shader != shader)
+            {
+                shader = packet.shader;
+                shader->use();
+                prepare(*shader);
+                material = nullptr; // the new program hasn't seen any material's uniforms
+                stats.programChanges++;
+            }
+            if (packet.material && packet.material != material)
+            {
+                material = packet.material;
+                material->Apply(*shader);
+                stats.materialChanges++;
+            }
+            state.BindVertexArray(packet.vao);
+            if (multiDrawRun)
+            {
+                // the run's materials only differ in their records, the first one's bindings serve all of them
+                state.BindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+                state.BindTexture(DRAW_RECORDS_TEXTURE_UNIT, GL_TEXTURE_BUFFER, recordTexture);
+                glMultiDrawElementsIndirect(packet.mode, GL_UNSIGNED_INT, (void*)(runs[run].firstCommand * sizeof(DrawElementsIndirectCommand)),
+                                            runs[run].count, 0);
+                stats.draws += runs[run].count;
+                stats.multiDraws++;
+                i += runs[run].count - 1;
+                run++;
+                continue;
+            }
+            shader->setMat4("model"_uniform, packet.model);
+            shader->setMat3("normalMatrix"_uniform, glm::mat3(glm::vec3(normalMatrices[3 * i]), glm::vec3(normalMatrices[3 * i + 1]), glm::vec3(normalMatrices[3 * i + 2])));
+            if (packet.indexed)
+                glDrawElementsBaseVertex(packet.mode, packet.count, GL_UNSIGNED_INT, (void*)(packet.firstIndex * sizeof(unsigned int)), packet.baseVertex);
+            else
+                glDrawArrays(packet.mode, 0, packet.count);
+            stats.draws++;
+        }
+        // leave depth testing as draws after the queue expect it
+        depthPrepass = false;
+        setPassState(PASS_OPAQUE);
+    }
+
+    unsigned int Size() const { return (unsigned int)items.size(); }
+    const Stats& GetStats() const { return stats; }
+
+private:
+    glm::mat4 view = glm::mat4(1.0f);
+    float inverseFar = 0.01f;
+    bool culling = false;
+    bool depthPrepass = false;      // ExecuteDepth() ran this frame
+    Frustum frustum;
+    FrustumCuller culler;
+    const OcclusionCuller *occlusion = nullptr;
+    vector<DrawPacket> packets;
+    vector<SortItem> items, scratch;
+    Stats stats;
+
+    // multi-draw indirect: sorted items firstItem..firstItem + count - 1 are drawn by commands from firstCommand
+    struct IndirectRun {
+        unsigned int firstItem, firstCommand, count;
+    };
+    bool multiDraw = false;
+    bool batchesReported = false;       // a frame needed more than one batch of indirect draws
+    unsigned int commandBuffer = 0, recordBuffer = 0, recordTexture = 0;
+    vector<DrawElementsIndirectCommand> commands;
+    vector<glm::vec4> records;
+    vector<glm::mat4> models;           // of the sorted items, for ComputeNormalMatrices()
+    vector<glm::vec4> normalMatrices;   // 3 columns per sorted item
+    vector<IndirectRun> runs;
+
+    void createIndirectBuffers()
+    {
+        RenderState &state = GetRenderState();
+        glGenBuffers(1, &commandBuffer);
+        state.BindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, MAX_INDIRECT_DRAWS * sizeof(DrawElementsIndirectCommand), NULL, GL_STREAM_DRAW);
+        glGenBuffers(1, &recordBuffer);
+        state.BindBuffer(GL_TEXTURE_BUFFER, recordBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, MAX_INDIRECT_DRAWS * DRAW_RECORD_TEXELS * sizeof(glm::vec4), NULL, GL_STREAM_DRAW);
+        glGenTextures(1, &recordTexture);
+        state.BindTexture(DRAW_RECORDS_TEXTURE_UNIT, GL_TEXTURE_BUFFER, recordTexture);
+        glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, recordBuffer);
+    }
+
+    // whether packet can be drawn by the same multi-draw as the run started by first
+    bool sameRun(unsigned int firstItem, unsigned int item) const
+    {
+        const DrawPacket &first = packets[items[firstItem].index];
+        const DrawPacket &packet = packets[items[item].index];
+        if ((items[firstItem].key >> 62) != (items[item].key >> 62) || !packet.drawRecord || !packet.indexed
+            || packet.shader != first.shader || packet.vao != first.vao || packet.mode != first.mode)
+            return false;
+        if (!packet.material || !first.material)
+            return packet.material == first.material;
+        return packet.material == first.material || packet.material->SameBindings(*first.material);
+    }
+
+    // collects the runs of the sorted items from first on, as many as fit in the buffers, and uploads their
+    // commands and records
+    void writeIndirectDraws(unsigned int first)
+    {
+        commands.clear();
+        records.clear();
+        runs.clear();
+        for (unsigned int i = first; i < items.size() && commands.size() < MAX_INDIRECT_DRAWS; )
+        {
+            if (!packets[items[i].index].drawRecord || !packets[items[i].index].indexed)
+            {
+                i++;
+                continue;
+            }
+            IndirectRun run = { i, (unsigned int)commands.size(), 0 };
+            for (; i < items.size() && commands.size() < MAX_INDIRECT_DRAWS && sameRun(run.firstItem, i); i++, run.count++)
+            {
+                const DrawPacket &packet = packets[items[i].index];
+                // baseInstance is the draw's index in the records, read back through aDrawID
+                DrawElementsIndirectCommand command = { packet.count, 1, packet.firstIndex, packet.baseVertex, (GLuint)commands.size() };
+                commands.push_back(command);
+                for (int column = 0; column < 4; column++)
+                    records.push_back(packet.model[column]);
+                // no material: regular textures and no highlight
+                records.push_back(packet.material ? packet.material->DrawRecord() : glm::vec4(-1.0f, -1.0f, 1.0f, 0.0f));
+                records.insert(records.end(), normalMatrices.begin() + 3 * i, normalMatrices.begin() + 3 * i + 3);
+            }
+            runs.push_back(run);
+        }
+        if (commands.empty())
+            return;
+
+        // orphan last frame's storage instead of waiting for the GPU to finish reading it
+        RenderState &state = GetRenderState();
+        state.BindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, MAX_INDIRECT_DRAWS * sizeof(DrawElementsIndirectCommand), NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, commands.size() * sizeof(DrawElementsIndirectCommand), commands.data());
+        state.BindBuffer(GL_TEXTURE_BUFFER, recordBuffer);
+        glBufferData(GL_TEXTURE_BUFFER, MAX_INDIRECT_DRAWS * DRAW_RECORD_TEXELS * sizeof(glm::vec4), NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_TEXTURE_BUFFER, 0, records.size() * sizeof(glm::vec4), records.data());
+    }
+
+    void setPassState(RenderPass pass)
+    {
+        RenderState &state = GetRenderState();
+        if (pass == PASS_BLENDED)
+        {
+            state.Enable(GL_BLEND);
+            state.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            state.DepthFunc(GL_LESS);
+            state.DepthMask(false);
+        }
+        else
+        {
+            // after a depth pre-pass the depth is already there, only the nearest surface passes
+            state.Disable(GL_BLEND);
+            state.DepthFunc(depthPrepass ? GL_EQUAL : GL_LESS);
+            state.DepthMask(!depthPrepass);
+        }
+    }
+};
+#endif
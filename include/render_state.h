@@ -0,0 +1,361 @@
+#ifndef RENDER_STATE_H
+#define RENDER_STATE_H
+
+#include <glad/glad.h>
+
+#include <cstdint>
+using namespace std;
+
+const unsigned int RENDER_STATE_TEXTURE_UNITS   = 32; // units tracked, binds to higher units always go through
+const unsigned int RENDER_STATE_BUFFER_BINDINGS = 16; // indexed uniform/storage buffer bindings tracked
+
+// GL calls the RenderState issued and filtered out
+struct RenderStateStats {
+    unsigned int issued = 0;
+    unsigned int skipped = 0;
+};
+
+// Shadow copy of the context's bindings (program, vertex array, framebuffer, texture units, buffer targets,
+// indexed buffer ranges) and of the depth and blend state. Every call compares against the shadow first
+// and only reaches GL when the value actually changes, so code can simply state what it needs for each draw
+// instead of unbinding after itself. Everything starts unknown, so the first call always goes through.
+//
+// Only works if all binding on the main context goes through here; after calling GL directly, Invalidate()
+// the state. Objects that may still be bound are deleted with the Delete* functions, which forget them
+// (GL silently unbinds deleted objects and a new object could get the same name).
+class RenderState
+{
+public:
+    RenderState()
+    {
+        Invalidate();
+    }
+
+    RenderState(const RenderState&) = delete;
+    RenderState& operator=(const RenderState&) = delete;
+
+    // forget everything, the next call of each kind goes to GL
+    void Invalidate()
+    {
+        program = UNKNOWN;
+        vertexArray = UNKNOWN;
+        drawFramebuffer = readFramebuffer = UNKNOWN;
+        activeUnit = UNKNOWN;
+        for (unsigned int i = 0; i < RENDER_STATE_TEXTURE_UNITS; i++)
+            for (unsigned int j = 0; j < TEXTURE_TARGETS; j++)
+                textures[i][j] = UNKNOWN;
+        for (unsigned int i = 0; i < BUFFER_TARGETS; i++)
+            buffers[i] = UNKNOWN;
+        for (unsigned int i = 0; i < INDEXED_TARGETS; i++)
+            for (unsigned int j = 0; j < RENDER_STATE_BUFFER_BINDINGS; j++)
+                ranges[i][j].buffer = UNKNOWN;
+        for (unsigned int i = 0; i < CAPABILITIES; i++)
+            capabilities[i] = UNKNOWN;
+        depthFunc = UNKNOWN;
+        depthMask = UNKNOWN;
+        blendSource = blendDestination = UNKNOWN;
+    }
+
+    // bindings
+    // ------------------------------------------------------------------------
+    void UseProgram(unsigned int id)
+    {
+        if (changed(program, id))
+            glUseProgram(id);
+    }
+
+    void BindVertexArray(unsigned int id)
+    {
+        if (!changed(vertexArray, id))
+            return;
+        glBindVertexArray(id);
+        // GL_ELEMENT_ARRAY_BUFFER belongs to the vertex array
+        buffers[ELEMENT_ARRAY] = UNKNOWN;
+    }
+
+    void BindFramebuffer(GLenum target, unsigned int id)
+    {
+        bool draw = target == GL_FRAMEBUFFER || target == GL_DRAW_FRAMEBUFFER;
+        bool read = target == GL_FRAMEBUFFER || target == GL_READ_FRAMEBUFFER;
+        if ((draw && drawFramebuffer != id) || (read && readFramebuffer != id))
+        {
+            glBindFramebuffer(target, id);
+            if (draw)
+                drawFramebuffer = id;
+            if (read)
+                readFramebuffer = id;
+            stats.issued++;
+        }
+        else
+            stats.skipped++;
+    }
+
+    void ActiveTexture(unsigned int unit)
+    {
+        if (changed(activeUnit, unit))
+            glActiveTexture(GL_TEXTURE0 + unit);
+    }
+
+    // binds texture to unit, only selecting the unit if the binding changes
+    void BindTexture(unsigned int unit, GLenum target, unsigned int texture)
+    {
+        int index = textureTarget(target);
+        if (unit >= RENDER_STATE_TEXTURE_UNITS || index < 0)
+        {
+            ActiveTexture(unit);
+            glBindTexture(target, texture);
+            stats.issued++;
+            return;
+        }
+        if (textures[unit][index] == texture)
+        {
+            stats.skipped++;
+            return;
+        }
+        ActiveTexture(unit);
+        glBindTexture(target, texture);
+        textures[unit][index] = texture;
+        stats.issued++;
+    }
+
+    // binds texture to whichever unit is active, for creating and updating textures
+    void BindTexture(GLenum target, unsigned int texture)
+    {
+        if (activeUnit == UNKNOWN)
+            ActiveTexture(0);
+        BindTexture(activeUnit, target, texture);
+    }
+
+    void BindBuffer(GLenum target, unsigned int buffer)
+    {
+        int index = bufferTarget(target);
+        if (index < 0)
+        {
+            glBindBuffer(target, buffer);
+            stats.issued++;
+        }
+        else if (changed(buffers[index], buffer))
+            glBindBuffer(target, buffer);
+    }
+
+    // glBindBufferRange, also binds the buffer to target like GL does
+    void BindBufferRange(GLenum target, unsigned int binding, unsigned int buffer, GLintptr offset, GLsizeiptr size)
+    {
+        int index = indexedTarget(target);
+        if (index >= 0 && binding < RENDER_STATE_BUFFER_BINDINGS)
+        {
+            Range &range = ranges[index][binding];
+            if (range.buffer == buffer && range.offset == offset && range.size == size)
+            {
+                stats.skipped++;
+                return;
+            }
+            range.buffer = buffer;
+            range.offset = offset;
+            range.size = size;
+        }
+        glBindBufferRange(target, binding, buffer, offset, size);
+        int generic = bufferTarget(target);
+        if (generic >= 0)
+            buffers[generic] = buffer;
+        stats.issued++;
+    }
+
+    // depth and blend state
+    // ------------------------------------------------------------------------
+    void Enable(GLenum capability)
+    {
+        setCapability(capability, true);
+    }
+
+    void Disable(GLenum capability)
+    {
+        setCapability(capability, false);
+    }
+
+    void DepthFunc(GLenum function)
+    {
+        if (changed(depthFunc, function))
+            glDepthFunc(function);
+    }
+
+    void DepthMask(bool write)
+    {
+        if (changed(depthMask, write ? 1u : 0u))
+            glDepthMask(write ? GL_TRUE : GL_FALSE);
+    }
+
+    void BlendFunc(GLenum source, GLenum destination)
+    {
+        if (blendSource == source && blendDestination == destination)
+        {
+            stats.skipped++;
+            return;
+        }
+        glBlendFunc(source, destination);
+        blendSource = source;
+        blendDestination = destination;
+        stats.issued++;
+    }
+
+    // deleting objects that may be bound
+    // ------------------------------------------------------------------------
+    void DeleteProgram(unsigned int id)
+    {
+        glDeleteProgram(id);
+        if (program == id)
+            program = UNKNOWN;
+    }
+
+    void DeleteVertexArray(unsigned int id)
+    {
+        glDeleteVertexArrays(1, &id);
+        if (vertexArray == id)
+            vertexArray = UNKNOWN;
+    }
+
+    void DeleteTexture(unsigned int id)
+    {
+        glDeleteTextures(1, &id);
+        for (unsigned int i = 0; i < RENDER_STATE_TEXTURE_UNITS; i++)
+            for (unsigned int j = 0; j < TEXTURE_TARGETS; j++)
+                if (textures[i][j] == id)
+                    textures[i][j] = UNKNOWN;
+    }
+
+    void DeleteBuffer(unsigned int id)
+    {
+        glDeleteBuffers(1, &id);
+        for (unsigned int i = 0; i < BUFFER_TARGETS; i++)
+            if (buffers[i] == id)
+                buffers[i] = UNKNOWN;
+        for (unsigned int i = 0; i < INDEXED_TARGETS; i++)
+            for (unsigned int j = 0; j < RENDER_STATE_BUFFER_BINDINGS; j++)
+                if (ranges[i][j].buffer == id)
+                    ranges[i][j].buffer = UNKNOWN;
+    }
+
+    void DeleteFramebuffer(unsigned int id)
+    {
+        glDeleteFramebuffers(1, &id);
+        if (drawFramebuffer == id)
+            drawFramebuffer = UNKNOWN;
+        if (readFramebuffer == id)
+            readFramebuffer = UNKNOWN;
+    }
+
+    // counters
+    // ------------------------------------------------------------------------
+    // closes the frame's counters. Call once per frame.
+    void EndFrame()
+    {
+        lastFrame = stats;
+        total.issued += stats.issued;
+        total.skipped += stats.skipped;
+        frames++;
+        stats = RenderStateStats();
+    }
+
+    // calls of the frame so far, of the last finished frame, and per frame since ResetTotals()
+    const RenderStateStats& Current() const { return stats; }
+    const RenderStateStats& LastFrame() const { return lastFrame; }
+    double AverageIssued() const { return frames > 0 ? (double)total.issued / frames : 0.0; }
+    double AverageSkipped() const { return frames > 0 ? (double)total.skipped / frames : 0.0; }
+
+    void ResetTotals()
+    {
+        total = RenderStateStats();
+        frames = 0;
+    }
+
+private:
+    static const unsigned int UNKNOWN = 0xFFFFFFFFu;
+
+    enum { TEXTURE_2D, TEXTURE_2D_ARRAY, TEXTURE_CUBE_MAP, TEXTURE_BUFFER_TARGET, TEXTURE_TARGETS };
+    enum { ARRAY, ELEMENT_ARRAY, UNIFORM, SHADER_STORAGE, DRAW_INDIRECT, PIXEL_PACK, PIXEL_UNPACK, TEXTURE_BUFFER, BUFFER_TARGETS };
+    enum { UNIFORM_RANGES, SHADER_STORAGE_RANGES, INDEXED_TARGETS };
+    enum { DEPTH_TEST, BLEND, CULL_FACE, CAPABILITIES };
+
+    struct Range {
+        unsigned int buffer;
+        GLintptr offset;
+        GLsizeiptr size;
+    };
+
+    unsigned int program, vertexArray, drawFramebuffer, readFramebuffer, activeUnit;
+    unsigned int textures[RENDER_STATE_TEXTURE_UNITS][TEXTURE_TARGETS];
+    unsigned int buffers[BUFFER_TARGETS];
+    Range ranges[INDEXED_TARGETS][RENDER_STATE_BUFFER_BINDINGS];
+    unsigned int capabilities[CAPABILITIES];
+    unsigned int depthFunc, depthMask, blendSource, blendDestination;
+
+    RenderStateStats stats, lastFrame, total;
+    unsigned int frames = 0;
+
+    // updates a shadowed value, true if GL has to be called
+    bool changed(unsigned int &current, unsigned int value)
+    {
+        if (current == value)
+        {
+            stats.skipped++;
+            return false;
+        }
+        current = value;
+        stats.issued++;
+        return true;
+    }
+
+    void setCapability(GLenum capability, bool enable)
+    {
+        int index = capability == GL_DEPTH_TEST ? DEPTH_TEST : capability == GL_BLEND ? BLEND : capability == GL_CULL_FACE ? CULL_FACE : -1;
+        if (index >= 0 && !changed(capabilities[index], enable ? 1u : 0u))
+            return;
+        if (index < 0)
+            stats.issued++;
+        if (enable)
+            glEnable(capability);
+        else
+            glDisable(capability);
+    }
+
+    static int textureTarget(GLenum target)
+    {
+        switch (target)
+        {
+        case GL_TEXTURE_2D:       return TEXTURE_2D;
+        case GL_TEXTURE_2D_ARRAY: return TEXTURE_2D_ARRAY;
+        case GL_TEXTURE_CUBE_MAP: return TEXTURE_CUBE_MAP;
+        case GL_TEXTURE_BUFFER:   return TEXTURE_BUFFER_TARGET;
+        default:                  return -1;
+        }
+    }
+
+    static int bufferTarget(GLenum target)
+    {
+        switch (target)
+        {
+        case GL_ARRAY_BUFFER:          return ARRAY;
+        case GL_ELEMENT_ARRAY_BUFFER:  return ELEMENT_ARRAY;
+        case GL_UNIFORM_BUFFER:        return UNIFORM;
+        case GL_SHADER_STORAGE_BUFFER: return SHADER_STORAGE;
+        case GL_DRAW_INDIRECT_BUFFER:  return DRAW_INDIRECT;
+        case GL_PIXEL_PACK_BUFFER:     return PIXEL_PACK;
+        case GL_PIXEL_UNPACK_BUFFER:   return PIXEL_UNPACK;
+        case GL_TEXTURE_BUFFER:        return TEXTURE_BUFFER;
+        default:                       return -1;
+        }
+    }
+
+    static int indexedTarget(GLenum target)
+    {
+        return target == GL_UNIFORM_BUFFER ? UNIFORM_RANGES : target == GL_SHADER_STORAGE_BUFFER ? SHADER_STORAGE_RANGES : -1;
+    }
+};
+
+// the main context's state; GL objects are shared with the shader compiler's context, bindings aren't
+inline RenderState& GetRenderState()
+{
+    static RenderState state;
+    return state;
+}
+#endif
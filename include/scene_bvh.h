@@ -0,0 +1,372 @@
+#ifndef SCENE_BVH_H
+#define SCENE_BVH_H
+
+#include <glm/glm.hpp>
+
+#include <bounds.h>
+#include <frustum_culler.h>
+
+#include <vector>
+#include <cfloat>
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+using namespace std;
+
+const unsigned int BVH_LEAF_OBJECTS = 4; // largest leaf; smaller ones are made where the SAH says splitting doesn't pay
+const unsigned int BVH_SAH_BINS = 16;    // split candidates per axis
+
+// A bounding volume hierarchy over the scene's objects (model instances) for hierarchical frustum culling
+// and spatial queries. Objects are the indices of the bounds given to Build(), which splits them by the
+// surface area heuristic over binned centroids. Objects that move afterwards are Update()d, and Refit()
+// then only recomputes the nodes above them, stopping where a box doesn't change. Refitting keeps the
+// tree correct but not optimal: once the dynamic objects have wandered far, Build() again.
+//
+// Every node covers a contiguous range of the object order, so a subtree entirely inside the frustum is
+// appended without visiting it. Queries don't modify the tree and may run concurrently.
+class SceneBVH
+{
+public:
+    // builds the tree over bounds, object i being bounds[i]; empty bounds are treated as a point at the origin
+    void Build(const vector<Bounds> &bounds)
+    {
+        unsigned int count = (unsigned int)bounds.size();
+        objectMin.resize(count);
+        objectMax.resize(count);
+        centroids.resize(count);
+        for (unsigned int i = 0; i < count; i++)
+        {
+            objectMin[i] = bounds[i].Empty() ? glm::vec3(0.0f) : bounds[i].min;
+            objectMax[i] = bounds[i].Empty() ? glm::vec3(0.0f) : bounds[i].max;
+            centroids[i] = (objectMin[i] + objectMax[i]) * 0.5f;
+        }
+        order.resize(count);
+        std::iota(order.begin(), order.end(), 0u);
+        objectLeaf.assign(count, 0);
+        dirtyLeaves.clear();
+        nodes.clear();
+        if (count == 0)
+            return;
+        nodes.reserve(2 * count - 1);
+        nodes.push_back(Node());
+        nodes[0].begin = 0;
+        nodes[0].count = count;
+        nodes[0].parent = NO_NODE;
+
+        // split nodes until they're leaves, depth first so a node's children follow it closely
+        vector<unsigned int> pending(1, 0);
+        while (!pending.empty())
+        {
+            unsigned int node = pending.back();
+            pending.pop_back();
+            if (split(node))
+            {
+                pending.push_back(nodes[node].left + 1);
+                pending.push_back(nodes[node].left);
+            }
+        }
+    }
+
+    // moves an object; queries see the new bounds after the next Refit()
+    void Update(unsigned int object, const Bounds &bounds)
+    {
+        objectMin[object] = bounds.min;
+        objectMax[object] = bounds.max;
+        dirtyLeaves.push_back(objectLeaf[object]);
+    }
+
+    // refits the leaves of the objects updated since the last Refit() and the nodes above them
+    void Refit()
+    {
+        for (unsigned int i = 0; i < dirtyLeaves.size(); i++)
+        {
+            unsigned int node = dirtyLeaves[i];
+            fitLeaf(nodes[node]);
+            for (unsigned int parent = nodes[node].parent; parent != NO_NODE; parent = nodes[parent].parent)
+            {
+                const Node &left = nodes[nodes[parent].left], &right = nodes[nodes[parent].left + 1];
+                glm::vec3 min = glm::min(left.min, right.min), max = glm::max(left.max, right.max);
+                if (min == nodes[parent].min && max == nodes[parent].max)
+                    break; // nothing above changes either
+                nodes[parent].min = min;
+                nodes[parent].max = max;
+            }
+        }
+        dirtyLeaves.clear();
+    }
+
+    // the objects whose boxes intersect the frustum, in no particular order. Subtrees inside a plane aren't
+    // tested against it again, subtrees inside all of them are taken whole.
+    void Cull(const Frustum &frustum, vector<unsigned int> &visible) const
+    {
+        visible.clear();
+        if (nodes.empty())
+            return;
+        struct Entry { unsigned int node, planes; };
+        vector<Entry> stack;
+        stack.reserve(64);
+        stack.push_back({ 0, 0x3F });
+        while (!stack.empty())
+        {
+            Entry entry = stack.back();
+            stack.pop_back();
+            const Node &node = nodes[entry.node];
+            unsigned int planes = classify(frustum, node.min, node.max, entry.planes);
+            if (planes == OUTSIDE)
+                continue;
+            if (planes == 0)
+                visible.insert(visible.end(), order.begin() + node.begin, order.begin() + node.begin + node.count);
+            else if (node.left == 0)
+            {
+                for (unsigned int i = node.begin; i < node.begin + node.count; i++)
+                    if (classify(frustum, objectMin[order[i]], objectMax[order[i]], planes) != OUTSIDE)
+                        visible.push_back(order[i]);
+            }
+            else
+            {
+                stack.push_back({ node.left + 1, planes });
+                stack.push_back({ node.left, planes });
+            }
+        }
+    }
+
+    // the objects whose boxes reach within radius of center
+    void QueryRange(const glm::vec3 &center, float radius, vector<unsigned int> &results) const
+    {
+        results.clear();
+        if (nodes.empty())
+            return;
+        float radiusSquared = radius * radius;
+        vector<unsigned int> stack;
+        stack.reserve(64);
+        stack.push_back(0);
+        while (!stack.empty())
+        {
+            const Node &node = nodes[stack.back()];
+            stack.pop_back();
+            if (distanceSquared(center, node.min, node.max) > radiusSquared)
+                continue;
+            if (node.left != 0)
+            {
+                stack.push_back(node.left + 1);
+                stack.push_back(node.left);
+                continue;
+            }
+            for (unsigned int i = node.begin; i < node.begin + node.count; i++)
+                if (distanceSquared(center, objectMin[order[i]], objectMax[order[i]]) <= radiusSquared)
+                    results.push_back(order[i]);
+        }
+    }
+
+    // the object whose box is closest to point (0 inside it), -1 if none is within maxDistance
+    int Nearest(const glm::vec3 &point, float maxDistance = FLT_MAX) const
+    {
+        int nearest = -1;
+        if (nodes.empty())
+            return nearest;
+        float best = maxDistance < FLT_MAX ? maxDistance * maxDistance : FLT_MAX;
+        struct Entry { unsigned int node; float distance; };
+        vector<Entry> stack;
+        stack.reserve(64);
+        stack.push_back({ 0, distanceSquared(point, nodes[0].min, nodes[0].max) });
+        while (!stack.empty())
+        {
+            Entry entry = stack.back();
+            stack.pop_back();
+            if (entry.distance > best)
+                continue; // something closer turned up since this was pushed
+            const Node &node = nodes[entry.node];
+            if (node.left == 0)
+            {
+                for (unsigned int i = node.begin; i < node.begin + node.count; i++)
+                {
+                    float distance = distanceSquared(point, objectMin[order[i]], objectMax[order[i]]);
+                    if (distance <= best)
+                    {
+                        best = distance;
+                        nearest = (int)order[i];
+                    }
+                }
+                continue;
+            }
+            // visit the nearer child first, it's the likelier to shrink best
+            Entry left = { node.left, distanceSquared(point, nodes[node.left].min, nodes[node.left].max) };
+            Entry right = { node.left + 1, distanceSquared(point, nodes[node.left + 1].min, nodes[node.left + 1].max) };
+            if (left.distance < right.distance)
+                std::swap(left, right);
+            if (left.distance <= best)
+                stack.push_back(left);
+            if (right.distance <= best)
+                stack.push_back(right);
+        }
+        return nearest;
+    }
+
+    unsigned int NodeCount() const { return (unsigned int)nodes.size(); }
+    unsigned int ObjectCount() const { return (unsigned int)order.size(); }
+
+private:
+    static const unsigned int NO_NODE = ~0u;
+    static const unsigned int OUTSIDE = ~0u; // classify()'s result for boxes outside a plane
+
+    struct Node {
+        glm::vec3 min = glm::vec3(0.0f), max = glm::vec3(0.0f);
+        unsigned int left = 0;   // the left child, the right one follows it; 0 for leaves (the root is nobody's child)
+        unsigned int begin = 0;  // the node's objects are order[begin, begin + count)
+        unsigned int count = 0;
+        unsigned int parent = 0;
+    };
+
+    vector<Node> nodes;
+    vector<glm::vec3> objectMin, objectMax, centroids;
+    vector<unsigned int> order;      // object indices, every node's a contiguous range
+    vector<unsigned int> objectLeaf; // the leaf holding each object
+    vector<unsigned int> dirtyLeaves;
+
+    static float area(const glm::vec3 &min, const glm::vec3 &max)
+    {
+        glm::vec3 size = max - min;
+        return size.x * size.y + size.y * size.z + size.z * size.x;
+    }
+
+    static float distanceSquared(const glm::vec3 &point, const glm::vec3 &min, const glm::vec3 &max)
+    {
+        glm::vec3 delta = glm::max(glm::max(min - point, point - max), glm::vec3(0.0f));
+        return glm::dot(delta, delta);
+    }
+
+    // the planes of mask the box straddles, or OUTSIDE if it's outside one of them
+    static unsigned int classify(const Frustum &frustum, const glm::vec3 &min, const glm::vec3 &max, unsigned int mask)
+    {
+        glm::vec3 center = (min + max) * 0.5f;
+        glm::vec3 extent = (max - min) * 0.5f;
+        for (unsigned int i = 0; i < 6; i++)
+        {
+            if (!(mask & (1u << i)))
+                continue;
+            const glm::vec4 &plane = frustum.planes[i];
+            float distance = center.x * plane.x + center.y * plane.y + center.z * plane.z + plane.w;
+            float reach = extent.x * std::abs(plane.x) + extent.y * std::abs(plane.y) + extent.z * std::abs(plane.z);
+            if (distance + reach < 0.0f)
+                return OUTSIDE;
+            if (distance - reach >= 0.0f)
+                mask &= ~(1u << i);
+        }
+        return mask;
+    }
+
+    void fitLeaf(Node &node)
+    {
+        node.min = glm::vec3(FLT_MAX);
+        node.max = glm::vec3(-FLT_MAX);
+        for (unsigned int i = node.begin; i < node.begin + node.count; i++)
+        {
+            node.min = glm::min(node.min, objectMin[order[i]]);
+            node.max = glm::max(node.max, objectMax[order[i]]);
+        }
+    }
+
+    // fits the node to its objects and splits them between two new children, unless it stays a leaf
+    bool split(unsigned int index)
+    {
+        unsigned int begin = nodes[index].begin, count = nodes[index].count;
+        glm::vec3 centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+        fitLeaf(nodes[index]);
+        for (unsigned int i = begin; i < begin + count; i++)
+        {
+            centroidMin = glm::min(centroidMin, centroids[order[i]]);
+            centroidMax = glm::max(centroidMax, centroids[order[i]]);
+        }
+
+        // the cheapest split between bins, costed by the children's areas times their object counts
+        float bestCost = FLT_MAX;
+        int bestAxis = -1;
+        unsigned int bestSplit = 0;
+        for (int axis = 0; axis < 3 && count > 1; axis++)
+        {
+            float extent = centroidMax[axis] - centroidMin[axis];
+            if (extent <= 0.0f)
+                continue;
+            glm::vec3 binMin[BVH_SAH_BINS], binMax[BVH_SAH_BINS];
+            unsigned int binCount[BVH_SAH_BINS] = {};
+            for (unsigned int b = 0; b < BVH_SAH_BINS; b++)
+            {
+                binMin[b] = glm::vec3(FLT_MAX);
+                binMax[b] = glm::vec3(-FLT_MAX);
+            }
+            float scale = BVH_SAH_BINS / extent;
+            for (unsigned int i = begin; i < begin + count; i++)
+            {
+                unsigned int object = order[i];
+                unsigned int b = std::min(BVH_SAH_BINS - 1, (unsigned int)((centroids[object][axis] - centroidMin[axis]) * scale));
+                binMin[b] = glm::min(binMin[b], objectMin[object]);
+                binMax[b] = glm::max(binMax[b], objectMax[object]);
+                binCount[b]++;
+            }
+            // sweep from the right for the right sides' areas, then from the left
+            float rightArea[BVH_SAH_BINS];
+            unsigned int rightCount[BVH_SAH_BINS];
+            glm::vec3 sweepMin(FLT_MAX), sweepMax(-FLT_MAX);
+            unsigned int sweepCount = 0;
+            for (unsigned int b = BVH_SAH_BINS - 1; b > 0; b--)
+            {
+                sweepMin = glm::min(sweepMin, binMin[b]);
+                sweepMax = glm::max(sweepMax, binMax[b]);
+                sweepCount += binCount[b];
+                rightArea[b] = sweepCount ? area(sweepMin, sweepMax) : 0.0f;
+                rightCount[b] = sweepCount;
+            }
+            sweepMin = glm::vec3(FLT_MAX);
+            sweepMax = glm::vec3(-FLT_MAX);
+            sweepCount = 0;
+            for (unsigned int b = 1; b < BVH_SAH_BINS; b++)
+            {
+                sweepMin = glm::min(sweepMin, binMin[b - 1]);
+                sweepMax = glm::max(sweepMax, binMax[b - 1]);
+                sweepCount += binCount[b - 1];
+                if (sweepCount == 0 || rightCount[b] == 0)
+                    continue;
+                float cost = sweepCount * area(sweepMin, sweepMax) + rightCount[b] * rightArea[b];
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    bestAxis = axis;
+                    bestSplit = b;
+                }
+            }
+        }
+
+        // a leaf when splitting costs more than testing every object (traversal counted as one test),
+        // unless that leaves it too large
+        float leafCost = (count - 1.0f) * area(nodes[index].min, nodes[index].max);
+        unsigned int middle;
+        if (bestAxis >= 0 && (bestCost < leafCost || count > BVH_LEAF_OBJECTS))
+        {
+            float scale = BVH_SAH_BINS / (centroidMax[bestAxis] - centroidMin[bestAxis]);
+            float axisMin = centroidMin[bestAxis];
+            middle = (unsigned int)(std::partition(order.begin() + begin, order.begin() + begin + count, [&](unsigned int object) {
+                return std::min(BVH_SAH_BINS - 1, (unsigned int)((centroids[object][bestAxis] - axisMin) * scale)) < bestSplit;
+            }) - order.begin());
+        }
+        else if (count > BVH_LEAF_OBJECTS)
+            middle = begin + count / 2; // every centroid in one place, any halves will do
+        else
+        {
+            for (unsigned int i = begin; i < begin + count; i++)
+                objectLeaf[order[i]] = index;
+            return false;
+        }
+
+        unsigned int left = (unsigned int)nodes.size();
+        nodes.push_back(Node());
+        nodes.push_back(Node());
+        nodes[index].left = left;
+        nodes[left].begin = begin;
+        nodes[left].count = middle - begin;
+        nodes[left + 1].begin = middle;
+        nodes[left + 1].count = begin + count - middle;
+        nodes[left].parent = nodes[left + 1].parent = index;
+        return true;
+    }
+};
+#endif
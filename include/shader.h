@@ -4,18 +4,102 @@
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 
+#include <shader_compiler.h>
+#include <render_state.h>
+
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <filesystem>
+
+// FNV-1a hash of a uniform name, evaluated by the compiler for literals
+constexpr uint32_t HashUniformName(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    while (*name)
+        hash = (hash ^ (uint32_t)(unsigned char)*name++) * 16777619u;
+    return hash;
+}
+
+// A uniform name reduced to its hash, written "pointLights[2].quadratic"_uniform. Setting a uniform through
+// an id is a hash table lookup into the locations the Shader reflected at link time: no string is built
+// and the driver isn't asked for the location.
+struct UniformID
+{
+    uint32_t hash;
+    constexpr explicit UniformID(const char *name) : hash(HashUniformName(name)) {}
+};
+
+constexpr UniformID operator"" _uniform(const char *name, size_t)
+{
+    return UniformID(name);
+}
+
+// binding points of the engine's uniform blocks (see uniform_buffer.h), assigned to every program that uses them
+const unsigned int CAMERA_BLOCK_BINDING   = 0;
+const unsigned int LIGHTS_BLOCK_BINDING   = 1;
+const unsigned int MATERIAL_BLOCK_BINDING = 2;
+
+// texture units of the material samplers (see material.h), assigned to every program that samples them
+const unsigned int DIFFUSE_TEXTURE_UNIT = 0; // texture_diffuse1
+const unsigned int PACKED_TEXTURE_UNIT  = 1; // texture_packed1
+const unsigned int NORMAL_TEXTURE_UNIT  = 2; // texture_normal1
+const unsigned int DRAW_RECORDS_TEXTURE_UNIT = 3; // drawRecords, the render queue's per draw records
+const unsigned int CLUSTER_LIGHTS_TEXTURE_UNIT  = 4; // clusterLights, clusterGrid and clusterIndices on the next two units
+const unsigned int CLUSTER_GRID_TEXTURE_UNIT    = 5;
+const unsigned int CLUSTER_INDICES_TEXTURE_UNIT = 6;
+const unsigned int GBUFFER_ALBEDO_TEXTURE_UNIT = 7; // gbufferAlbedo, gbufferNormal, gbufferMaterial and gbufferDepth on the next three
+const unsigned int GBUFFER_NORMAL_TEXTURE_UNIT   = 8;
+const unsigned int GBUFFER_MATERIAL_TEXTURE_UNIT = 9;
+const unsigned int GBUFFER_DEPTH_TEXTURE_UNIT    = 10;
+const unsigned int SHADOW_MAP_TEXTURE_UNIT = 11; // shadowMap, the directional light's cascades (see shadow_cascades.h)
+
+// linked program binaries are cached here
+const char *const SHADER_CACHE_DIRECTORY = "data/cache/shaders";
+
+// main thread time spent building programs (reading, compiling or submitting, checking and reflecting), for
+// comparing startup with and without the program binary cache and the shader compiler
+struct ShaderStats {
+    unsigned int programs = 0;
+    unsigned int cacheHits = 0;
+    double seconds = 0.0;
+};
+
+inline ShaderStats& GetShaderStats()
+{
+    static ShaderStats stats;
+    return stats;
+}
+
+// program binaries need GL 4.1 (or ARB_get_program_binary) and a driver that offers at least one format
+inline bool ProgramBinarySupported()
+{
+    if (!GLAD_GL_VERSION_4_1)
+        return false;
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return formats > 0;
+}
 
 class Shader
 {
 public:
     unsigned int ID;
-    // constructor generates the shader on the fly
+    // constructor generates the shader on the fly, or loads the program binary a previous run cached.
+    // defines ("#define NAME VALUE" lines) are injected after the #version line of both stages.
+    // With a compiler the program is only submitted and links in the background; it is finished by
+    // compiler->Finish()/Update() or, at the latest, the first use().
     // ------------------------------------------------------------------------
-    Shader(const char* vertexPath, const char* fragmentPath)
+    Shader(const char* vertexPath, const char* fragmentPath, bool useProgramCache = true, const std::string &defines = "",
+           ShaderCompiler *compiler = nullptr)
+        : compiler(compiler)
     {
         // 1. retrieve the vertex/fragment source code from filePath
         std::string vertexCode;
@@ -45,97 +129,387 @@ public:
         {
             std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
         }
-        const char* vShaderCode = vertexCode.c_str();
-        const char * fShaderCode = fragmentCode.c_str();
-        // 2. compile shaders
-        unsigned int vertex, fragment;
-        // vertex shader
-        vertex = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(vertex, 1, &vShaderCode, NULL);
-        glCompileShader(vertex);
-        checkCompileErrors(vertex, "VERTEX");
-        // fragment Shader
-        fragment = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(fragment, 1, &fShaderCode, NULL);
-        glCompileShader(fragment);
-        checkCompileErrors(fragment, "FRAGMENT");
-        // shader Program
+        vertexCode = injectDefines(vertexCode, defines);
+        fragmentCode = injectDefines(fragmentCode, defines);
+        auto start = std::chrono::steady_clock::now();
+        ShaderStats &stats = GetShaderStats();
+        stats.programs++;
+
+        // 2. try the program binary cache, keyed by the exact sources and the driver that built the binary
         ID = glCreateProgram();
-        glAttachShader(ID, vertex);
-        glAttachShader(ID, fragment);
-        glLinkProgram(ID);
-        checkCompileErrors(ID, "PROGRAM");
-        // delete the shaders as they're linked into our program now and no longer necessery
-        glDeleteShader(vertex);
-        glDeleteShader(fragment);
+        std::string cachePath;
+        if (useProgramCache && ProgramBinarySupported())
+        {
+            cachePath = programCachePath(vertexCode, fragmentCode);
+            if (loadProgramBinary(cachePath))
+                stats.cacheHits++;
+            else
+                glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+        }
+        if (linked())
+            finishLink(0, 0, "");
+        else if (compiler)
+        {
+            // 3. compile shaders, without waiting for them
+            pending = true;
+            compiler->Submit(ID, vertexCode, fragmentCode, [this, cachePath](unsigned int vertex, unsigned int fragment) {
+                auto start = std::chrono::steady_clock::now();
+                finishLink(vertex, fragment, cachePath);
+                GetShaderStats().seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            });
+        }
+        else
+        {
+            const char* vShaderCode = vertexCode.c_str();
+            const char * fShaderCode = fragmentCode.c_str();
+            // 3. compile shaders
+            unsigned int vertex, fragment;
+            // vertex shader
+            vertex = glCreateShader(GL_VERTEX_SHADER);
+            glShaderSource(vertex, 1, &vShaderCode, NULL);
+            glCompileShader(vertex);
+            // fragment Shader
+            fragment = glCreateShader(GL_FRAGMENT_SHADER);
+            glShaderSource(fragment, 1, &fShaderCode, NULL);
+            glCompileShader(fragment);
+            // shader Program
+            glAttachShader(ID, vertex);
+            glAttachShader(ID, fragment);
+            glLinkProgram(ID);
+            finishLink(vertex, fragment, cachePath);
+        }
 
+        stats.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
     }
-    // activate the shader
+    // the compiler finishes the program through this object, so it stays where it was constructed
+    // ------------------------------------------------------------------------
+    Shader(const Shader&) = delete;
+    Shader& operator=(const Shader&) = delete;
+    // activate the shader, waiting for it first if it's still being compiled
     // ------------------------------------------------------------------------
-    void use() const
+    void use()
     { 
-        glUseProgram(ID); 
+        if (pending)
+            compiler->Wait(ID);
+        GetRenderState().UseProgram(ID); 
     }
-    // utility uniform functions
+    // false while the program is still being compiled by the ShaderCompiler
+    bool ready() const
+    {
+        return !pending;
+    }
+    // location of an active uniform, -1 (ignored by glUniform*) when the program doesn't use it
     // ------------------------------------------------------------------------
+    GLint location(UniformID id) const
+    {
+        auto found = uniforms.find(id.hash);
+        return found != uniforms.end() ? found->second : -1;
+    }
+    // utility uniform functions, by id (preferred, "name"_uniform) or by name
+    // ------------------------------------------------------------------------
+    void setBool(UniformID id, bool value) const
+    {         
+        glUniform1i(location(id), (int)value); 
+    }
     void setBool(const std::string &name, bool value) const
     {         
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value); 
+        setBool(UniformID(name.c_str()), value); 
     }
     // ------------------------------------------------------------------------
+    void setInt(UniformID id, int value) const
+    { 
+        glUniform1i(location(id), value); 
+    }
     void setInt(const std::string &name, int value) const
     { 
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), value); 
+        setInt(UniformID(name.c_str()), value); 
     }
     // ------------------------------------------------------------------------
+    void setFloat(UniformID id, float value) const
+    { 
+        glUniform1f(location(id), value); 
+    }
     void setFloat(const std::string &name, float value) const
     { 
-        glUniform1f(glGetUniformLocation(ID, name.c_str()), value); 
+        setFloat(UniformID(name.c_str()), value); 
     }
     // ------------------------------------------------------------------------
+    void setVec2(UniformID id, const glm::vec2 &value) const
+    { 
+        glUniform2fv(location(id), 1, &value[0]); 
+    }
+    void setVec2(UniformID id, float x, float y) const
+    { 
+        glUniform2f(location(id), x, y); 
+    }
     void setVec2(const std::string &name, const glm::vec2 &value) const
     { 
-        glUniform2fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]); 
+        setVec2(UniformID(name.c_str()), value); 
     }
     void setVec2(const std::string &name, float x, float y) const
     { 
-        glUniform2f(glGetUniformLocation(ID, name.c_str()), x, y); 
+        setVec2(UniformID(name.c_str()), x, y); 
     }
     // ------------------------------------------------------------------------
+    void setVec3(UniformID id, const glm::vec3 &value) const
+    { 
+        glUniform3fv(location(id), 1, &value[0]); 
+    }
+    void setVec3(UniformID id, float x, float y, float z) const
+    { 
+        glUniform3f(location(id), x, y, z); 
+    }
     void setVec3(const std::string &name, const glm::vec3 &value) const
     { 
-        glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]); 
+        setVec3(UniformID(name.c_str()), value); 
     }
     void setVec3(const std::string &name, float x, float y, float z) const
     { 
-        glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z); 
+        setVec3(UniformID(name.c_str()), x, y, z); 
     }
     // ------------------------------------------------------------------------
+    void setVec4(UniformID id, const glm::vec4 &value) const
+    { 
+        glUniform4fv(location(id), 1, &value[0]); 
+    }
+    void setVec4(UniformID id, float x, float y, float z, float w) const
+    { 
+        glUniform4f(location(id), x, y, z, w); 
+    }
     void setVec4(const std::string &name, const glm::vec4 &value) const
     { 
-        glUniform4fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]); 
+        setVec4(UniformID(name.c_str()), value); 
     }
     void setVec4(const std::string &name, float x, float y, float z, float w) const
     { 
-        glUniform4f(glGetUniformLocation(ID, name.c_str()), x, y, z, w); 
+        setVec4(UniformID(name.c_str()), x, y, z, w); 
+    }
+    // sets count consecutive elements of a vec4 array, starting at the element id names
+    void setVec4Array(UniformID id, int count, const glm::vec4 *values) const
+    { 
+        glUniform4fv(location(id), count, &values[0][0]); 
     }
     // ------------------------------------------------------------------------
+    void setMat2(UniformID id, const glm::mat2 &mat) const
+    {
+        glUniformMatrix2fv(location(id), 1, GL_FALSE, &mat[0][0]);
+    }
     void setMat2(const std::string &name, const glm::mat2 &mat) const
     {
-        glUniformMatrix2fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        setMat2(UniformID(name.c_str()), mat);
     }
     // ------------------------------------------------------------------------
+    void setMat3(UniformID id, const glm::mat3 &mat) const
+    {
+        glUniformMatrix3fv(location(id), 1, GL_FALSE, &mat[0][0]);
+    }
     void setMat3(const std::string &name, const glm::mat3 &mat) const
     {
-        glUniformMatrix3fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        setMat3(UniformID(name.c_str()), mat);
     }
     // ------------------------------------------------------------------------
+    void setMat4(UniformID id, const glm::mat4 &mat) const
+    {
+        glUniformMatrix4fv(location(id), 1, GL_FALSE, &mat[0][0]);
+    }
     void setMat4(const std::string &name, const glm::mat4 &mat) const
     {
-        glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+        setMat4(UniformID(name.c_str()), mat);
+    }
+    // sets count consecutive elements of a mat4 array, starting at the element id names
+    void setMat4Array(UniformID id, int count, const glm::mat4 *mats) const
+    {
+        glUniformMatrix4fv(location(id), count, GL_FALSE, &mats[0][0][0]);
     }
 
 private:
+    std::unordered_map<uint32_t, GLint> uniforms; // name hash -> location of every active uniform
+    ShaderCompiler *compiler;
+    bool pending = false;
+
+    // everything after glLinkProgram: reports errors, caches the binary and reflects the linked program.
+    // vertex/fragment are 0 when the program came from the binary cache.
+    // ------------------------------------------------------------------------
+    void finishLink(unsigned int vertex, unsigned int fragment, const std::string &cachePath)
+    {
+        pending = false;
+        if (vertex != 0)
+        {
+            checkCompileErrors(vertex, "VERTEX");
+            checkCompileErrors(fragment, "FRAGMENT");
+            checkCompileErrors(ID, "PROGRAM");
+            // delete the shaders as they're linked into our program now and no longer necessery
+            glDetachShader(ID, vertex);
+            glDetachShader(ID, fragment);
+            glDeleteShader(vertex);
+            glDeleteShader(fragment);
+            if (!cachePath.empty() && linked())
+                saveProgramBinary(cachePath);
+        }
+        reflectUniforms();
+        bindUniformBlock("Camera", CAMERA_BLOCK_BINDING);
+        bindUniformBlock("Lights", LIGHTS_BLOCK_BINDING);
+        bindUniformBlock("Material", MATERIAL_BLOCK_BINDING);
+        bindSampler("texture_diffuse1"_uniform, DIFFUSE_TEXTURE_UNIT);
+        bindSampler("texture_packed1"_uniform, PACKED_TEXTURE_UNIT);
+        bindSampler("texture_normal1"_uniform, NORMAL_TEXTURE_UNIT);
+        bindSampler("drawRecords"_uniform, DRAW_RECORDS_TEXTURE_UNIT);
+        bindSampler("clusterLights"_uniform, CLUSTER_LIGHTS_TEXTURE_UNIT);
+        bindSampler("clusterGrid"_uniform, CLUSTER_GRID_TEXTURE_UNIT);
+        bindSampler("clusterIndices"_uniform, CLUSTER_INDICES_TEXTURE_UNIT);
+        bindSampler("gbufferAlbedo"_uniform, GBUFFER_ALBEDO_TEXTURE_UNIT);
+        bindSampler("gbufferNormal"_uniform, GBUFFER_NORMAL_TEXTURE_UNIT);
+        bindSampler("gbufferMaterial"_uniform, GBUFFER_MATERIAL_TEXTURE_UNIT);
+        bindSampler("gbufferDepth"_uniform, GBUFFER_DEPTH_TEXTURE_UNIT);
+        bindSampler("shadowMap"_uniform, SHADOW_MAP_TEXTURE_UNIT);
+    }
+
+    // builds the uniform table from the linked program
+    // ------------------------------------------------------------------------
+    void reflectUniforms()
+    {
+        uniforms.clear();
+        GLint count = 0, maxLength = 0;
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+        std::vector<GLchar> buffer(maxLength + 1);
+        for (GLint i = 0; i < count; i++)
+        {
+            GLsizei length = 0;
+            GLint size = 0;
+            GLenum type;
+            glGetActiveUniform(ID, (GLuint)i, (GLsizei)buffer.size(), &length, &size, &type, buffer.data());
+            std::string name(buffer.data(), length);
+            GLint uniformLocation = glGetUniformLocation(ID, name.c_str());
+            if (uniformLocation < 0)
+                continue; // uniform block members have no location
+            addUniform(name, uniformLocation);
+            // arrays are reported once as "name[0]"; make "name" and every element addressable too
+            if (name.size() > 3 && name.compare(name.size() - 3, 3, "[0]") == 0)
+            {
+                std::string base = name.substr(0, name.size() - 3);
+                addUniform(base, uniformLocation);
+                for (GLint element = 1; element < size; element++)
+                {
+                    std::string elementName = base + "[" + std::to_string(element) + "]";
+                    addUniform(elementName, glGetUniformLocation(ID, elementName.c_str()));
+                }
+            }
+        }
+    }
+
+    static std::string injectDefines(const std::string &code, const std::string &defines)
+    {
+        if (defines.empty())
+            return code;
+        // #version has to stay the first statement
+        size_t insert = 0;
+        if (code.compare(0, 8, "#version") == 0)
+        {
+            insert = code.find('\n');
+            insert = insert == std::string::npos ? code.size() : insert + 1;
+        }
+        std::string result = code.substr(0, insert);
+        if (!result.empty() && result.back() != '\n')
+            result += '\n';
+        // keep compiler messages pointing at the lines of the file
+        return result + defines + "#line " + std::to_string(insert > 0 ? 2 : 1) + "\n" + code.substr(insert);
+    }
+
+    bool linked() const
+    {
+        GLint success = GL_FALSE;
+        glGetProgramiv(ID, GL_LINK_STATUS, &success);
+        return success == GL_TRUE;
+    }
+
+    // cache file of a program: a hash over the sources and the vendor, renderer and version strings,
+    // since a binary is only valid for the driver that produced it
+    // ------------------------------------------------------------------------
+    static std::string programCachePath(const std::string &vertexCode, const std::string &fragmentCode)
+    {
+        uint64_t hash = 14695981039346656037ull;
+        auto mix = [&hash](const char *text) {
+            for (; text && *text; text++)
+                hash = (hash ^ (uint64_t)(unsigned char)*text) * 1099511628211ull;
+            hash = (hash ^ 0xFF) * 1099511628211ull; // separator, so "ab"+"c" != "a"+"bc"
+        };
+        mix((const char*)glGetString(GL_VENDOR));
+        mix((const char*)glGetString(GL_RENDERER));
+        mix((const char*)glGetString(GL_VERSION));
+        mix(vertexCode.c_str());
+        mix(fragmentCode.c_str());
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash);
+        return std::string(SHADER_CACHE_DIRECTORY) + "/" + name;
+    }
+
+    // file layout: "EPB1", binary format, binary length, binary
+    bool loadProgramBinary(const std::string &path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+            return false;
+        char magic[4];
+        uint32_t header[2] = { 0, 0 };
+        file.read(magic, 4);
+        file.read((char*)header, sizeof(header));
+        if (!file || std::memcmp(magic, "EPB1", 4) != 0 || header[1] == 0)
+            return false;
+        std::vector<char> binary(header[1]);
+        file.read(binary.data(), binary.size());
+        if (!file)
+            return false;
+        // drivers reject binaries from other versions or hardware; that's not an error, just compile
+        glProgramBinary(ID, (GLenum)header[0], binary.data(), (GLsizei)binary.size());
+        return linked();
+    }
+
+    void saveProgramBinary(const std::string &path)
+    {
+        GLint length = 0;
+        glGetProgramiv(ID, GL_PROGRAM_BINARY_LENGTH, &length);
+        if (length <= 0)
+            return;
+        std::vector<char> binary(length);
+        GLenum format = 0;
+        glGetProgramBinary(ID, length, NULL, &format, binary.data());
+        std::error_code error;
+        std::filesystem::create_directories(SHADER_CACHE_DIRECTORY, error);
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        uint32_t header[2] = { (uint32_t)format, (uint32_t)length };
+        file.write("EPB1", 4);
+        file.write((const char*)header, sizeof(header));
+        file.write(binary.data(), binary.size());
+        if (!file)
+            std::cout << "ERROR::SHADER::PROGRAM_CACHE_WRITE_FAILED: " << path << std::endl;
+    }
+
+    // GLSL 3.30 can't declare block bindings, so they're assigned by name after linking
+    void bindUniformBlock(const char *name, unsigned int binding)
+    {
+        GLuint index = glGetUniformBlockIndex(ID, name);
+        if (index != GL_INVALID_INDEX)
+            glUniformBlockBinding(ID, index, binding);
+    }
+
+    // samplers keep their unit for the life of the program, so materials only bind textures
+    void bindSampler(UniformID id, unsigned int unit)
+    {
+        GLint samplerLocation = location(id);
+        if (samplerLocation < 0)
+            return;
+        GetRenderState().UseProgram(ID);
+        glUniform1i(samplerLocation, (int)unit);
+    }
+
+    void addUniform(const std::string &name, GLint uniformLocation)
+    {
+        auto inserted = uniforms.emplace(HashUniformName(name.c_str()), uniformLocation);
+        if (!inserted.second && inserted.first->second != uniformLocation)
+            std::cout << "ERROR::SHADER::UNIFORM_HASH_COLLISION: " << name << std::endl;
+    }
+
     // utility function for checking shader compilation/linking errors.
     // ------------------------------------------------------------------------
     void checkCompileErrors(GLuint shader, std::string type)
@@ -0,0 +1,256 @@
+#ifndef SHADER_COMPILER_H
+#define SHADER_COMPILER_H
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include <string>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstring>
+#include <iostream>
+using namespace std;
+
+// GL_KHR_parallel_shader_compile, glad is generated without extensions
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+
+// Compiles and links programs without making the caller wait for each one. Programs are submitted with
+// their sources and the link result is only looked at once the program is complete (or needed), so the
+// driver can work on all of them at once:
+//  - with GL_KHR_parallel_shader_compile the driver compiles on its own threads and completion is polled
+//    with GL_COMPLETION_STATUS_KHR,
+//  - otherwise a hidden window's context, shared with the main one, compiles on a background thread,
+//  - without either (no extension and useBackground false) Submit() compiles and links right away.
+class ShaderCompiler
+{
+public:
+    // called on the main thread once a program has linked (or failed to); vertex/fragment are the shader
+    // objects, still attached, for reading compile logs
+    typedef std::function<void(unsigned int vertex, unsigned int fragment)> LinkedCallback;
+
+    enum Mode { SYNCHRONOUS, PARALLEL_KHR, BACKGROUND_CONTEXT };
+
+    // window: the main window, current on the calling thread
+    ShaderCompiler(GLFWwindow *window, bool useBackground = true)
+    {
+        if (hasExtension("GL_KHR_parallel_shader_compile"))
+        {
+            PFNGLMAXSHADERCOMPILERTHREADSKHRPROC maxThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)glfwGetProcAddress("glMaxShaderCompilerThreadsKHR");
+            if (maxThreads)
+                maxThreads(0xFFFFFFFF); // as many as the implementation likes
+            mode = PARALLEL_KHR;
+        }
+        else if (useBackground)
+        {
+            // same context hints as the main window, which are still set
+            glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+            backgroundWindow = glfwCreateWindow(1, 1, "shader compiler", NULL, window);
+            glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+            if (backgroundWindow)
+            {
+                mode = BACKGROUND_CONTEXT;
+                worker = std::thread(&ShaderCompiler::workerMain, this);
+            }
+            else
+                std::cout << "ShaderCompiler: no shared context, shaders are compiled synchronously" << std::endl;
+        }
+    }
+
+    ~ShaderCompiler()
+    {
+        if (worker.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            wake.notify_all();
+            worker.join();
+        }
+        if (backgroundWindow)
+            glfwDestroyWindow(backgroundWindow);
+    }
+
+    ShaderCompiler(const ShaderCompiler&) = delete;
+    ShaderCompiler& operator=(const ShaderCompiler&) = delete;
+
+    Mode GetMode() const { return mode; }
+    const char* ModeName() const
+    {
+        return mode == PARALLEL_KHR ? "KHR_parallel_shader_compile" : mode == BACKGROUND_CONTEXT ? "background context" : "synchronous";
+    }
+
+    // starts compiling and linking program; linked is called from Update(), Finish() or Wait()
+    void Submit(unsigned int program, const string &vertexCode, const string &fragmentCode, LinkedCallback linked)
+    {
+        auto job = std::make_shared<Job>();
+        job->program = program;
+        job->vertexCode = vertexCode;
+        job->fragmentCode = fragmentCode;
+        job->linked = std::move(linked);
+        jobs.push_back(job);
+
+        if (mode == BACKGROUND_CONTEXT)
+        {
+            // the program was created on this context, make sure the background one can see it
+            glFlush();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                queue.push_back(job);
+            }
+            wake.notify_one();
+        }
+        else
+        {
+            // the KHR path returns from these right away; without it they block, which is all we can do
+            compile(*job);
+            job->done.store(true, std::memory_order_release);
+        }
+    }
+
+    // hands out every program that completed since the last call, never blocks
+    void Update()
+    {
+        for (unsigned int i = 0; i < jobs.size(); )
+        {
+            if (complete(*jobs[i]))
+                retire(i);
+            else
+                i++;
+        }
+    }
+
+    // blocks until program has linked and hands it out
+    void Wait(unsigned int program)
+    {
+        for (unsigned int i = 0; i < jobs.size(); i++)
+        {
+            if (jobs[i]->program != program)
+                continue;
+            waitFor(*jobs[i]);
+            retire(i);
+            return;
+        }
+    }
+
+    // blocks until every submitted program has linked, handing them out in submission order
+    void Finish()
+    {
+        while (!jobs.empty())
+        {
+            waitFor(*jobs.front());
+            retire(0);
+        }
+    }
+
+    bool Pending(unsigned int program) const
+    {
+        for (unsigned int i = 0; i < jobs.size(); i++)
+            if (jobs[i]->program == program)
+                return true;
+        return false;
+    }
+
+private:
+    struct Job {
+        unsigned int program = 0, vertex = 0, fragment = 0;
+        string vertexCode, fragmentCode;
+        LinkedCallback linked;
+        std::atomic<bool> done{false};
+    };
+
+    Mode mode = SYNCHRONOUS;
+    std::deque<std::shared_ptr<Job>> jobs; // submitted and not yet handed out, main thread only
+
+    GLFWwindow *backgroundWindow = nullptr;
+    std::thread worker;
+    std::deque<std::shared_ptr<Job>> queue; // waiting for the background thread
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    static bool hasExtension(const char *name)
+    {
+        GLint count = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+        for (GLint i = 0; i < count; i++)
+        {
+            const char *extension = (const char*)glGetStringi(GL_EXTENSIONS, (GLuint)i);
+            if (extension && std::strcmp(extension, name) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    // issues the compile and link, without asking for any status
+    static void compile(Job &job)
+    {
+        const char *vertexCode = job.vertexCode.c_str();
+        const char *fragmentCode = job.fragmentCode.c_str();
+        job.vertex = glCreateShader(GL_VERTEX_SHADER);
+        glShaderSource(job.vertex, 1, &vertexCode, NULL);
+        glCompileShader(job.vertex);
+        job.fragment = glCreateShader(GL_FRAGMENT_SHADER);
+        glShaderSource(job.fragment, 1, &fragmentCode, NULL);
+        glCompileShader(job.fragment);
+        glAttachShader(job.program, job.vertex);
+        glAttachShader(job.program, job.fragment);
+        glLinkProgram(job.program);
+    }
+
+    bool complete(Job &job) const
+    {
+        if (!job.done.load(std::memory_order_acquire))
+            return false;
+        if (mode != PARALLEL_KHR)
+            return true;
+        GLint status = GL_FALSE;
+        glGetProgramiv(job.program, GL_COMPLETION_STATUS_KHR, &status);
+        return status == GL_TRUE;
+    }
+
+    void waitFor(Job &job) const
+    {
+        // with the KHR extension the first status query simply blocks until the link is done
+        while (!job.done.load(std::memory_order_acquire))
+            std::this_thread::yield();
+    }
+
+    void retire(unsigned int index)
+    {
+        std::shared_ptr<Job> job = jobs[index];
+        jobs.erase(jobs.begin() + index);
+        job->linked(job->vertex, job->fragment);
+    }
+
+    void workerMain()
+    {
+        glfwMakeContextCurrent(backgroundWindow);
+        while (true)
+        {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (stopping)
+                    break;
+                job = queue.front();
+                queue.pop_front();
+            }
+            compile(*job);
+            // results have to be complete before the main context looks at them
+            glFinish();
+            job->done.store(true, std::memory_order_release);
+        }
+        glfwMakeContextCurrent(NULL);
+    }
+};
+#endif
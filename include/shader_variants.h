@@ -0,0 +1,86 @@
+#ifndef SHADER_VARIANTS_H
+#define SHADER_VARIANTS_H
+
+#include <shader.h>
+#include <uniform_buffer.h>
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+using namespace std;
+
+// The features a lighting shader variant is compiled for. Scenes fill in the lights, materials the maps;
+// everything that's off is compiled out instead of evaluated (see the #if blocks in lighting.vs/fs).
+struct ShaderPermutation {
+    unsigned int pointLights = NR_POINT_LIGHTS; // 0..NR_POINT_LIGHTS point lights evaluated
+    bool dirLight = true;
+    bool spotLight = true;
+    bool normalMap = false;                     // texture_normal1, needs tangents
+    bool packedMap = false;                     // texture_packed1, otherwise the material block's constants
+    bool drawRecords = false;                   // model and material from the render queue's draw records (multi-draw indirect)
+    bool instanced = false;                     // model and tint from the instance attributes (Model::DrawInstanced)
+    bool clustered = false;                     // the point and spot lights of the fragment's cluster (LightClusters), on top of the above
+    bool gbufferOutput = false;                 // writes the surface to the G-buffer instead of lighting it (deferred geometry pass)
+    bool gbufferInput = false;                  // lights the surface read back from the G-buffer (deferred resolve, see gbuffer.h)
+    bool shadows = false;                       // the directional light is shadowed by its cascades (ShadowCascades)
+
+    uint32_t Key() const
+    {
+        return (pointLights & 7u) | (dirLight ? 1u << 3 : 0u) | (spotLight ? 1u << 4 : 0u)
+             | (normalMap ? 1u << 5 : 0u) | (packedMap ? 1u << 6 : 0u) | (drawRecords ? 1u << 7 : 0u)
+             | (instanced ? 1u << 8 : 0u) | (clustered ? 1u << 9 : 0u) | (gbufferOutput ? 1u << 10 : 0u)
+             | (gbufferInput ? 1u << 11 : 0u) | (shadows ? 1u << 12 : 0u);
+    }
+
+    string Defines() const
+    {
+        return "#define NR_POINT_LIGHTS " + to_string(pointLights) + "\n"
+             + "#define HAS_DIR_LIGHT " + (dirLight ? "1" : "0") + "\n"
+             + "#define HAS_SPOT_LIGHT " + (spotLight ? "1" : "0") + "\n"
+             + "#define HAS_NORMAL_MAP " + (normalMap ? "1" : "0") + "\n"
+             + "#define HAS_PACKED_MAP " + (packedMap ? "1" : "0") + "\n"
+             + "#define HAS_DRAW_RECORDS " + (drawRecords ? "1" : "0") + "\n"
+             + "#define HAS_INSTANCING " + (instanced ? "1" : "0") + "\n"
+             + "#define HAS_CLUSTERED_LIGHTS " + (clustered ? "1" : "0") + "\n"
+             + "#define HAS_GBUFFER_OUTPUT " + (gbufferOutput ? "1" : "0") + "\n"
+             + "#define HAS_GBUFFER_INPUT " + (gbufferInput ? "1" : "0") + "\n"
+             + "#define HAS_SHADOWS " + (shadows ? "1" : "0") + "\n";
+    }
+};
+
+// Every permutation of one vertex/fragment shader pair that has been asked for, compiled on first use.
+// Prewarm() the permutations a scene is going to need at load time so drawing never hits a compile; with a
+// ShaderCompiler they are all submitted at once and compile in parallel until compiler->Finish().
+class ShaderVariants
+{
+public:
+    ShaderVariants(const string &vertexPath, const string &fragmentPath, bool useProgramCache = true, ShaderCompiler *compiler = nullptr)
+        : vertexPath(vertexPath), fragmentPath(fragmentPath), useProgramCache(useProgramCache), compiler(compiler)
+    {
+    }
+
+    Shader& Get(const ShaderPermutation &permutation)
+    {
+        std::unique_ptr<Shader> &variant = variants[permutation.Key()];
+        if (!variant)
+            variant = std::make_unique<Shader>(vertexPath.c_str(), fragmentPath.c_str(), useProgramCache, permutation.Defines(), compiler);
+        return *variant;
+    }
+
+    void Prewarm(const vector<ShaderPermutation> &permutations)
+    {
+        for (unsigned int i = 0; i < permutations.size(); i++)
+            Get(permutations[i]);
+    }
+
+    unsigned int Count() const { return (unsigned int)variants.size(); }
+
+private:
+    string vertexPath, fragmentPath;
+    bool useProgramCache;
+    ShaderCompiler *compiler;
+    std::unordered_map<uint32_t, std::unique_ptr<Shader>> variants;
+};
+#endif
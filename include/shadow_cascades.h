@@ -0,0 +1,275 @@
+#ifndef SHADOW_CASCADES_H
+#define SHADOW_CASCADES_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+#include <shader.h>
+#include <shader_compiler.h>
+#include <render_state.h>
+#include <gpu_timer.h>
+#include <frustum_culler.h>
+#include <bounds.h>
+
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+using namespace std;
+
+const unsigned int SHADOW_CASCADES = 4;        // SHADOW_CASCADES in lighting.fs
+const unsigned int SHADOW_MAP_SIZE = 1024;     // texels per side of every cascade
+const float SHADOW_DISTANCE = 50.0f;           // view distance the cascades cover, beyond it nothing is shadowed
+const float SHADOW_SPLIT_LAMBDA = 0.75f;       // blend of logarithmic (1) and uniform (0) cascade splits
+const float SHADOW_CACHE_MARGIN = 1.25f;       // cascades are fitted this much larger than needed, the camera moves inside them
+const float SHADOW_CASTER_RANGE = 50.0f;       // how far towards the light of a cascade casters are still rendered into it
+const float SHADOW_SLOPE_BIAS = 2.0f;          // glPolygonOffset of the casters
+const float SHADOW_CONSTANT_BIAS = 4.0f;
+
+// Cascaded shadow maps of the directional light. The view volume up to SHADOW_DISTANCE is split into
+// SHADOW_CASCADES slices, each covered by one layer of a depth texture array. A cascade is fitted to the
+// bounding sphere of its slice rather than its corners, so its size doesn't change as the camera turns, and
+// its center is snapped to whole texels in light space, so shadow edges don't crawl as the camera moves.
+//
+// Rendered cascades are cached: one is only rendered again when its slice's sphere leaves the margin it was
+// fitted with (the camera moved far enough), the light turned, the static casters changed (InvalidateStatic)
+// or a dynamic caster overlaps it, now or when it was last rendered (AddDynamicCaster). A still camera over a
+// static scene renders no shadows at all.
+//
+// Each frame: Update(), AddDynamicCaster() for whatever moves, Render() before the scene, then Bind() on the
+// programs that shade with the shadows (ShaderPermutation::shadows).
+class ShadowCascades
+{
+public:
+    struct Stats {
+        unsigned int rendered = 0;  // cascades rendered this frame
+        unsigned int cached = 0;    // cascades reused from an earlier frame
+        unsigned int refitted = 0;  // of the rendered ones, those fitted again to the camera
+        unsigned int draws = 0;     // caster draws issued this frame
+        double milliseconds = 0.0;  // CPU time of this frame's Render()
+    };
+
+    ShadowCascades(bool useProgramCache = true, ShaderCompiler *compiler = nullptr)
+        : depthShader("src/shaders/depth.vs", "src/shaders/depth.fs", useProgramCache, "#define SHADOW_PASS 1\n", compiler),
+          instancedDepthShader("src/shaders/depth.vs", "src/shaders/depth.fs", useProgramCache,
+                               "#define SHADOW_PASS 1\n#define HAS_INSTANCING 1\n", compiler),
+          timer(std::make_unique<GpuTimer>())
+    {
+        RenderState &state = GetRenderState();
+        glGenTextures(1, &texture);
+        state.BindTexture(SHADOW_MAP_TEXTURE_UNIT, GL_TEXTURE_2D_ARRAY, texture);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, SHADOW_CASCADES, 0,
+                     GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+        // compared in the sampler: linear filtering blends four compares
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+        glGenFramebuffers(1, &fbo);
+        state.BindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "ERROR::SHADOW_CASCADES::FRAMEBUFFER_INCOMPLETE" << std::endl;
+        state.BindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    ~ShadowCascades()
+    {
+        RenderState &state = GetRenderState();
+        state.DeleteFramebuffer(fbo);
+        state.DeleteTexture(texture);
+    }
+
+    ShadowCascades(const ShadowCascades&) = delete;
+    ShadowCascades& operator=(const ShadowCascades&) = delete;
+
+    // fits the cascades to a camera (view, vertical field of view in radians, aspect, near plane) and the
+    // light's direction, and decides which of them have to be rendered this frame
+    void Update(const glm::mat4 &view, float fovY, float aspect, float nearPlane, const glm::vec3 &lightDirection)
+    {
+        stats = Stats();
+        glm::vec3 direction = glm::normalize(lightDirection);
+        if (glm::dot(direction, this->lightDirection) < 0.9999f)
+        {
+            // light space turns with the light; a fixed up vector keeps it from rolling with the camera
+            this->lightDirection = direction;
+            glm::vec3 up = glm::abs(direction.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+            lightView = glm::lookAt(glm::vec3(0.0f), direction, up);
+            for (unsigned int i = 0; i < SHADOW_CASCADES; i++)
+                cascades[i].valid = false;
+        }
+
+        glm::mat4 inverseView = glm::inverse(view);
+        float tanY = glm::tan(fovY * 0.5f);
+        float tanX = tanY * aspect;
+        float splitNear = nearPlane;
+        for (unsigned int i = 0; i < SHADOW_CASCADES; i++)
+        {
+            float t = (float)(i + 1) / SHADOW_CASCADES;
+            float logarithmic = nearPlane * glm::pow(SHADOW_DISTANCE / nearPlane, t);
+            float uniform = nearPlane + (SHADOW_DISTANCE - nearPlane) * t;
+            float splitFar = glm::mix(uniform, logarithmic, SHADOW_SPLIT_LAMBDA);
+
+            // bounding sphere of the slice's corners; its radius only depends on the projection
+            glm::vec3 corners[8];
+            glm::vec3 center(0.0f);
+            for (unsigned int c = 0; c < 8; c++)
+            {
+                float depth = c < 4 ? splitNear : splitFar;
+                glm::vec3 corner((c & 1 ? 1.0f : -1.0f) * tanX * depth, (c & 2 ? 1.0f : -1.0f) * tanY * depth, -depth);
+                corners[c] = glm::vec3(inverseView * glm::vec4(corner, 1.0f));
+                center += corners[c] / 8.0f;
+            }
+            float radius = 0.0f;
+            for (unsigned int c = 0; c < 8; c++)
+                radius = glm::max(radius, glm::length(corners[c] - center));
+            radius = glm::ceil(radius * 16.0f) / 16.0f;
+            splitNear = splitFar;
+
+            Cascade &cascade = cascades[i];
+            glm::vec3 lightCenter = glm::vec3(lightView * glm::vec4(center, 1.0f));
+            glm::vec3 offset = glm::abs(lightCenter - cascade.center);
+            if (cascade.valid && glm::all(glm::lessThanEqual(offset + radius, glm::vec3(cascade.radius))))
+                continue;
+            fit(cascade, lightCenter, radius * SHADOW_CACHE_MARGIN);
+            stats.refitted++;
+        }
+    }
+
+    // the static casters changed: every cascade is rendered again
+    void InvalidateStatic()
+    {
+        for (unsigned int i = 0; i < SHADOW_CASCADES; i++)
+            cascades[i].dirty = true;
+    }
+
+    // a caster that moves this frame; the cascades it overlaps are rendered this frame and the next. Call
+    // after Update(), drawing it stays up to Render()'s draw callback.
+    void AddDynamicCaster(const Bounds &bounds)
+    {
+        for (unsigned int i = 0; i < SHADOW_CASCADES; i++)
+            if (cascades[i].valid && cascades[i].frustum.Intersects(bounds))
+                cascades[i].dynamic = true;
+    }
+
+    // renders the cascades that need it. draw is called once per cascade with its light space frustum, to cull
+    // the casters against, and the shadow depth programs for plain and instanced draws (set up with the
+    // cascade's matrix); it returns the number of draws it issued.
+    void Render(const function<unsigned int(const Frustum&, Shader&, Shader&)> &draw)
+    {
+        auto start = std::chrono::steady_clock::now();
+        bool any = false;
+        for (unsigned int i = 0; i < SHADOW_CASCADES && !any; i++)
+            any = cascades[i].dirty || cascades[i].dynamic || cascades[i].hadDynamic;
+        if (!any)
+        {
+            stats.cached = SHADOW_CASCADES;
+            stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            return;
+        }
+
+        RenderState &state = GetRenderState();
+        GLint viewport[4], framebuffer = 0;
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer);
+        timer->Begin();
+        state.BindFramebuffer(GL_FRAMEBUFFER, fbo);
+        glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+        state.Enable(GL_DEPTH_TEST);
+        state.DepthFunc(GL_LESS);
+        state.DepthMask(true);
+        state.Enable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(SHADOW_SLOPE_BIAS, SHADOW_CONSTANT_BIAS);
+        for (unsigned int i = 0; i < SHADOW_CASCADES; i++)
+        {
+            Cascade &cascade = cascades[i];
+            bool render = cascade.dirty || cascade.dynamic || cascade.hadDynamic;
+            // a dynamic caster leaving a cascade has to be rendered out of it once more
+            cascade.hadDynamic = cascade.dynamic;
+            cascade.dynamic = false;
+            if (!render)
+            {
+                stats.cached++;
+                continue;
+            }
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, i);
+            glClear(GL_DEPTH_BUFFER_BIT);
+            depthShader.use();
+            depthShader.setMat4("lightViewProjection"_uniform, cascade.viewProjection);
+            instancedDepthShader.use();
+            instancedDepthShader.setMat4("lightViewProjection"_uniform, cascade.viewProjection);
+            stats.draws += draw(cascade.frustum, depthShader, instancedDepthShader);
+            cascade.dirty = false;
+            stats.rendered++;
+        }
+        state.Disable(GL_POLYGON_OFFSET_FILL);
+        state.BindFramebuffer(GL_FRAMEBUFFER, (unsigned int)framebuffer);
+        glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+        timer->End();
+        stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // the cascades and their matrices for a program built with ShaderPermutation::shadows
+    void Bind(Shader &shader) const
+    {
+        // clip space to texture space: uv and depth in 0..1
+        const glm::mat4 bias = glm::translate(glm::mat4(1.0f), glm::vec3(0.5f)) * glm::scale(glm::mat4(1.0f), glm::vec3(0.5f));
+        glm::mat4 matrices[SHADOW_CASCADES];
+        glm::vec4 texelSizes(0.0f);
+        for (unsigned int i = 0; i < SHADOW_CASCADES; i++)
+        {
+            matrices[i] = bias * cascades[i].viewProjection;
+            texelSizes[i] = cascades[i].radius * 2.0f / SHADOW_MAP_SIZE;
+        }
+        GetRenderState().BindTexture(SHADOW_MAP_TEXTURE_UNIT, GL_TEXTURE_2D_ARRAY, texture);
+        shader.setMat4Array("shadowMatrices"_uniform, SHADOW_CASCADES, matrices);
+        shader.setVec4("shadowTexelSizes"_uniform, texelSizes);
+    }
+
+    // this frame's cascades; the GPU time of the frames that rendered any is in Timer()
+    const Stats& GetStats() const { return stats; }
+    GpuTimer& Timer() { return *timer; }
+
+private:
+    struct Cascade {
+        glm::vec3 center = glm::vec3(0.0f); // light space, snapped to texels
+        float radius = 0.0f;                // half the side of the covered square, margin included
+        glm::mat4 viewProjection = glm::mat4(1.0f);
+        Frustum frustum;
+        bool valid = false;                 // fitted at least once
+        bool dirty = true;                  // has to be rendered
+        bool dynamic = false;               // overlaps a dynamic caster this frame
+        bool hadDynamic = false;            // did when it was last rendered
+    };
+
+    Shader depthShader, instancedDepthShader;
+    std::unique_ptr<GpuTimer> timer;
+    unsigned int texture = 0, fbo = 0;
+    Cascade cascades[SHADOW_CASCADES];
+    glm::vec3 lightDirection = glm::vec3(0.0f);
+    glm::mat4 lightView = glm::mat4(1.0f);
+    Stats stats;
+
+    // covers a sphere of radius around center (light space) with the cascade, extruded towards the light by
+    // SHADOW_CASTER_RANGE so casters outside the view still shadow into it
+    void fit(Cascade &cascade, const glm::vec3 &center, float radius)
+    {
+        float texel = radius * 2.0f / SHADOW_MAP_SIZE;
+        cascade.center = glm::vec3(glm::floor(glm::vec2(center) / texel) * texel, center.z);
+        cascade.radius = radius;
+        glm::vec3 c = cascade.center;
+        glm::mat4 projection = glm::ortho(c.x - radius, c.x + radius, c.y - radius, c.y + radius,
+                                          -(c.z + radius + SHADOW_CASTER_RANGE), -(c.z - radius));
+        cascade.viewProjection = projection * lightView;
+        cascade.frustum = Frustum(cascade.viewProjection);
+        cascade.valid = true;
+        cascade.dirty = true;
+    }
+};
+#endif
@@ -0,0 +1,299 @@
+#ifndef TEXTURE_UPLOADER_H
+#define TEXTURE_UPLOADER_H
+
+#include <glad/glad.h>
+#include <others/stb_image.h>
+
+#include <job_system.h>
+#include <render_state.h>
+
+#include <string>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include <cstring>
+using namespace std;
+
+const size_t UPLOAD_RING_SIZE      = 64 * 1024 * 1024;
+const size_t UPLOAD_RING_ALIGNMENT = 64;
+
+// texture upload throughput, for comparing the PBO ring against plain glTexImage2D
+struct UploadStats {
+    unsigned int textures = 0;
+    size_t bytes = 0;
+    double seconds = 0.0; // wall clock time from the first request of a batch until its last upload was issued
+
+    double MegabytesPerSecond() const { return seconds > 0.0 ? (double)bytes / (1024.0 * 1024.0) / seconds : 0.0; }
+};
+
+// stats of the synchronous TextureFromFile path
+inline UploadStats& SynchronousUploadStats()
+{
+    static UploadStats stats;
+    return stats;
+}
+
+// Asynchronous texture uploads through a persistently mapped pixel buffer ring. Images are decoded on the
+// job system and copied by the decoding thread straight into the mapped ring memory; the GL thread then
+// only issues glTexImage2D from the buffer offset, which lets the driver DMA the pixels instead of copying
+// them out of client memory. Every upload is followed by a fence, and ring memory is reused only after its
+// fence has signaled. Requires GL 4.4 for persistent mapping, Available() is false otherwise.
+class TextureUploader
+{
+public:
+    TextureUploader(size_t ringSize = UPLOAD_RING_SIZE) : ringSize(ringSize)
+    {
+        if (!GLAD_GL_VERSION_4_4)
+        {
+            std::cout << "TextureUploader: GL 4.4 is not available, textures are uploaded synchronously" << std::endl;
+            return;
+        }
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &pbo);
+        RenderState &state = GetRenderState();
+        state.BindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, ringSize, NULL, flags);
+        ring = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, ringSize, flags);
+        state.BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    ~TextureUploader()
+    {
+        if (!ring)
+            return;
+        Finish();
+        while (!live.empty())
+            retireOldest();
+        RenderState &state = GetRenderState();
+        state.BindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        state.BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        state.DeleteBuffer(pbo);
+    }
+
+    TextureUploader(const TextureUploader&) = delete;
+    TextureUploader& operator=(const TextureUploader&) = delete;
+
+    bool Available() const { return ring != nullptr; }
+
+    // returns the texture name right away; its storage is created once the image has been decoded and
+    // Update() or Finish() issued the upload
+    unsigned int Load(const string &filename)
+    {
+        if (batchStart == 0.0)
+            batchStart = now();
+
+        unsigned int textureID;
+        glGenTextures(1, &textureID);
+
+        int width, height, nrComponents;
+        if (!stbi_info(filename.c_str(), &width, &height, &nrComponents))
+        {
+            std::cout << "Texture failed to load at path: " << filename << std::endl;
+            return textureID;
+        }
+        size_t size = (size_t)width * height * nrComponents;
+        if (size > ringSize)
+        {
+            // doesn't fit the ring at all, take the slow path
+            loadSynchronous(textureID, filename);
+            return textureID;
+        }
+
+        auto upload = std::make_shared<PendingUpload>();
+        upload->textureID = textureID;
+        upload->filename = filename;
+        upload->width = width;
+        upload->height = height;
+        upload->components = nrComponents;
+        upload->size = size;
+        upload->offset = allocate(size);
+        live.push_back(upload);
+
+        unsigned char *destination = ring + upload->offset;
+        GetJobSystem().Run([upload, destination]() {
+            int w, h, n;
+            // stb_image can't decode into a caller provided buffer, so the decoder copies its output into the ring
+            unsigned char *data = stbi_load(upload->filename.c_str(), &w, &h, &n, 0);
+            if (data && w == upload->width && h == upload->height && n == upload->components)
+                std::memcpy(destination, data, upload->size);
+            else
+                upload->failed = true;
+            stbi_image_free(data);
+            upload->decoded.store(true, std::memory_order_release);
+        });
+        return textureID;
+    }
+
+    // issues the uploads of every image that finished decoding (in request order) and recycles ring memory
+    // whose uploads the GPU has consumed. Never blocks.
+    void Update()
+    {
+        for (unsigned int i = 0; i < live.size(); i++)
+        {
+            PendingUpload &upload = *live[i];
+            if (upload.submitted)
+                continue;
+            if (!upload.decoded.load(std::memory_order_acquire))
+                break;
+            submit(upload);
+        }
+        while (!live.empty() && live.front()->submitted && signaled(live.front()->fence))
+        {
+            glDeleteSync(live.front()->fence);
+            live.pop_front();
+        }
+        if (batchStart != 0.0 && (live.empty() || live.back()->submitted))
+        {
+            stats.seconds += now() - batchStart;
+            batchStart = 0.0;
+        }
+    }
+
+    // blocks until every requested texture has been uploaded
+    void Finish()
+    {
+        while (!live.empty() && !live.back()->submitted)
+        {
+            Update();
+            std::this_thread::yield();
+        }
+        Update();
+    }
+
+    const UploadStats& GetStats() const { return stats; }
+
+private:
+    struct PendingUpload {
+        unsigned int textureID = 0;
+        string filename;
+        int width = 0, height = 0, components = 0;
+        size_t offset = 0, size = 0;
+        std::atomic<bool> decoded{false};
+        bool failed = false;
+        bool submitted = false;
+        GLsync fence = 0;
+    };
+
+    size_t ringSize;
+    unsigned int pbo = 0;
+    unsigned char *ring = nullptr;
+    size_t head = 0;
+    std::deque<std::shared_ptr<PendingUpload>> live; // ring allocations in request order
+    double batchStart = 0.0;
+    UploadStats stats;
+
+    static double now()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static bool signaled(GLsync fence)
+    {
+        GLenum status = glClientWaitSync(fence, 0, 0);
+        return status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED;
+    }
+
+    static GLenum formatFor(int nrComponents)
+    {
+        if (nrComponents == 1)
+            return GL_RED;
+        else if (nrComponents == 3)
+            return GL_RGB;
+        return GL_RGBA;
+    }
+
+    static void setSamplingParameters()
+    {
+        glGenerateMipmap(GL_TEXTURE_2D);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+
+    // finds room for size bytes, waiting for the oldest uploads to retire when the ring is full
+    size_t allocate(size_t size)
+    {
+        while (true)
+        {
+            if (live.empty())
+                head = 0;
+            size_t offset = (head + UPLOAD_RING_ALIGNMENT - 1) / UPLOAD_RING_ALIGNMENT * UPLOAD_RING_ALIGNMENT;
+            if (offset + size > ringSize)
+                offset = 0;
+            bool overlaps = false;
+            for (unsigned int i = 0; i < live.size() && !overlaps; i++)
+                overlaps = offset < live[i]->offset + live[i]->size && live[i]->offset < offset + size;
+            if (!overlaps)
+            {
+                head = offset + size;
+                return offset;
+            }
+            retireOldest();
+        }
+    }
+
+    // waits for the oldest allocation to be decoded, uploaded and consumed by the GPU, then frees it
+    void retireOldest()
+    {
+        std::shared_ptr<PendingUpload> oldest = live.front();
+        while (!oldest->decoded.load(std::memory_order_acquire))
+            std::this_thread::yield();
+        if (!oldest->submitted)
+            Update();
+        if (live.empty() || live.front() != oldest)
+            return; // Update() already found it consumed
+        while (glClientWaitSync(oldest->fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+            ;
+        glDeleteSync(oldest->fence);
+        live.pop_front();
+    }
+
+    void submit(PendingUpload &upload)
+    {
+        if (upload.failed)
+            std::cout << "Texture failed to load at path: " << upload.filename << std::endl;
+        else
+        {
+            GLenum format = formatFor(upload.components);
+            RenderState &state = GetRenderState();
+            state.BindTexture(GL_TEXTURE_2D, upload.textureID);
+            state.BindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexImage2D(GL_TEXTURE_2D, 0, format, upload.width, upload.height, 0, format, GL_UNSIGNED_BYTE, (void*)upload.offset);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            // client memory uploads elsewhere must not read from the ring
+            state.BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            setSamplingParameters();
+            stats.textures++;
+            stats.bytes += upload.size;
+        }
+        upload.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        upload.submitted = true;
+    }
+
+    void loadSynchronous(unsigned int textureID, const string &filename)
+    {
+        int width, height, nrComponents;
+        unsigned char *data = stbi_load(filename.c_str(), &width, &height, &nrComponents, 0);
+        if (data)
+        {
+            GLenum format = formatFor(nrComponents);
+            GetRenderState().BindTexture(GL_TEXTURE_2D, textureID);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+            glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+            setSamplingParameters();
+            stats.textures++;
+            stats.bytes += (size_t)width * height * nrComponents;
+        }
+        else
+            std::cout << "Texture failed to load at path: " << filename << std::endl;
+        stbi_image_free(data);
+    }
+};
+#endif
@@ -0,0 +1,169 @@
+#ifndef UNIFORM_BUFFER_H
+#define UNIFORM_BUFFER_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+#include <shader.h>
+#include <render_state.h>
+
+#include <vector>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+using namespace std;
+
+const unsigned int NR_POINT_LIGHTS = 4;   // size of the Lights block, MAX_POINT_LIGHTS in lighting.fs
+const size_t UNIFORM_RING_FRAME_SIZE = 16 * 1024;
+const unsigned int UNIFORM_RING_FRAMES = 3;
+
+// C++ mirrors of the std140 blocks in the shaders. vec3s are paired with a float so that every member
+// starts where std140 puts it; keep the two sides in sync.
+
+// layout(std140) uniform Camera, per frame
+struct CameraBlock {
+    glm::mat4 projection;
+    glm::mat4 view;
+    glm::vec3 viewPos;   float padding;
+};
+
+struct DirLightBlock {
+    glm::vec3 direction; float padding0;
+    glm::vec3 ambient;   float padding1;
+    glm::vec3 diffuse;   float padding2;
+    glm::vec3 specular;  float padding3;
+};
+
+struct PointLightBlock {
+    glm::vec3 position;  float constant;
+    glm::vec3 ambient;   float linear;
+    glm::vec3 diffuse;   float quadratic;
+    glm::vec3 specular;  float padding;
+};
+
+struct SpotLightBlock {
+    glm::vec3 position;  float cutOff;
+    glm::vec3 direction; float outerCutOff;
+    glm::vec3 ambient;   float constant;
+    glm::vec3 diffuse;   float linear;
+    glm::vec3 specular;  float quadratic;
+};
+
+// layout(std140) uniform Lights, per frame
+struct LightsBlock {
+    DirLightBlock dirLight;
+    PointLightBlock pointLights[NR_POINT_LIGHTS];
+    SpotLightBlock spotLight;
+};
+
+// layout(std140) uniform Material, per material
+struct MaterialBlock {
+    float shininess;
+    float specular;      float padding[2];
+};
+
+// GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT rounded up size of a block, for packing blocks into one buffer
+inline size_t UniformBlockStride(size_t size)
+{
+    GLint alignment = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+// Per-frame uniform blocks in one buffer split into UNIFORM_RING_FRAMES regions. Blocks are staged on the
+// CPU with Set() and Commit() writes all of them into the next region with a single unsynchronized map,
+// then binds each to its binding point. A region is only rewritten once the fence placed after the frame
+// that used it has signaled, so the GPU never reads a block while it's being overwritten and the map never
+// waits on the driver.
+class UniformRing
+{
+public:
+    UniformRing(size_t frameSize = UNIFORM_RING_FRAME_SIZE, unsigned int frames = UNIFORM_RING_FRAMES)
+        : frameSize(frameSize), fences(frames, (GLsync)0)
+    {
+        glGenBuffers(1, &ubo);
+        GetRenderState().BindBuffer(GL_UNIFORM_BUFFER, ubo);
+        glBufferData(GL_UNIFORM_BUFFER, frameSize * frames, NULL, GL_STREAM_DRAW);
+        GLint alignment = 256;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        this->alignment = (size_t)alignment;
+    }
+
+    ~UniformRing()
+    {
+        for (unsigned int i = 0; i < fences.size(); i++)
+            if (fences[i])
+                glDeleteSync(fences[i]);
+        GetRenderState().DeleteBuffer(ubo);
+    }
+
+    UniformRing(const UniformRing&) = delete;
+    UniformRing& operator=(const UniformRing&) = delete;
+
+    // stages a block for the next Commit()
+    template <typename T>
+    void Set(unsigned int binding, const T &block)
+    {
+        size_t offset = (staging.size() + alignment - 1) / alignment * alignment;
+        if (offset + sizeof(T) > frameSize)
+        {
+            std::cout << "ERROR::UNIFORM_RING::FRAME_FULL" << std::endl;
+            return;
+        }
+        staging.resize(offset + sizeof(T));
+        std::memcpy(staging.data() + offset, &block, sizeof(T));
+        ranges.push_back({ binding, offset, sizeof(T) });
+    }
+
+    // uploads the staged blocks and binds them. Call once per frame, before drawing.
+    void Commit()
+    {
+        // everything issued so far, including the previous frame's draws, used the current region
+        if (fences[frame])
+            glDeleteSync(fences[frame]);
+        fences[frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        frame = (frame + 1) % (unsigned int)fences.size();
+        if (fences[frame])
+        {
+            while (glClientWaitSync(fences[frame], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+                ;
+            glDeleteSync(fences[frame]);
+            fences[frame] = 0;
+        }
+
+        size_t base = frame * frameSize;
+        RenderState &state = GetRenderState();
+        state.BindBuffer(GL_UNIFORM_BUFFER, ubo);
+        if (!staging.empty())
+        {
+            void *region = glMapBufferRange(GL_UNIFORM_BUFFER, base, staging.size(),
+                                            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+            if (region)
+            {
+                std::memcpy(region, staging.data(), staging.size());
+                glUnmapBuffer(GL_UNIFORM_BUFFER);
+            }
+        }
+        for (unsigned int i = 0; i < ranges.size(); i++)
+            state.BindBufferRange(GL_UNIFORM_BUFFER, ranges[i].binding, ubo, base + ranges[i].offset, ranges[i].size);
+
+        staging.clear();
+        ranges.clear();
+    }
+
+private:
+    struct Range {
+        unsigned int binding;
+        size_t offset, size;
+    };
+
+    unsigned int ubo = 0;
+    size_t frameSize;
+    size_t alignment = 256;
+    unsigned int frame = 0;
+    std::vector<GLsync> fences;
+    std::vector<unsigned char> staging;
+    std::vector<Range> ranges;
+};
+#endif
@@ -0,0 +1,707 @@
+#ifndef VIRTUAL_TEXTURE_H
+#define VIRTUAL_TEXTURE_H
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include <others/stb_image.h>
+
+#include <shader.h>
+#include <render_state.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <fstream>
+#include <iostream>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+using namespace std;
+
+// Virtual texture layout. These values are mirrored as #defines in lighting.fs and vt_feedback.fs.
+const int VT_PAGE_SIZE      = 128; // payload texels per page side
+const int VT_PAGE_BORDER    = 4;   // filtering border texels on each side of a page
+const int VT_TILE_SIZE      = VT_PAGE_SIZE + 2 * VT_PAGE_BORDER; // texels per physical tile side
+const int VT_VIRTUAL_PAGES  = 256; // side of the virtual address space in pages (feedback encodes page coords in 8 bits)
+const int VT_PHYSICAL_PAGES = 16;  // side of the physical page cache in tiles
+const int VT_MAX_REGIONS    = 64;  // textures that can be registered (size of vtRegions[] in the shaders)
+const int VT_MAX_REGION_PAGES = 64;    // largest texture is VT_MAX_REGION_PAGES * VT_PAGE_SIZE texels per side
+const int VT_FEEDBACK_DIVISOR = 8;     // feedback buffer is the framebuffer size divided by this
+const int VT_READBACK_FRAMES  = 3;     // feedback readbacks in flight
+const int VT_MAX_UPLOADS      = 16;    // tiles uploaded into the physical cache per frame
+const int VT_MAX_LOADS        = 64;    // tiles handed to the streaming thread per frame
+const unsigned int VT_PAGE_TABLE_UNIT = 14;
+const unsigned int VT_PHYSICAL_UNIT   = 15;
+
+// A texture's square, power-of-two sized window into the virtual address space.
+struct VirtualRegion {
+    glm::ivec2 page;   // first page in the virtual address space
+    int pages;         // side in pages at mip 0
+    int maxMip;        // mip at which the region is a single page
+    string cookedPath; // tile store on disk
+    std::shared_ptr<const vector<unsigned char>> tiles; // the tile store's pages in memory instead, when it couldn't be written
+};
+
+// Sparse virtual texturing: every registered texture is cooked once into a tile store on disk and
+// mapped into one large virtual address space. Only the pages the camera actually sees (reported by a
+// low resolution feedback pass that is read back asynchronously) are streamed into a fixed size physical
+// page cache, and a mipmapped page table texture translates virtual pages to physical tiles in the shader.
+// VRAM use is the page table plus the physical cache, no matter how many textures are registered.
+class VirtualTexture
+{
+public:
+    struct Stats {
+        unsigned int requested = 0; // distinct pages seen in the last analyzed feedback
+        unsigned int resident  = 0; // tiles currently in the physical cache
+        unsigned int uploaded  = 0; // tiles uploaded this frame
+        unsigned int pending   = 0; // tiles queued on or returned by the streaming thread
+    };
+
+    // cacheDirectory receives the cooked tile stores, width/height is the framebuffer size
+    VirtualTexture(const string &cacheDirectory, int width, int height) : cacheDirectory(cacheDirectory)
+    {
+        std::error_code error;
+        std::filesystem::create_directories(cacheDirectory, error);
+        regionOfPage.assign(VT_VIRTUAL_PAGES * VT_VIRTUAL_PAGES, -1);
+        freeSquares.push_back(glm::ivec3(0, 0, VT_VIRTUAL_PAGES));
+        slots.resize(VT_PHYSICAL_PAGES * VT_PHYSICAL_PAGES);
+
+        setupPageTable();
+        setupPhysicalCache();
+        setupFeedback(width, height);
+
+        loader = std::thread(&VirtualTexture::loaderMain, this);
+    }
+
+    ~VirtualTexture()
+    {
+        {
+            std::lock_guard<std::mutex> lock(loaderMutex);
+            stopLoader = true;
+        }
+        loaderSignal.notify_one();
+        loader.join();
+    }
+
+    VirtualTexture(const VirtualTexture&) = delete;
+    VirtualTexture& operator=(const VirtualTexture&) = delete;
+
+    // cooks the texture (if the tile store is missing or stale), maps it into the virtual address space and
+    // makes its coarsest page permanently resident. Returns the region index or -1 on failure.
+    // When RGBA8 pixels are given they're cooked instead of loading path, which then only names the texture.
+    int Register(const string &path, const unsigned char *pixels = nullptr, int width = 0, int height = 0)
+    {
+        if (regions.size() >= VT_MAX_REGIONS)
+        {
+            std::cout << "ERROR::VIRTUAL_TEXTURE::TOO_MANY_REGIONS: " << path << std::endl;
+            return -1;
+        }
+        VirtualRegion region;
+        region.cookedPath = cookedPathFor(path);
+        if (!cook(path, region, pixels, width, height))
+            return -1;
+        if (!allocate(region.pages, region.page))
+        {
+            std::cout << "ERROR::VIRTUAL_TEXTURE::ADDRESS_SPACE_FULL: " << path << std::endl;
+            return -1;
+        }
+        region.maxMip = 0;
+        while ((1 << region.maxMip) < region.pages)
+            region.maxMip++;
+
+        int index = (int)regions.size();
+        regions.push_back(region);
+        for (int y = 0; y < region.pages; y++)
+            for (int x = 0; x < region.pages; x++)
+                regionOfPage[(region.page.y + y) * VT_VIRTUAL_PAGES + region.page.x + x] = (short)index;
+
+        // the coarsest page is the fallback for everything else in the region, so it never gets evicted
+        unsigned int key = pageKey(region.maxMip, region.page.x >> region.maxMip, region.page.y >> region.maxMip);
+        vector<unsigned char> tile(VT_TILE_SIZE * VT_TILE_SIZE * 4);
+        if (readTile(region, key, tile.data()))
+            upload(key, tile.data(), true);
+        pageTableDirty = true;
+        return index;
+    }
+
+    const VirtualRegion& Region(int index) const { return regions[index]; }
+
+    // binds the page table and physical cache and uploads the region table to a shader that samples through them
+    void Bind(Shader &shader) const
+    {
+        RenderState &state = GetRenderState();
+        state.BindTexture(VT_PAGE_TABLE_UNIT, GL_TEXTURE_2D, pageTable);
+        state.BindTexture(VT_PHYSICAL_UNIT, GL_TEXTURE_2D, physicalCache);
+        shader.setInt("vtPageTable"_uniform, VT_PAGE_TABLE_UNIT);
+        shader.setInt("vtPhysical"_uniform, VT_PHYSICAL_UNIT);
+        shader.setFloat("vtLodBias"_uniform, 0.0f);
+        setRegions(shader);
+    }
+
+    // redirects rendering into the feedback buffer; draw the scene with the feedback shader until EndFeedback
+    void BeginFeedback(Shader &feedbackShader)
+    {
+        glGetIntegerv(GL_VIEWPORT, savedViewport);
+        GetRenderState().BindFramebuffer(GL_FRAMEBUFFER, feedbackFBO);
+        glViewport(0, 0, feedbackWidth, feedbackHeight);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        feedbackShader.use();
+        // the feedback buffer is VT_FEEDBACK_DIVISOR times smaller, so its derivatives are that much larger
+        feedbackShader.setFloat("vtLodBias"_uniform, -std::log2((float)VT_FEEDBACK_DIVISOR));
+        setRegions(feedbackShader);
+    }
+
+    // queues an asynchronous readback of the feedback buffer and restores the default framebuffer
+    void EndFeedback()
+    {
+        Readback &readback = readbacks[readbackHead];
+        // never wait on the GPU: if the ring is still full of unanalyzed readbacks this frame's feedback is dropped
+        if (readback.fence == 0)
+        {
+            GetRenderState().BindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+            glReadPixels(0, 0, feedbackWidth, feedbackHeight, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+            GetRenderState().BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            readbackHead = (readbackHead + 1) % VT_READBACK_FRAMES;
+        }
+        GetRenderState().BindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(savedViewport[0], savedViewport[1], savedViewport[2], savedViewport[3]);
+    }
+
+    // analyzes finished readbacks, streams missing pages and refreshes the page table. Call once per frame.
+    void Update()
+    {
+        frame++;
+        stats.uploaded = 0;
+
+        // 1. analyze every readback the GPU has finished with
+        for (int i = 0; i < VT_READBACK_FRAMES; i++)
+        {
+            Readback &readback = readbacks[readbackTail];
+            if (readback.fence == 0)
+                break;
+            GLenum status = glClientWaitSync(readback.fence, 0, 0);
+            if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+                break;
+            glDeleteSync(readback.fence);
+            readback.fence = 0;
+
+            GetRenderState().BindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+            const unsigned char *pixels = (const unsigned char*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, feedbackWidth * feedbackHeight * 4, GL_MAP_READ_BIT);
+            if (pixels)
+                analyze(pixels);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            GetRenderState().BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+            readbackTail = (readbackTail + 1) % VT_READBACK_FRAMES;
+        }
+
+        // 2. move finished tiles from the streaming thread into the physical cache
+        vector<LoadedTile> ready;
+        {
+            std::lock_guard<std::mutex> lock(loaderMutex);
+            while (!loaded.empty() && ready.size() < VT_MAX_UPLOADS)
+            {
+                ready.push_back(std::move(loaded.front()));
+                loaded.pop_front();
+            }
+        }
+        for (unsigned int i = 0; i < ready.size(); i++)
+        {
+            pending.erase(ready[i].key);
+            if (!ready[i].data.empty() && upload(ready[i].key, ready[i].data.data(), false))
+                stats.uploaded++;
+        }
+
+        // 3. rebuild the page table if the residency changed
+        if (pageTableDirty)
+            updatePageTable();
+
+        stats.pending = (unsigned int)pending.size();
+        stats.resident = (unsigned int)resident.size();
+    }
+
+    const Stats& GetStats() const { return stats; }
+
+private:
+    struct Slot {
+        unsigned int key = 0;
+        unsigned int lastUsed = 0;
+        bool used = false;
+        bool locked = false;
+    };
+    struct Readback {
+        unsigned int pbo = 0;
+        GLsync fence = 0;
+    };
+    struct TileRequest {
+        unsigned int key;
+        VirtualRegion region;
+    };
+    struct LoadedTile {
+        unsigned int key;
+        vector<unsigned char> data;
+    };
+
+    string cacheDirectory;
+    vector<VirtualRegion> regions;
+    vector<short> regionOfPage;       // region index for every mip 0 page, -1 if unmapped
+    vector<glm::ivec3> freeSquares;   // free (x, y, size) squares of the buddy allocator
+
+    // physical cache
+    unsigned int physicalCache = 0;
+    vector<Slot> slots;
+    std::unordered_map<unsigned int, int> resident; // page key -> slot
+    std::unordered_set<unsigned int> pending;       // page keys queued on or returned by the streaming thread
+
+    // page table, with a CPU mirror of every mip level
+    unsigned int pageTable = 0;
+    int pageTableMips = 0;
+    vector<vector<uint32_t>> pageTableLevels;
+    bool pageTableDirty = true;
+
+    // feedback
+    unsigned int feedbackFBO = 0, feedbackColor = 0, feedbackDepth = 0;
+    int feedbackWidth = 0, feedbackHeight = 0;
+    Readback readbacks[VT_READBACK_FRAMES];
+    int readbackHead = 0, readbackTail = 0;
+    GLint savedViewport[4];
+
+    // streaming thread
+    std::thread loader;
+    std::mutex loaderMutex;
+    std::condition_variable loaderSignal;
+    std::deque<TileRequest> requests;
+    std::deque<LoadedTile> loaded;
+    bool stopLoader = false;
+
+    unsigned int frame = 0;
+    Stats stats;
+
+    // a page is identified by its mip and its coordinates at that mip
+    static unsigned int pageKey(int mip, int x, int y) { return (unsigned int)((mip << 16) | (y << 8) | x); }
+    static int keyMip(unsigned int key) { return (int)(key >> 16); }
+    static int keyX(unsigned int key) { return (int)(key & 0xFF); }
+    static int keyY(unsigned int key) { return (int)((key >> 8) & 0xFF); }
+
+    void setupPageTable()
+    {
+        pageTableMips = 0;
+        while ((VT_VIRTUAL_PAGES >> pageTableMips) > 0)
+            pageTableMips++;
+        pageTableLevels.resize(pageTableMips);
+
+        glGenTextures(1, &pageTable);
+        GetRenderState().BindTexture(GL_TEXTURE_2D, pageTable);
+        for (int mip = 0; mip < pageTableMips; mip++)
+        {
+            int size = VT_VIRTUAL_PAGES >> mip;
+            pageTableLevels[mip].assign(size * size, 0);
+            glTexImage2D(GL_TEXTURE_2D, mip, GL_RGBA8, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, pageTableLevels[mip].data());
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, pageTableMips - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+
+    void setupPhysicalCache()
+    {
+        int size = VT_PHYSICAL_PAGES * VT_TILE_SIZE;
+        glGenTextures(1, &physicalCache);
+        GetRenderState().BindTexture(GL_TEXTURE_2D, physicalCache);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+
+    void setupFeedback(int width, int height)
+    {
+        feedbackWidth = std::max(1, width / VT_FEEDBACK_DIVISOR);
+        feedbackHeight = std::max(1, height / VT_FEEDBACK_DIVISOR);
+
+        RenderState &state = GetRenderState();
+        glGenFramebuffers(1, &feedbackFBO);
+        state.BindFramebuffer(GL_FRAMEBUFFER, feedbackFBO);
+        glGenTextures(1, &feedbackColor);
+        state.BindTexture(GL_TEXTURE_2D, feedbackColor);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, feedbackWidth, feedbackHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, feedbackColor, 0);
+        glGenRenderbuffers(1, &feedbackDepth);
+        glBindRenderbuffer(GL_RENDERBUFFER, feedbackDepth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, feedbackWidth, feedbackHeight);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, feedbackDepth);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "ERROR::VIRTUAL_TEXTURE::FEEDBACK_FRAMEBUFFER_INCOMPLETE" << std::endl;
+        state.BindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        for (int i = 0; i < VT_READBACK_FRAMES; i++)
+        {
+            glGenBuffers(1, &readbacks[i].pbo);
+            state.BindBuffer(GL_PIXEL_PACK_BUFFER, readbacks[i].pbo);
+            glBufferData(GL_PIXEL_PACK_BUFFER, feedbackWidth * feedbackHeight * 4, NULL, GL_STREAM_READ);
+        }
+        state.BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    void setRegions(Shader &shader) const
+    {
+        // xy: first page, z: side, all in [0, 1] virtual texture coordinates. w: max mip
+        glm::vec4 rects[VT_MAX_REGIONS];
+        for (unsigned int i = 0; i < regions.size(); i++)
+            rects[i] = glm::vec4(glm::vec2(regions[i].page) / (float)VT_VIRTUAL_PAGES, (float)regions[i].pages / (float)VT_VIRTUAL_PAGES, (float)regions[i].maxMip);
+        if (!regions.empty())
+            shader.setVec4Array("vtRegions"_uniform, (int)regions.size(), rects);
+    }
+
+    // power-of-two square allocation in the virtual address space (a buddy allocator over a quadtree)
+    bool allocate(int pages, glm::ivec2 &page)
+    {
+        int best = -1;
+        for (unsigned int i = 0; i < freeSquares.size(); i++)
+            if (freeSquares[i].z >= pages && (best < 0 || freeSquares[i].z < freeSquares[best].z))
+                best = i;
+        if (best < 0)
+            return false;
+        glm::ivec3 square = freeSquares[best];
+        freeSquares.erase(freeSquares.begin() + best);
+        while (square.z > pages)
+        {
+            int half = square.z / 2;
+            freeSquares.push_back(glm::ivec3(square.x + half, square.y, half));
+            freeSquares.push_back(glm::ivec3(square.x, square.y + half, half));
+            freeSquares.push_back(glm::ivec3(square.x + half, square.y + half, half));
+            square.z = half;
+        }
+        page = glm::ivec2(square.x, square.y);
+        return true;
+    }
+
+    string cookedPathFor(const string &path) const
+    {
+        string name = path;
+        for (unsigned int i = 0; i < name.size(); i++)
+            if (name[i] == '/' || name[i] == '\\' || name[i] == ':' || name[i] == '.')
+                name[i] = '_';
+        return cacheDirectory + '/' + name + ".vtc";
+    }
+
+    // cooks a source image into a tile store: a small header followed by every page of every mip level,
+    // finest mip first and row by row within a mip, each page stored with its filtering border. If the store
+    // can't be written the region keeps its pages in memory and streams them from there.
+    bool cook(const string &source, VirtualRegion &region, const unsigned char *pixels, int width, int height)
+    {
+        const string &cooked = region.cookedPath;
+        int &pages = region.pages;
+        std::error_code error;
+        if (std::filesystem::exists(cooked, error) &&
+            std::filesystem::last_write_time(cooked, error) >= std::filesystem::last_write_time(source, error))
+        {
+            std::ifstream file(cooked, std::ios::binary);
+            char magic[4];
+            int32_t storedPages = 0;
+            file.read(magic, 4);
+            file.read((char*)&storedPages, sizeof(storedPages));
+            if (file && std::memcmp(magic, "EVT1", 4) == 0 && storedPages > 0)
+            {
+                pages = storedPages;
+                return true;
+            }
+        }
+
+        std::cout << "Cooking virtual texture: " << source << std::endl;
+        unsigned char *data = nullptr;
+        if (!pixels)
+        {
+            int nrComponents;
+            data = stbi_load(source.c_str(), &width, &height, &nrComponents, 4);
+            if (!data)
+            {
+                std::cout << "Texture failed to load at path: " << source << std::endl;
+                return false;
+            }
+            pixels = data;
+        }
+
+        pages = 1;
+        while (pages * VT_PAGE_SIZE < std::max(width, height) && pages < VT_MAX_REGION_PAGES)
+            pages *= 2;
+
+        // resample to the region's square power-of-two size; texture coordinates are [0, 1] either way
+        int size = pages * VT_PAGE_SIZE;
+        vector<unsigned char> level(size * size * 4);
+        for (int y = 0; y < size; y++)
+        {
+            float sy = ((float)y + 0.5f) * height / size - 0.5f;
+            int y0 = std::max(0, (int)std::floor(sy)), y1 = std::min(height - 1, y0 + 1);
+            float fy = glm::clamp(sy - (float)y0, 0.0f, 1.0f);
+            for (int x = 0; x < size; x++)
+            {
+                float sx = ((float)x + 0.5f) * width / size - 0.5f;
+                int x0 = std::max(0, (int)std::floor(sx)), x1 = std::min(width - 1, x0 + 1);
+                float fx = glm::clamp(sx - (float)x0, 0.0f, 1.0f);
+                for (int c = 0; c < 4; c++)
+                {
+                    float top = glm::mix((float)pixels[(y0 * width + x0) * 4 + c], (float)pixels[(y0 * width + x1) * 4 + c], fx);
+                    float bottom = glm::mix((float)pixels[(y1 * width + x0) * 4 + c], (float)pixels[(y1 * width + x1) * 4 + c], fx);
+                    level[(y * size + x) * 4 + c] = (unsigned char)(glm::mix(top, bottom, fy) + 0.5f);
+                }
+            }
+        }
+        if (data)
+            stbi_image_free(data);
+
+        vector<unsigned char> store;
+        vector<unsigned char> tile(VT_TILE_SIZE * VT_TILE_SIZE * 4);
+        store.reserve((pages * pages * 4 / 3 + 1) * tile.size());
+        for (int levelPages = pages; levelPages >= 1; levelPages /= 2)
+        {
+            // borders wrap around, matching the GL_REPEAT addressing of regular textures
+            for (int ty = 0; ty < levelPages; ty++)
+                for (int tx = 0; tx < levelPages; tx++)
+                {
+                    for (int y = 0; y < VT_TILE_SIZE; y++)
+                    {
+                        int sy = ((ty * VT_PAGE_SIZE + y - VT_PAGE_BORDER) % size + size) % size;
+                        for (int x = 0; x < VT_TILE_SIZE; x++)
+                        {
+                            int sx = ((tx * VT_PAGE_SIZE + x - VT_PAGE_BORDER) % size + size) % size;
+                            std::memcpy(&tile[(y * VT_TILE_SIZE + x) * 4], &level[(sy * size + sx) * 4], 4);
+                        }
+                    }
+                    store.insert(store.end(), tile.begin(), tile.end());
+                }
+
+            // box filter down to the next mip
+            if (levelPages > 1)
+            {
+                int half = size / 2;
+                vector<unsigned char> next(half * half * 4);
+                for (int y = 0; y < half; y++)
+                    for (int x = 0; x < half; x++)
+                        for (int c = 0; c < 4; c++)
+                        {
+                            int sum = level[((2 * y) * size + 2 * x) * 4 + c] + level[((2 * y) * size + 2 * x + 1) * 4 + c] +
+                                      level[((2 * y + 1) * size + 2 * x) * 4 + c] + level[((2 * y + 1) * size + 2 * x + 1) * 4 + c];
+                            next[(y * half + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+                        }
+                level.swap(next);
+                size = half;
+            }
+        }
+
+        std::ofstream file(cooked, std::ios::binary | std::ios::trunc);
+        int32_t storedPages = pages;
+        file.write("EVT1", 4);
+        file.write((const char*)&storedPages, sizeof(storedPages));
+        file.write((const char*)store.data(), store.size());
+        if (!file)
+        {
+            // a partial store would pass for a cooked one next run
+            std::cout << "ERROR::VIRTUAL_TEXTURE::COOK_WRITE_FAILED: " << cooked << std::endl;
+            file.close();
+            std::filesystem::remove(cooked, error);
+            region.tiles = std::make_shared<const vector<unsigned char>>(std::move(store));
+        }
+        return true;
+    }
+
+    // reads one page of a region from its tile store
+    static bool readTile(const VirtualRegion &region, unsigned int key, unsigned char *tile)
+    {
+        int mip = keyMip(key);
+        int levelPages = region.pages >> mip;
+        int localX = keyX(key) - (region.page.x >> mip);
+        int localY = keyY(key) - (region.page.y >> mip);
+
+        std::streamoff index = 0;
+        for (int level = 0; level < mip; level++)
+            index += (std::streamoff)(region.pages >> level) * (region.pages >> level);
+        index += localY * levelPages + localX;
+
+        const std::streamoff tileBytes = VT_TILE_SIZE * VT_TILE_SIZE * 4;
+        if (region.tiles)
+        {
+            std::memcpy(tile, region.tiles->data() + index * tileBytes, tileBytes);
+            return true;
+        }
+        std::ifstream file(region.cookedPath, std::ios::binary);
+        file.seekg(8 + index * tileBytes);
+        file.read((char*)tile, tileBytes);
+        if (!file)
+        {
+            std::cout << "ERROR::VIRTUAL_TEXTURE::TILE_READ_FAILED: " << region.cookedPath << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    void loaderMain()
+    {
+        while (true)
+        {
+            TileRequest request;
+            {
+                std::unique_lock<std::mutex> lock(loaderMutex);
+                loaderSignal.wait(lock, [this] { return stopLoader || !requests.empty(); });
+                if (stopLoader)
+                    return;
+                request = requests.front();
+                requests.pop_front();
+            }
+            LoadedTile tile;
+            tile.key = request.key;
+            tile.data.resize(VT_TILE_SIZE * VT_TILE_SIZE * 4);
+            if (!readTile(request.region, request.key, tile.data.data()))
+                tile.data.clear();
+            std::lock_guard<std::mutex> lock(loaderMutex);
+            loaded.push_back(std::move(tile));
+        }
+    }
+
+    // turns one feedback readback into page requests
+    void analyze(const unsigned char *pixels)
+    {
+        std::unordered_map<unsigned int, unsigned int> counts;
+        for (int i = 0; i < feedbackWidth * feedbackHeight; i++)
+        {
+            const unsigned char *pixel = pixels + i * 4;
+            if (pixel[3] == 0)
+                continue;
+            counts[pageKey(pixel[2], pixel[0], pixel[1])]++;
+        }
+
+        // every ancestor up to the region's single page is needed as well, both as fallback while the
+        // finer page streams in and so that coarse pages are never evicted before their children
+        std::unordered_map<unsigned int, unsigned int> needed;
+        for (auto &request : counts)
+        {
+            int mip = keyMip(request.first), x = keyX(request.first), y = keyY(request.first);
+            int baseX = x << mip, baseY = y << mip;
+            if (mip >= pageTableMips || baseX >= VT_VIRTUAL_PAGES || baseY >= VT_VIRTUAL_PAGES)
+                continue;
+            int region = regionOfPage[baseY * VT_VIRTUAL_PAGES + baseX];
+            if (region < 0)
+                continue;
+            for (int level = mip; level <= regions[region].maxMip; level++)
+                needed[pageKey(level, baseX >> level, baseY >> level)] += request.second;
+        }
+        stats.requested = (unsigned int)counts.size();
+
+        vector<std::pair<unsigned int, unsigned int>> missing;
+        for (auto &page : needed)
+        {
+            auto it = resident.find(page.first);
+            if (it != resident.end())
+                slots[it->second].lastUsed = frame;
+            else if (pending.find(page.first) == pending.end())
+                missing.push_back(page);
+        }
+        // coarse pages first, then the pages covering the most pixels
+        std::sort(missing.begin(), missing.end(), [](const std::pair<unsigned int, unsigned int> &a, const std::pair<unsigned int, unsigned int> &b) {
+            if (keyMip(a.first) != keyMip(b.first))
+                return keyMip(a.first) > keyMip(b.first);
+            return a.second > b.second;
+        });
+        if (missing.size() > VT_MAX_LOADS)
+            missing.resize(VT_MAX_LOADS);
+
+        if (!missing.empty())
+        {
+            std::lock_guard<std::mutex> lock(loaderMutex);
+            for (unsigned int i = 0; i < missing.size(); i++)
+            {
+                int mip = keyMip(missing[i].first);
+                int region = regionOfPage[(keyY(missing[i].first) << mip) * VT_VIRTUAL_PAGES + (keyX(missing[i].first) << mip)];
+                requests.push_back({ missing[i].first, regions[region] });
+                pending.insert(missing[i].first);
+            }
+        }
+        loaderSignal.notify_one();
+    }
+
+    // copies a tile into a free (or the least recently used) physical slot
+    bool upload(unsigned int key, const unsigned char *tile, bool locked)
+    {
+        int slot = -1;
+        for (unsigned int i = 0; i < slots.size(); i++)
+        {
+            if (!slots[i].used)
+            {
+                slot = i;
+                break;
+            }
+            // pages seen in the latest feedback stay put, otherwise the cache would thrash
+            if (!slots[i].locked && slots[i].lastUsed + 1 < frame && (slot < 0 || slots[i].lastUsed < slots[slot].lastUsed))
+                slot = i;
+        }
+        if (slot < 0)
+            return false;
+        if (slots[slot].used)
+            resident.erase(slots[slot].key);
+
+        slots[slot].key = key;
+        slots[slot].lastUsed = frame;
+        slots[slot].used = true;
+        slots[slot].locked = locked;
+        resident[key] = slot;
+
+        GetRenderState().BindTexture(GL_TEXTURE_2D, physicalCache);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, (slot % VT_PHYSICAL_PAGES) * VT_TILE_SIZE, (slot / VT_PHYSICAL_PAGES) * VT_TILE_SIZE,
+                        VT_TILE_SIZE, VT_TILE_SIZE, GL_RGBA, GL_UNSIGNED_BYTE, tile);
+        pageTableDirty = true;
+        return true;
+    }
+
+    // rebuilds the page table from the coarsest mip down: a resident page points at its own tile, every
+    // other page inherits the entry of its parent so the shader always finds the best resident data
+    void updatePageTable()
+    {
+        for (int mip = pageTableMips - 1; mip >= 0; mip--)
+        {
+            int size = VT_VIRTUAL_PAGES >> mip;
+            vector<uint32_t> &level = pageTableLevels[mip];
+            for (int y = 0; y < size; y++)
+                for (int x = 0; x < size; x++)
+                {
+                    uint32_t entry = 0;
+                    auto it = resident.find(pageKey(mip, x, y));
+                    if (it != resident.end())
+                    {
+                        uint32_t physX = it->second % VT_PHYSICAL_PAGES;
+                        uint32_t physY = it->second / VT_PHYSICAL_PAGES;
+                        entry = physX | (physY << 8) | ((uint32_t)mip << 16) | (0xFFu << 24);
+                    }
+                    else if (mip + 1 < pageTableMips)
+                        entry = pageTableLevels[mip + 1][(y / 2) * (size / 2) + x / 2];
+                    level[y * size + x] = entry;
+                }
+        }
+
+        GetRenderState().BindTexture(GL_TEXTURE_2D, pageTable);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        for (int mip = 0; mip < pageTableMips; mip++)
+        {
+            int size = VT_VIRTUAL_PAGES >> mip;
+            glTexSubImage2D(GL_TEXTURE_2D, mip, 0, 0, size, size, GL_RGBA, GL_UNSIGNED_BYTE, pageTableLevels[mip].data());
+        }
+        pageTableDirty = false;
+    }
+};
+#endif
@@ -10,18 +10,61 @@
 #include <shader.h>
 #include <camera.h>
 #include <model.h>
+#include <virtual_texture.h>
+#include <texture_uploader.h>
+#include <gpu_timer.h>
+#include <uniform_buffer.h>
+#include <shader_variants.h>
+#include <render_queue.h>
+#include <geometry_pool.h>
+#include <debug_renderer.h>
+#include <light_clusters.h>
+#include <gbuffer.h>
+#include <frustum_culler.h>
+#include <scene_bvh.h>
+#include <occlusion_culler.h>
+#include <occlusion_queries.h>
+#include <shadow_cascades.h>
+#include <dynamic_resolution.h>
+#include <fixed_timestep.h>
+#include <benchmarks.h>
+#include <memory>
+#include <vector>
+#include <cmath>
 
 // settings
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
+const bool USE_VIRTUAL_TEXTURING = true; // stream model textures through the virtual texture instead of loading them whole
+const bool USE_UPLOAD_RING = true;       // decode textures on the job system and upload them through a PBO ring (GL 4.4)
+const bool USE_PROGRAM_CACHE = true;     // load linked programs from data/cache/shaders instead of compiling (GL 4.1)
+const bool USE_SHADER_COMPILER = true;   // compile shaders in parallel with loading (KHR_parallel_shader_compile or a shared context)
+const bool USE_MULTI_DRAW_INDIRECT = true; // pool the model's meshes and draw whole passes with glMultiDrawElementsIndirect (GL 4.3), M toggles
+const unsigned int MODEL_INSTANCES = 0;  // tinted copies of the model in a grid below the scene, drawn with Model::DrawInstanced
+const bool USE_CLUSTERED_LIGHTING = true; // bin the point and spot lights into view frustum clusters, fragments only shade their cluster's
+const unsigned int DEMO_LIGHTS = 0;      // small colored point lights orbiting the model, clustered lighting only
+const bool USE_FRUSTUM_CULLING = true;   // skip the meshes and instanced copies whose bounds are outside the view frustum
+const bool USE_DEFERRED_SHADING = false; // write a G-buffer and light it in one full-screen pass instead of lighting every fragment, G toggles
+const bool USE_OCCLUSION_CULLING = true; // rasterize the model's simplified meshes on the CPU and skip the draws and copies hidden behind them
+const bool USE_DEPTH_PREPASS = false;   // lay down the scene's depth through position streams first, then shade it with GL_EQUAL, P toggles
+const bool USE_OCCLUSION_QUERIES = false; // draw the instanced copies in groups gated by hardware queries on their boxes instead, O toggles
+const unsigned int INSTANCE_GROUP = 4;   // copies per side of a square group drawn and queried as one
+const bool USE_SHADOWS = true;           // cascaded shadow maps for the directional light, cached while the camera stays inside them
+const bool USE_DYNAMIC_RESOLUTION = true; // render the scene offscreen at a resolution that keeps its GPU time on target, then scale it up
 
 
 
 // globals
-float deltaTime = 0.0f;	// Time between current frame and last frame
-float lastFrame = 0.0f; // Time of last frame
 float lastX = 400, lastY = 300;
 bool firstMouse = true;
+bool multiDrawIndirect = USE_MULTI_DRAW_INDIRECT; // switched at runtime with M
+bool multiDrawKeyDown = false;
+bool deferredShading = USE_DEFERRED_SHADING; // switched at runtime with G
+bool deferredKeyDown = false;
+bool depthPrepass = USE_DEPTH_PREPASS; // switched at runtime with P
+bool depthPrepassKeyDown = false;
+bool occlusionQueriesOn = USE_OCCLUSION_QUERIES; // switched at runtime with O
+bool occlusionQueriesKeyDown = false;
 
 Camera camera(glm::vec3(0.0f, 0.0f, 3.0f));
 
@@ -51,10 +94,9 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset)
 	camera.ProcessMouseScroll(yoffset);
 }
 
-void processInput(GLFWwindow *window)
+// one fixed step of the simulation: the camera moves by the keys held
+void simulate(GLFWwindow *window, float deltaTime)
 {
-	if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-		glfwSetWindowShouldClose(window, true);
     if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
 		camera.ProcessKeyboard(Camera_Movement::FORWARD, deltaTime);
     if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
@@ -70,6 +112,36 @@ void processInput(GLFWwindow *window)
 		camera.ProcessKeyboard(Camera_Movement::DOWN, deltaTime);
 }
 
+void processInput(GLFWwindow *window)
+{
+	if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+		glfwSetWindowShouldClose(window, true);
+
+	// toggle multi-draw indirect, once per press
+	bool multiDrawKey = glfwGetKey(window, GLFW_KEY_M) == GLFW_PRESS;
+	if (multiDrawKey && !multiDrawKeyDown)
+		multiDrawIndirect = !multiDrawIndirect;
+	multiDrawKeyDown = multiDrawKey;
+
+	// toggle deferred shading, once per press
+	bool deferredKey = glfwGetKey(window, GLFW_KEY_G) == GLFW_PRESS;
+	if (deferredKey && !deferredKeyDown)
+		deferredShading = !deferredShading;
+	deferredKeyDown = deferredKey;
+
+	// toggle the depth pre-pass, once per press
+	bool depthPrepassKey = glfwGetKey(window, GLFW_KEY_P) == GLFW_PRESS;
+	if (depthPrepassKey && !depthPrepassKeyDown)
+		depthPrepass = !depthPrepass;
+	depthPrepassKeyDown = depthPrepassKey;
+
+	// toggle occlusion queries, once per press
+	bool occlusionQueriesKey = glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS;
+	if (occlusionQueriesKey && !occlusionQueriesKeyDown)
+		occlusionQueriesOn = !occlusionQueriesOn;
+	occlusionQueriesKeyDown = occlusionQueriesKey;
+}
+
 // utility function for loading a 2D texture from file
 unsigned int loadTexture(char const * path)
 {
@@ -89,7 +161,7 @@ unsigned int loadTexture(char const * path)
         else if (nrComponents == 4)
             format = GL_RGBA;
 
-        glBindTexture(GL_TEXTURE_2D, textureID);
+        GetRenderState().BindTexture(GL_TEXTURE_2D, textureID);
         glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
         glGenerateMipmap(GL_TEXTURE_2D);
 
@@ -109,19 +181,33 @@ unsigned int loadTexture(char const * path)
     return textureID;
 }
 
-int main()
+int main(int argc, char **argv)
 {
+	// --bench: run the CPU benchmarks instead of the engine
+	for (int i = 1; i < argc; i++)
+		if (std::string(argv[i]) == "--bench")
+		{
+			RunBenchmarks();
+			return 0;
+		}
+
 	// glfw: initialize and configure
 	glfwInit();
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 #ifdef __APPLE__
 	//glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #endif
 
-	// glfw window creation
-	GLFWwindow *window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "e-engine 3", NULL, NULL);
+	// glfw window creation, asking for the newest context first; 3.3 is the minimum, newer versions
+	// enable the faster paths (persistent mapped buffers, indirect draws)
+	const int contextVersions[][2] = { {4, 6}, {4, 5}, {4, 3}, {3, 3} };
+	GLFWwindow *window = NULL;
+	for (unsigned int i = 0; i < 4 && window == NULL; i++)
+	{
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, contextVersions[i][0]);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, contextVersions[i][1]);
+		window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "e-engine 3", NULL, NULL);
+	}
 	if (window == NULL)
 	{
 		std::cout << "Failed to create GLFW window" << std::endl;
@@ -145,64 +231,36 @@ int main()
 	stbi_set_flip_vertically_on_load(true);
 
 	// configure global opengl state
-    glEnable(GL_DEPTH_TEST);
+    GetRenderState().Enable(GL_DEPTH_TEST);
     // - uncomment this call to draw in wireframe polygons.
     // glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 
 	// diagnostic output
+	std::cout << "OpenGL " << glGetString(GL_VERSION) << " on " << glGetString(GL_RENDERER) << std::endl;
 	int nrAttributes;
 	glGetIntegerv(GL_MAX_VERTEX_ATTRIBS, &nrAttributes);
 	std::cout << "Maximum nr of vertex attributes supported: " << nrAttributes << std::endl;
 
-	// build and compile our shaders
-	Shader lightingShader("src/shaders/lighting.vs", "src/shaders/lighting.fs");
-	Shader lightSourceShader("src/shaders/light_source.vs", "src/shaders/light_source.fs");
-
-	// // set up vertex data (and buffer(s)) and configure vertex attributes
-	float vertices[] = {
-		// positions          // normals           // texture coords
-		-0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
-		0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
-		0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-		0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-		-0.5f,  0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
-		-0.5f, -0.5f, -0.5f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
-
-		-0.5f, -0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   0.0f, 0.0f,
-		0.5f, -0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   1.0f, 0.0f,
-		0.5f,  0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   1.0f, 1.0f,
-		0.5f,  0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   1.0f, 1.0f,
-		-0.5f,  0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   0.0f, 1.0f,
-		-0.5f, -0.5f,  0.5f,  0.0f,  0.0f, 1.0f,   0.0f, 0.0f,
-
-		-0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-		-0.5f,  0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
-		-0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-		-0.5f, -0.5f, -0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-		-0.5f, -0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-		-0.5f,  0.5f,  0.5f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-
-		0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-		0.5f,  0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
-		0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-		0.5f, -0.5f, -0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-		0.5f, -0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-		0.5f,  0.5f,  0.5f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-
-		-0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-		0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
-		0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-		0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-		-0.5f, -0.5f,  0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
-		-0.5f, -0.5f, -0.5f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-
-		-0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
-		0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
-		0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-		0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-		-0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
-		-0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f
-	};
+	// build and compile our shaders; with the compiler they only link once the model has loaded
+	double shaderStart = glfwGetTime();
+	std::unique_ptr<ShaderCompiler> shaderCompiler;
+	if (USE_SHADER_COMPILER)
+		shaderCompiler = std::make_unique<ShaderCompiler>(window);
+	ShaderVariants lightingShaders("src/shaders/lighting.vs", "src/shaders/lighting.fs", USE_PROGRAM_CACHE, shaderCompiler.get());
+	ShaderVariants resolveShaders("src/shaders/deferred.vs", "src/shaders/lighting.fs", USE_PROGRAM_CACHE, shaderCompiler.get());
+	Shader depthShader("src/shaders/depth.vs", "src/shaders/depth.fs", USE_PROGRAM_CACHE, "", shaderCompiler.get());
+	Shader vtFeedbackShader("src/shaders/lighting.vs", "src/shaders/vt_feedback.fs", USE_PROGRAM_CACHE, "", shaderCompiler.get());
+	// the directional light's shadow cascades
+	std::unique_ptr<ShadowCascades> shadowCascades;
+	if (USE_SHADOWS)
+		shadowCascades = std::make_unique<ShadowCascades>(USE_PROGRAM_CACHE, shaderCompiler.get());
+	// the scene's offscreen target and its resolution controller
+	std::unique_ptr<DynamicResolution> dynamicResolution;
+	if (USE_DYNAMIC_RESOLUTION)
+		dynamicResolution = std::make_unique<DynamicResolution>(SCR_WIDTH, SCR_HEIGHT, USE_PROGRAM_CACHE, shaderCompiler.get());
+	// light gizmos and other debug primitives
+	DebugRenderer debugRenderer(USE_PROGRAM_CACHE, shaderCompiler.get());
+
     // // positions all containers
     // glm::vec3 cubePositions[] = {
     //     glm::vec3( 0.0f,  0.0f,  0.0f),
@@ -252,57 +310,303 @@ int main()
 	// glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)(6*sizeof(float)));
 	// glEnableVertexAttribArray(2);
 
-	// light VAO
-	unsigned int lightSourceVBO;
-	unsigned int lightSourceVAO;
-	glGenBuffers(1, &lightSourceVBO);
-	glGenVertexArrays(1, &lightSourceVAO);
-	glBindVertexArray(lightSourceVAO);
-	
-	glBindBuffer(GL_ARRAY_BUFFER, lightSourceVBO);
-	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-
+	// unsigned int texture = loadTexture("data/textures/container2.png");
+	// unsigned int texture_specular = loadTexture("data/textures/container2_specular.png");
 
-	// we only need to bind to the VBO, the container's VBO's data already contains the data.
-	glBindBuffer(GL_ARRAY_BUFFER, lightSourceVBO);
-	// set the vertex attribute 
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 8 * sizeof(float), (void*)0);
-	glEnableVertexAttribArray(0);
+	// virtual texturing
+	std::unique_ptr<VirtualTexture> virtualTexture;
+	if (USE_VIRTUAL_TEXTURING)
+		virtualTexture = std::make_unique<VirtualTexture>("data/cache/vt", SCR_WIDTH, SCR_HEIGHT);
 
+	// asynchronous texture uploads
+	std::unique_ptr<TextureUploader> textureUploader;
+	if (USE_UPLOAD_RING)
+		textureUploader = std::make_unique<TextureUploader>();
 
-	// unsigned int texture = loadTexture("data/textures/container2.png");
-	// unsigned int texture_specular = loadTexture("data/textures/container2_specular.png");
+	// shared vertex and index buffers for multi-draw indirect; on older contexts every mesh keeps its own
+	std::unique_ptr<GeometryPool> geometryPool;
+	if (USE_MULTI_DRAW_INDIRECT && GLAD_GL_VERSION_4_3)
+		geometryPool = std::make_unique<GeometryPool>();
 
 	// load models
     // -----------
-    // Model ourModel("data/models/backpack/backpack.obj");
-	Model ourModel("data/models/donut2.obj");
+    // Model ourModel("data/models/backpack/backpack.obj", false, virtualTexture.get(), textureUploader.get(), geometryPool.get());
+	Model ourModel("data/models/donut2.obj", false, virtualTexture.get(), textureUploader.get(), geometryPool.get());
+	if (USE_OCCLUSION_CULLING)
+	{
+		ourModel.BuildOccluders();
+		unsigned int meshTriangles = 0, occluderTriangles = 0;
+		for (unsigned int i = 0; i < ourModel.meshes.size(); i++)
+		{
+			meshTriangles += (unsigned int)ourModel.meshes[i].indices.size() / 3;
+			occluderTriangles += ourModel.occluders[i].Triangles();
+		}
+		std::cout << "Occluders: " << meshTriangles << " triangles simplified to " << occluderTriangles << std::endl;
+	}
+
+	// report texture upload throughput of either path
+	const UploadStats *uploadStats = &SynchronousUploadStats();
+	if (textureUploader && textureUploader->Available())
+	{
+		textureUploader->Finish();
+		uploadStats = &textureUploader->GetStats();
+	}
+	std::cout << "Textures: " << uploadStats->textures << " (" << uploadStats->bytes / 1024 << " KB) in " << uploadStats->seconds * 1000.0
+			  << " ms, " << uploadStats->MegabytesPerSecond() << " MB/s" << (uploadStats == &SynchronousUploadStats() ? " (synchronous)" : " (PBO ring)") << std::endl;
+
+	// compile the lighting variants the scene needs up front: its lights, and the maps of each material
+	ShaderPermutation scenePermutation;
+	scenePermutation.pointLights = NR_POINT_LIGHTS;
+	scenePermutation.dirLight = true;
+	scenePermutation.spotLight = true;
+	scenePermutation.shadows = USE_SHADOWS;
+	if (USE_CLUSTERED_LIGHTING)
+	{
+		// the point lights and the spot light come from the clusters
+		scenePermutation.pointLights = 0;
+		scenePermutation.spotLight = false;
+		scenePermutation.clustered = true;
+	}
+	// the deferred path draws the same materials without lights into the G-buffer, and lights them in the resolve
+	ShaderPermutation geometryPermutation = scenePermutation;
+	geometryPermutation.pointLights = 0;
+	geometryPermutation.dirLight = false;
+	geometryPermutation.spotLight = false;
+	geometryPermutation.clustered = false;
+	geometryPermutation.shadows = false;
+	geometryPermutation.gbufferOutput = true;
+	ShaderPermutation resolvePermutation = scenePermutation;
+	resolvePermutation.gbufferInput = true;
+	auto prewarm = [&](const ShaderPermutation &permutation) {
+		lightingShaders.Prewarm(ourModel.Permutations(permutation));
+		if (geometryPool)
+		{
+			// and their draw record twins, for when multi-draw indirect is toggled on
+			ShaderPermutation drawRecords = permutation;
+			drawRecords.drawRecords = true;
+			lightingShaders.Prewarm(ourModel.Permutations(drawRecords));
+		}
+		if (MODEL_INSTANCES > 0)
+		{
+			ShaderPermutation instanced = permutation;
+			instanced.instanced = true;
+			lightingShaders.Prewarm(ourModel.Permutations(instanced));
+		}
+	};
+	prewarm(scenePermutation);
+	prewarm(geometryPermutation);
+	resolveShaders.Get(resolvePermutation);
+	if (shaderCompiler)
+		shaderCompiler->Finish();
+	const ShaderStats &shaderStats = GetShaderStats();
+	std::cout << "Shaders: " << shaderStats.programs << " programs (" << lightingShaders.Count() << " lighting variants) in " << shaderStats.seconds * 1000.0 << " ms, "
+			  << shaderStats.cacheHits << " from the program cache" << (USE_PROGRAM_CACHE && ProgramBinarySupported() ? "" : " (disabled)") << std::endl;
+	std::cout << "Startup: shaders and model ready after " << (glfwGetTime() - shaderStart) * 1000.0 << " ms ("
+			  << (shaderCompiler ? shaderCompiler->ModeName() : "no shader compiler") << ")" << std::endl;
+
+	// lights: only the spot light follows the camera, everything else is set up once
+	LightsBlock lights = {};
+	lights.dirLight.direction = glm::vec3(-0.2f, -1.0f, -0.3f);
+	lights.dirLight.ambient = glm::vec3(0.05f, 0.05f, 0.05f);
+	lights.dirLight.diffuse = glm::vec3(0.8f, 0.8f, 0.8f);
+	lights.dirLight.specular = glm::vec3(1.0f, 1.0f, 1.0f);
+	for (unsigned int i = 0; i < NR_POINT_LIGHTS; i++)
+	{
+		lights.pointLights[i].position = pointLightPositions[i];
+		lights.pointLights[i].constant = 1.0f;
+		lights.pointLights[i].linear = 0.09f;
+		lights.pointLights[i].quadratic = 0.032f;
+		lights.pointLights[i].ambient = pointLightColors[i] * 0.05f;
+		lights.pointLights[i].diffuse = pointLightColors[i] * 0.8f;
+		lights.pointLights[i].specular = glm::vec3(1.0f, 1.0f, 1.0f);
+	}
+	lights.spotLight.cutOff = glm::cos(glm::radians(12.5f));
+	lights.spotLight.outerCutOff = glm::cos(glm::radians(17.5f));
+	lights.spotLight.constant = 1.0f;
+	lights.spotLight.linear = 0.09f;
+	lights.spotLight.quadratic = 0.032f;
+	lights.spotLight.ambient = glm::vec3(0.05f, 0.05f, 0.05f);
+	lights.spotLight.diffuse = glm::vec3(0.8f, 0.8f, 0.8f);
+	lights.spotLight.specular = glm::vec3(1.0f, 1.0f, 1.0f);
+
+	// per frame uniform blocks (camera, lights), shared by every program
+	std::unique_ptr<UniformRing> uniformRing = std::make_unique<UniformRing>();
+
+	// the deferred path's G-buffer, kept around so G can switch at any time
+	std::unique_ptr<GBuffer> gbuffer = std::make_unique<GBuffer>(SCR_WIDTH, SCR_HEIGHT);
+
+	// the frame's point and spot lights, binned into clusters
+	std::unique_ptr<LightClusters> lightClusters;
+	if (USE_CLUSTERED_LIGHTING)
+		lightClusters = std::make_unique<LightClusters>();
+
+	// the instanced copies don't move, their transforms and tints are set up once
+	vector<glm::mat4> instanceTransforms(MODEL_INSTANCES);
+	vector<glm::vec4> instanceTints(MODEL_INSTANCES);
+	unsigned int instanceRow = (unsigned int)std::ceil(std::sqrt((float)MODEL_INSTANCES));
+	for (unsigned int i = 0; i < MODEL_INSTANCES; i++)
+	{
+		float x = (float)(i % instanceRow) - instanceRow * 0.5f;
+		float z = -(float)(i / instanceRow);
+		instanceTransforms[i] = glm::translate(glm::mat4(1.0f), glm::vec3(x * 3.0f, -6.0f, z * 3.0f));
+		instanceTints[i] = glm::vec4(0.5f + 0.5f * glm::sin(glm::vec3(i * 0.37f, i * 0.71f, i * 1.13f)), 1.0f);
+	}
+	// and they're culled through a BVH over their bounds, built once
+	SceneBVH instanceBVH;
+	vector<Bounds> instanceBounds(MODEL_INSTANCES);
+	for (unsigned int i = 0; i < MODEL_INSTANCES; i++)
+		instanceBounds[i] = ourModel.bounds.Transformed(instanceTransforms[i]);
+	instanceBVH.Build(instanceBounds);
+	// with occlusion queries, they're drawn in square groups of neighbours instead, one query per group
+	vector<vector<unsigned int>> instanceGroups;
+	vector<Bounds> instanceGroupBounds;
+	unsigned int groupRow = (instanceRow + INSTANCE_GROUP - 1) / INSTANCE_GROUP;
+	for (unsigned int i = 0; i < MODEL_INSTANCES; i++)
+	{
+		unsigned int group = (i / instanceRow / INSTANCE_GROUP) * groupRow + (i % instanceRow) / INSTANCE_GROUP;
+		if (group >= instanceGroups.size())
+		{
+			instanceGroups.resize(group + 1);
+			instanceGroupBounds.resize(group + 1);
+		}
+		instanceGroups[group].push_back(i);
+		instanceGroupBounds[group].Merge(instanceBounds[i]);
+	}
+	std::unique_ptr<OcclusionQueries> occlusionQueries;
+	if (MODEL_INSTANCES > 0)
+		occlusionQueries = std::make_unique<OcclusionQueries>(USE_PROGRAM_CACHE, shaderCompiler.get());
+	vector<unsigned int> visibleInstances;
+	vector<glm::mat4> visibleTransforms;
+	vector<glm::vec4> visibleTints;
+
+	// the model hides what's behind it: its occluders are rasterized on the CPU every frame
+	OcclusionCuller occlusionCuller;
+
+	// draws of the frame, sorted to keep state changes down
+	RenderQueue renderQueue;
+	if (geometryPool)
+		std::cout << "Submission: multi-draw indirect " << (renderQueue.SetMultiDrawIndirect(multiDrawIndirect) ? "on" : "off") << ", M toggles" << std::endl;
+	else
+		std::cout << "Submission: a draw call per mesh (multi-draw indirect needs GL 4.3)" << std::endl;
+	bool deferredShown = deferredShading;
+	std::cout << "Shading: " << (deferredShading ? "deferred" : "forward") << ", G toggles" << std::endl;
+	bool depthPrepassShown = depthPrepass;
+	std::cout << "Depth pre-pass: " << (depthPrepass ? "on" : "off") << ", P toggles" << std::endl;
+	bool occlusionQueriesShown = occlusionQueriesOn;
+	if (occlusionQueries)
+		std::cout << "Instance occlusion: " << (occlusionQueriesOn ? "hardware queries" : "CPU") << ", O toggles" << std::endl;
+
+	// gpu time of the scene pass, printed with the other stats every few seconds
+	std::unique_ptr<GpuTimer> modelTimer = std::make_unique<GpuTimer>();
+	double lastStatsTime = 0.0;
+
+	// the simulation runs in fixed steps; frames render the camera between its last two positions
+	FixedTimestep timestep;
+	glm::vec3 previousCameraPosition = camera.Position;
+	double simulationSeconds = 0.0;
 
 	// render loop
 	while (!glfwWindowShouldClose(window))
 	{
 		// time
-		float currentFrame = glfwGetTime();
-		deltaTime = currentFrame - lastFrame;
-		lastFrame = currentFrame; 
+		double currentFrame = glfwGetTime();
+		timestep.Advance(currentFrame);
 
-		// input
+		// input, and the simulation steps the frame's time adds up to
 		processInput(window);
+		double simulationStart = glfwGetTime();
+		for (unsigned int i = 0; i < timestep.Steps(); i++)
+		{
+			previousCameraPosition = camera.Position;
+			simulate(window, (float)timestep.Step());
+		}
+		simulationSeconds += glfwGetTime() - simulationStart;
+		// mouse look isn't simulated, it stays immediate
+		Camera frameCamera = camera;
+		frameCamera.Position = glm::mix(previousCameraPosition, camera.Position, (float)timestep.Alpha());
+		double frameTime = timestep.InterpolatedTime();
+
+		// issue any texture uploads that finished decoding
+		if (textureUploader)
+			textureUploader->Update();
+
+		// the window's framebuffer in pixels, which differs from the window size on HiDPI screens; 0 x 0 minimized
+		int framebufferWidth = 0, framebufferHeight = 0;
+		glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+		framebufferWidth = std::max(framebufferWidth, 1);
+		framebufferHeight = std::max(framebufferHeight, 1);
+		float aspect = (float)framebufferWidth / (float)framebufferHeight;
+
+		// the scene's resolution this frame, the window's without dynamic resolution
+		if (dynamicResolution)
+			dynamicResolution->Resize(framebufferWidth, framebufferHeight);
+		unsigned int renderWidth = dynamicResolution ? dynamicResolution->RenderWidth() : framebufferWidth;
+		unsigned int renderHeight = dynamicResolution ? dynamicResolution->RenderHeight() : framebufferHeight;
 
-		// render
-		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
-		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		// view/projection transformation
+		glm::mat4 projection = frameCamera.GetProjectionMatrix(aspect, 0.1f, 100.0f);
+        glm::mat4 view = frameCamera.GetViewMatrix();
+		Frustum frustum(projection * view);
+		const Frustum *cullFrustum = USE_FRUSTUM_CULLING ? &frustum : nullptr;
 
+		// model transformation
+        glm::mat4 model = glm::mat4(1.0f);
+        model = glm::translate(model, glm::vec3(0.0f, 0.0f, 0.0f)); // translate it down so it's at the center of the scene
+        model = glm::scale(model, glm::vec3(1.0f, 1.0f, 1.0f));	// it's a bit too big for our scene, so scale it down
 
+		// per frame uniform blocks
+		CameraBlock cameraBlock = {};
+		cameraBlock.projection = projection;
+		cameraBlock.view = view;
+		cameraBlock.viewPos = frameCamera.Position;
+		lights.spotLight.position = frameCamera.Position;
+		lights.spotLight.direction = frameCamera.Front;
+		uniformRing->Set(CAMERA_BLOCK_BINDING, cameraBlock);
+		uniformRing->Set(LIGHTS_BLOCK_BINDING, lights);
+		uniformRing->Commit();
+
+		if (lightClusters)
+		{
+			lightClusters->Begin(view, projection, 0.1f, 100.0f, renderWidth, renderHeight);
+			for (unsigned int i = 0; i < NR_POINT_LIGHTS; i++)
+				lightClusters->AddPointLight(lights.pointLights[i]);
+			lightClusters->AddSpotLight(lights.spotLight);
+			for (unsigned int i = 0; i < DEMO_LIGHTS; i++)
+			{
+				// spread over a ring around the model, each on its own orbit
+				float angle = (float)std::fmod(frameTime * (0.2 + 0.3 * (i % 7) / 7.0) + i * 2.39996, 2.0 * glm::pi<double>());
+				float radius = 1.5f + 3.0f * (i % 13) / 13.0f;
+				PointLightBlock demo = {};
+				demo.position = glm::vec3(radius * glm::cos(angle), 1.5f * glm::sin(angle * 3.0f + i), radius * glm::sin(angle));
+				demo.constant = 1.0f;
+				demo.linear = 4.5f;
+				demo.quadratic = 75.0f;
+				glm::vec3 color = 0.5f + 0.5f * glm::sin(glm::vec3(i * 0.37f, i * 0.71f + 2.0f, i * 1.13f + 4.0f));
+				demo.diffuse = color * 0.15f;
+				demo.specular = demo.diffuse;
+				lightClusters->AddPointLight(demo);
+				debugRenderer.Cube(demo.position, 0.03f, color);
+			}
+			lightClusters->Build();
+		}
 
-		// view/projection transformation
-		glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), 
-		(float)SCR_WIDTH / (float)SCR_HEIGHT,
-		 0.1f,
-		 100.0f);
-        glm::mat4 view = camera.GetViewMatrix();
+		// virtual texture feedback: render the pages we need at low resolution, then stream them in
+		if (virtualTexture)
+		{
+			virtualTexture->BeginFeedback(vtFeedbackShader);
+			vtFeedbackShader.setMat4("model"_uniform, model);
+			vtFeedbackShader.setMat3("normalMatrix"_uniform, NormalMatrix(model));
+			ourModel.Draw(vtFeedbackShader);
+			virtualTexture->EndFeedback();
+			virtualTexture->Update();
+		}
+
+		// render
+		if (dynamicResolution)
+			dynamicResolution->Begin();
+		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-       
 
 
 		// light setup
@@ -314,21 +618,38 @@ int main()
 		// glm::vec3 lightDiffuseColor = lightColor   * glm::vec3(0.5f); 
 		// glm::vec3 lightAmbientColor = lightDiffuseColor * glm::vec3(0.2f); 
 
-		// render light source object
-		lightSourceShader.use();
-		lightSourceShader.setMat4("projection", projection);
-        lightSourceShader.setMat4("view", view);
-		glBindVertexArray(lightSourceVAO);
-		for (unsigned int i = 0; i < 4; i++)
+		// queue the frame's draws: the loaded model, and the light source objects as debug cubes
+		if (geometryPool && renderQueue.MultiDrawIndirect() != multiDrawIndirect)
+			std::cout << "Submission: multi-draw indirect " << (renderQueue.SetMultiDrawIndirect(multiDrawIndirect) ? "on" : "off") << std::endl;
+		if (deferredShown != deferredShading)
 		{
-			lightSourceShader.setVec3("lightColor", pointLightColors[i]);
-			
-			glm::mat4 model = glm::mat4(1.0f);
-			model = glm::translate(model, pointLightPositions[i]);
-			model = glm::scale(model, glm::vec3(0.2f)); // Make it a smaller cube
-			lightSourceShader.setMat4("model", model);
-			glDrawArrays(GL_TRIANGLES, 0, 36);
+			// the scene pass timings of the two paths shouldn't mix
+			std::cout << "Shading: " << (deferredShading ? "deferred" : "forward") << std::endl;
+			modelTimer->Reset();
+			deferredShown = deferredShading;
 		}
+		if (depthPrepassShown != depthPrepass)
+		{
+			std::cout << "Depth pre-pass: " << (depthPrepass ? "on" : "off") << std::endl;
+			modelTimer->Reset();
+			depthPrepassShown = depthPrepass;
+		}
+		ShaderPermutation framePermutation = deferredShading ? geometryPermutation : scenePermutation;
+		ShaderPermutation instancedPermutation = framePermutation;
+		instancedPermutation.instanced = true;
+		const OcclusionCuller *cullOcclusion = nullptr;
+		if (USE_OCCLUSION_CULLING)
+		{
+			occlusionCuller.Begin(projection * view);
+			ourModel.SubmitOccluders(occlusionCuller, model);
+			occlusionCuller.Rasterize();
+			cullOcclusion = &occlusionCuller;
+		}
+		renderQueue.Begin(view, 100.0f, cullFrustum, cullOcclusion);
+		ourModel.Submit(renderQueue, lightingShaders, framePermutation, model);
+		for (unsigned int i = 0; i < 4; i++)
+			debugRenderer.Cube(pointLightPositions[i], 0.2f, pointLightColors[i]);
+		renderQueue.Sort();
         // glDrawArrays(GL_TRIANGLES, 0, 36);
 
 		// // render the cubes
@@ -348,55 +669,6 @@ int main()
 		// // lightingShader.setVec3("material.specular", 0.727811f, 0.626959f, 0.626959f);
 		// // lightingShader.setFloat("material.shininess", 0.6f * 128);
 
-        lightingShader.use();
-
-		lightingShader.setVec3("dirLight.direction", -0.2f, -1.0f, -0.3f); 
-		lightingShader.setVec3("dirLight.ambient", 0.05f, 0.05f, 0.05f);
-		lightingShader.setVec3("dirLight.diffuse", 0.8f, 0.8f, 0.8f);
-		lightingShader.setVec3("dirLight.specular", 1.0f, 1.0f, 1.0f); 
-
-		lightingShader.setVec3("pointLights[0].position", pointLightPositions[0]); 
-		lightingShader.setFloat("pointLights[0].constant", 1.0f); 
-		lightingShader.setFloat("pointLights[0].linear", 0.09f); 
-		lightingShader.setFloat("pointLights[0].quadratic", 0.032f); 
-		lightingShader.setVec3("pointLights[0].ambient", pointLightColors[0]*0.05f);
-		lightingShader.setVec3("pointLights[0].diffuse", pointLightColors[0]*0.8f);
-		lightingShader.setVec3("pointLights[0].specular", 1.0f, 1.0f, 1.0f); 
-		lightingShader.setVec3("pointLights[1].position", pointLightPositions[1]); 
-		lightingShader.setFloat("pointLights[1].constant", 1.0f); 
-		lightingShader.setFloat("pointLights[1].linear", 0.09f); 
-		lightingShader.setFloat("pointLights[1].quadratic", 0.032f); 
-		lightingShader.setVec3("pointLights[1].ambient", pointLightColors[1]*0.05f);
-		lightingShader.setVec3("pointLights[1].diffuse", pointLightColors[1]*0.8f);
-		lightingShader.setVec3("pointLights[1].specular", 1.0f, 1.0f, 1.0f); 
-		lightingShader.setVec3("pointLights[2].position", pointLightPositions[2]); 
-		lightingShader.setFloat("pointLights[2].constant", 1.0f); 
-		lightingShader.setFloat("pointLights[2].linear", 0.09f); 
-		lightingShader.setFloat("pointLights[2].quadratic", 0.032f); 
-		lightingShader.setVec3("pointLights[2].ambient", pointLightColors[2]*0.05f);
-		lightingShader.setVec3("pointLights[2].diffuse", pointLightColors[2]*0.8f);
-		lightingShader.setVec3("pointLights[2].specular", 1.0f, 1.0f, 1.0f); 
-		lightingShader.setVec3("pointLights[3].position", pointLightPositions[3]); 
-		lightingShader.setFloat("pointLights[3].constant", 1.0f); 
-		lightingShader.setFloat("pointLights[3].linear", 0.09f); 
-		lightingShader.setFloat("pointLights[3].quadratic", 0.032f); 
-		lightingShader.setVec3("pointLights[3].ambient", pointLightColors[3]*0.05f);
-		lightingShader.setVec3("pointLights[3].diffuse", pointLightColors[3]*0.8f);
-		lightingShader.setVec3("pointLights[3].specular", 1.0f, 1.0f, 1.0f); 
-
-		lightingShader.setVec3("spotLight.position",  camera.Position);
-		lightingShader.setVec3("spotLight.direction", camera.Front);
-		lightingShader.setFloat("spotLight.cutOff",   glm::cos(glm::radians(12.5f)));
-		lightingShader.setFloat("spotLight.outerCutOff",   glm::cos(glm::radians(17.5f)));
-		lightingShader.setFloat("spotLight.constant", 1.0f); 
-		lightingShader.setFloat("spotLight.linear", 0.09f); 
-		lightingShader.setFloat("spotLight.quadratic", 0.032f); 
-		lightingShader.setVec3("spotLight.ambient", 0.05f, 0.05f, 0.05f);
-		lightingShader.setVec3("spotLight.diffuse", 0.8f, 0.8f, 0.8f);
-		lightingShader.setVec3("spotLight.specular", 1.0f, 1.0f, 1.0f); 
-
-		// lightingShader.setVec3("viewPos", camera.Position); 
-
 		// glActiveTexture(GL_TEXTURE0);
 		// glBindTexture(GL_TEXTURE_2D, texture);
 
@@ -422,18 +694,191 @@ int main()
         // }
 
 
- 		// render the loaded model
-        glm::mat4 model = glm::mat4(1.0f);
-        model = glm::translate(model, glm::vec3(0.0f, 0.0f, 0.0f)); // translate it down so it's at the center of the scene
-        model = glm::scale(model, glm::vec3(1.0f, 1.0f, 1.0f));	// it's a bit too big for our scene, so scale it down
-		lightingShader.setMat4("projection", projection);
-        lightingShader.setMat4("view", view);
-        lightingShader.setMat4("model", model);
-		lightingShader.setFloat("material.shininess", 32.0f);
+		// the shadow cascades that moved or whose casters changed, culled against each cascade
+		if (shadowCascades)
+		{
+			shadowCascades->Update(view, glm::radians(frameCamera.Zoom), aspect, 0.1f, lights.dirLight.direction);
+			shadowCascades->Render([&](const Frustum &cascade, Shader &depth, Shader &instancedDepth) {
+				unsigned int draws = ourModel.DrawDepth(depth, model, &cascade);
+				// the copies in the cascade, one instanced draw per mesh
+				if (MODEL_INSTANCES > 0 && ourModel.DrawDepthInstanced(instancedDepth, instanceTransforms.data(), MODEL_INSTANCES, &cascade) > 0)
+					draws += (unsigned int)ourModel.meshes.size();
+				return draws;
+			});
+		}
+
+ 		// render the queued draws
+        modelTimer->Begin();
+		auto prepareLighting = [&](Shader &shader) {
+			if (virtualTexture)
+				virtualTexture->Bind(shader);
+			if (lightClusters)
+				lightClusters->Bind(shader);
+			if (shadowCascades)
+				shadowCascades->Bind(shader);
+		};
+		if (deferredShading)
+		{
+			gbuffer->Resize(renderWidth, renderHeight);
+			gbuffer->BeginGeometry();
+		}
+		if (depthPrepass)
+			renderQueue.ExecuteDepth(depthShader);
+        renderQueue.Execute(prepareLighting);
+		const glm::mat4 *transforms = instanceTransforms.data();
+		const glm::vec4 *tints = instanceTints.data();
+		unsigned int instanceCount = MODEL_INSTANCES;
+		unsigned int instancesOccluded = 0;
+		unsigned int instancesDrawn = 0;
+		if (occlusionQueries && occlusionQueriesShown != occlusionQueriesOn)
+		{
+			std::cout << "Instance occlusion: " << (occlusionQueriesOn ? "hardware queries" : "CPU") << std::endl;
+			occlusionQueriesShown = occlusionQueriesOn;
+		}
+		if (occlusionQueries && occlusionQueriesOn)
+		{
+			// each group is drawn if its box passed any samples last frame, then queried against this frame's depth
+			occlusionQueries->Begin(frameCamera.Position, 0.1f);
+			for (unsigned int group = 0; group < instanceGroups.size(); group++)
+			{
+				if (cullFrustum && !frustum.Intersects(instanceGroupBounds[group]))
+					continue;
+				visibleTransforms.clear();
+				visibleTints.clear();
+				for (unsigned int i = 0; i < instanceGroups[group].size(); i++)
+				{
+					visibleTransforms.push_back(instanceTransforms[instanceGroups[group][i]]);
+					visibleTints.push_back(instanceTints[instanceGroups[group][i]]);
+				}
+				occlusionQueries->BeginDraw(group, instanceGroupBounds[group]);
+				instancesDrawn += ourModel.DrawInstanced(lightingShaders, instancedPermutation, visibleTransforms.data(), (unsigned int)visibleTransforms.size(),
+														 visibleTints.data(), prepareLighting, cullFrustum);
+				occlusionQueries->EndDraw();
+			}
+			occlusionQueries->Issue();
+			instanceCount = 0;
+		}
+		else if (MODEL_INSTANCES > 0 && (USE_FRUSTUM_CULLING || cullOcclusion))
+		{
+			// the copies in the frustum, or all of them without frustum culling, less those behind the occluders
+			if (USE_FRUSTUM_CULLING)
+				instanceBVH.Cull(frustum, visibleInstances);
+			else
+			{
+				visibleInstances.resize(MODEL_INSTANCES);
+				for (unsigned int i = 0; i < MODEL_INSTANCES; i++)
+					visibleInstances[i] = i;
+			}
+			visibleTransforms.clear();
+			visibleTints.clear();
+			for (unsigned int i = 0; i < visibleInstances.size(); i++)
+			{
+				if (cullOcclusion && !cullOcclusion->Visible(instanceBounds[visibleInstances[i]]))
+				{
+					instancesOccluded++;
+					continue;
+				}
+				visibleTransforms.push_back(instanceTransforms[visibleInstances[i]]);
+				visibleTints.push_back(instanceTints[visibleInstances[i]]);
+			}
+			transforms = visibleTransforms.data();
+			tints = visibleTints.data();
+			instanceCount = (unsigned int)visibleTransforms.size();
+		}
+		if (instanceCount > 0)
+			instancesDrawn = ourModel.DrawInstanced(lightingShaders, instancedPermutation, transforms, instanceCount, tints, prepareLighting);
+		if (deferredShading)
+		{
+			// light every covered pixel once, however often it was overdrawn
+			gbuffer->EndGeometry();
+			Shader &resolveShader = resolveShaders.Get(resolvePermutation);
+			resolveShader.use();
+			gbuffer->Bind(resolveShader, projection * view);
+			if (lightClusters)
+				lightClusters->Bind(resolveShader);
+			if (shadowCascades)
+				shadowCascades->Bind(resolveShader);
+			gbuffer->DrawFullscreen();
+		}
+		debugRenderer.Flush();
+        modelTimer->End();
+		if (dynamicResolution)
+		{
+			dynamicResolution->End();
+			dynamicResolution->Present();
+		}
 
-        ourModel.Draw(lightingShader);
+		// stats
+		if (currentFrame - lastStatsTime > 5.0)
+		{
+			std::cout << "Scene pass: " << modelTimer->AverageMilliseconds() << " ms GPU (" << modelTimer->Samples() << " frames, "
+					  << (deferredShading ? "deferred" : "forward") << ", depth pre-pass " << (depthPrepass ? "on" : "off") << ")" << std::endl;
+			const RenderQueue::Stats &queueStats = renderQueue.GetStats();
+			std::cout << "Render queue: " << queueStats.draws << " draws in " << queueStats.multiDraws << " multi-draws, "
+					  << (queueStats.depthDraws > 0 ? std::to_string(queueStats.depthDraws) + " depth draws, " : std::string()) << queueStats.programChanges << " program and "
+					  << queueStats.materialChanges << " material changes, sorted in " << queueStats.sortMilliseconds << " ms" << std::endl;
+			if (USE_FRUSTUM_CULLING)
+				std::cout << "Frustum culling: " << queueStats.culled << " draws culled in " << queueStats.cullMilliseconds << " ms"
+						  << (MODEL_INSTANCES > 0 ? ", " + std::to_string(MODEL_INSTANCES - instancesDrawn - instancesOccluded) + " instances" : std::string()) << std::endl;
+			if (USE_OCCLUSION_CULLING)
+			{
+				const OcclusionCuller::Stats &occlusionStats = occlusionCuller.GetStats();
+				std::cout << "Occlusion culling: " << queueStats.occluded << " draws" << (MODEL_INSTANCES > 0 ? " and " + std::to_string(instancesOccluded) + " instances" : std::string())
+						  << " occluded, " << occlusionStats.triangles << " occluder triangles rasterized in " << occlusionStats.milliseconds << " ms" << std::endl;
+			}
+			if (occlusionQueries && occlusionQueriesOn)
+			{
+				const OcclusionQueries::Stats &queryStats = occlusionQueries->GetStats();
+				std::cout << "Occlusion queries: " << queryStats.queries << " issued, " << queryStats.conditionalDraws << " conditional draws, "
+						  << queryStats.skippedDraws << " of " << queryStats.resolvedDraws << " resolved ones skipped, results after "
+						  << queryStats.latencyFrames << " frames" << std::endl;
+			}
+			if (shadowCascades)
+			{
+				const ShadowCascades::Stats &shadowStats = shadowCascades->GetStats();
+				std::cout << "Shadows: " << shadowStats.rendered << " cascades rendered (" << shadowStats.refitted << " refitted), " << shadowStats.cached
+						  << " cached, " << shadowStats.draws << " draws in " << shadowStats.milliseconds << " ms CPU this frame; "
+						  << shadowCascades->Timer().AverageMilliseconds() << " ms GPU over " << shadowCascades->Timer().Samples() << " rendering frames" << std::endl;
+				shadowCascades->Timer().Reset();
+			}
+			if (dynamicResolution)
+			{
+				DynamicResolution::Stats resolutionStats = dynamicResolution->GetStats();
+				std::cout << "Dynamic resolution: " << dynamicResolution->RenderWidth() << "x" << dynamicResolution->RenderHeight() << ", scale "
+						  << resolutionStats.minScale << "-" << resolutionStats.maxScale << " (" << resolutionStats.averageScale << " on average), frames "
+						  << resolutionStats.minMilliseconds << "-" << resolutionStats.maxMilliseconds << " ms GPU (" << resolutionStats.averageMilliseconds
+						  << " on average, target " << DYNAMIC_RESOLUTION_TARGET_MS << ") over " << resolutionStats.frames << " frames, "
+						  << resolutionStats.changes << " changes" << std::endl;
+				dynamicResolution->ResetStats();
+			}
+			const FixedTimestep::Stats &simulationStats = timestep.GetStats();
+			std::cout << "Simulation: " << simulationStats.steps << " steps of " << timestep.Step() * 1000.0 << " ms over " << simulationStats.frames
+					  << " frames (up to " << simulationStats.maxSteps << " in one), " << (simulationStats.steps > 0 ? simulationSeconds * 1000.0 / simulationStats.steps : 0.0)
+					  << " ms CPU per step, " << simulationStats.droppedSeconds << " s dropped" << std::endl;
+			timestep.ResetStats();
+			simulationSeconds = 0.0;
+			if (lightClusters)
+			{
+				const LightClusters::Stats &clusterStats = lightClusters->GetStats();
+				std::cout << "Light clusters: " << clusterStats.lights << " lights, " << (double)clusterStats.indices / CLUSTER_COUNT
+						  << " per cluster on average, binned in " << clusterStats.binMilliseconds << " ms" << std::endl;
+			}
+			std::cout << "Debug renderer: " << debugRenderer.GetStats().primitives << " primitives in " << debugRenderer.GetStats().draws << " draws" << std::endl;
+			modelTimer->Reset();
+			RenderState &state = GetRenderState();
+			std::cout << "Render state: " << state.AverageIssued() << " GL calls per frame, " << state.AverageSkipped() << " redundant ones skipped" << std::endl;
+			state.ResetTotals();
+			if (virtualTexture)
+			{
+				const VirtualTexture::Stats &stats = virtualTexture->GetStats();
+				std::cout << "Virtual texture: " << stats.requested << " pages requested, " << stats.resident << " resident, "
+						  << stats.pending << " pending" << std::endl;
+			}
+			lastStatsTime = currentFrame;
+		}
 
 		// glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
+		GetRenderState().EndFrame();
 		glfwSwapBuffers(window);
 		glfwPollEvents();
 	}
@@ -442,6 +887,16 @@ int main()
     // glDeleteVertexArrays(1, &VAO);
     // glDeleteBuffers(1, &VBO);
 
+    virtualTexture.reset();
+    textureUploader.reset();
+    uniformRing.reset();
+    lightClusters.reset();
+    gbuffer.reset();
+    shadowCascades.reset();
+    dynamicResolution.reset();
+    modelTimer.reset();
+    shaderCompiler.reset();
+
     // glfw: terminate, clearing all previously allocated GLFW resources.
 	glfwTerminate();
 
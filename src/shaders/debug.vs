@@ -0,0 +1,34 @@
+#version 330 core
+// debug_renderer.h: instanced shapes, or with DEBUG_LINES world space lines with a color per vertex
+#ifndef DEBUG_LINES
+#define DEBUG_LINES 0
+#endif
+layout (location = 0) in vec3 aPos;
+#if DEBUG_LINES
+layout (location = 1) in vec4 aColor;
+#else
+layout (location = 6) in mat4 aInstanceModel;
+layout (location = 10) in vec4 aInstanceData; // color
+#endif
+
+layout (std140) uniform Camera {
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+};
+
+flat out vec4 Color;
+
+void main()
+{
+#if DEBUG_LINES
+    vec3 position = aPos;
+    Color = aColor;
+#else
+    // w is only not 1 for frustums, whose transform is an inverse projection
+    vec4 world = aInstanceModel * vec4(aPos, 1.0);
+    vec3 position = world.xyz / world.w;
+    Color = aInstanceData;
+#endif
+    gl_Position = projection * view * vec4(position, 1.0);
+}
\ No newline at end of file
@@ -0,0 +1,42 @@
+#version 330 core
+// depth only passes (render_queue.h ExecuteDepth): positions from a mesh's position stream. gl_Position is
+// computed exactly like lighting.vs does, and invariant in both, so the shading pass can test GL_EQUAL.
+// With SHADOW_PASS it renders a cascade of the directional light's shadow map (shadow_cascades.h) instead.
+#ifndef SHADOW_PASS
+#define SHADOW_PASS 0
+#endif
+#ifndef HAS_INSTANCING
+#define HAS_INSTANCING 0
+#endif
+layout (location = 0) in vec3 aPos;
+#if HAS_INSTANCING
+layout (location = 6) in mat4 aInstanceModel; // the instance buffer's transform, see instance_buffer.h
+#endif
+
+#if SHADOW_PASS
+uniform mat4 lightViewProjection;
+#else
+layout (std140) uniform Camera {
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+};
+#endif
+
+#if !HAS_INSTANCING
+uniform mat4 model;
+#endif
+
+invariant gl_Position;
+
+void main()
+{
+#if HAS_INSTANCING
+    mat4 model = aInstanceModel;
+#endif
+#if SHADOW_PASS
+    gl_Position = lightViewProjection * model * vec4(aPos, 1.0);
+#else
+    gl_Position = projection * view * model * vec4(aPos, 1.0);
+#endif
+}
@@ -1,10 +0,0 @@
-#version 330 core
-out vec4 FragColor;
-  
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-
-void main()
-{
-    FragColor = vec4(lightColor, 1.0);
-}
\ No newline at end of file
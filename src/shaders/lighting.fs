@@ -1,16 +1,84 @@
 #version 330 core
-struct Material {
-    // sampler2D diffuse;
-    // sampler2D specular;
-    float shininess;
-}; 
+// permutation defines, injected by ShaderVariants (see shader_variants.h); the defaults are the general shader
+#ifndef NR_POINT_LIGHTS
+#define NR_POINT_LIGHTS 4
+#endif
+#ifndef HAS_DIR_LIGHT
+#define HAS_DIR_LIGHT 1
+#endif
+#ifndef HAS_SPOT_LIGHT
+#define HAS_SPOT_LIGHT 1
+#endif
+#ifndef HAS_NORMAL_MAP
+#define HAS_NORMAL_MAP 0
+#endif
+#ifndef HAS_PACKED_MAP
+#define HAS_PACKED_MAP 1
+#endif
+#ifndef HAS_DRAW_RECORDS
+#define HAS_DRAW_RECORDS 0
+#endif
+#ifndef HAS_INSTANCING
+#define HAS_INSTANCING 0
+#endif
+#ifndef HAS_CLUSTERED_LIGHTS
+#define HAS_CLUSTERED_LIGHTS 0
+#endif
+#ifndef HAS_GBUFFER_OUTPUT
+#define HAS_GBUFFER_OUTPUT 0
+#endif
+#ifndef HAS_GBUFFER_INPUT
+#define HAS_GBUFFER_INPUT 0
+#endif
+#ifndef HAS_SHADOWS
+#define HAS_SHADOWS 0
+#endif
 
 uniform sampler2D texture_diffuse1;
 uniform sampler2D texture_diffuse2;
 uniform sampler2D texture_diffuse3;
-uniform sampler2D texture_specular1;
-uniform sampler2D texture_specular2;
+uniform sampler2D texture_packed1; // r: specular, g: ambient occlusion, b: roughness, see material_cook.h
+uniform sampler2D texture_normal1;  // tangent space
+
+// virtual texturing, see virtual_texture.h for the matching constants
+#define VT_PAGE_SIZE 128.0
+#define VT_PAGE_BORDER 4.0
+#define VT_TILE_SIZE 136.0
+#define VT_VIRTUAL_PAGES 256.0
+#define VT_PHYSICAL_PAGES 16.0
+#define VT_MAX_REGIONS 64
+uniform sampler2D vtPageTable;
+uniform sampler2D vtPhysical;
+uniform vec4 vtRegions[VT_MAX_REGIONS]; // xy: first page, z: side (virtual uv), w: max mip
+uniform float vtLodBias;
+uniform int vtDiffuseRegion;  // -1 when texture_diffuse1 is a regular texture
+uniform int vtPackedRegion;   // -1 when texture_packed1 is a regular texture
+
+// clustered lights, see light_clusters.h for the matching constants and the light layout
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_LIGHT_TEXELS 5
+uniform samplerBuffer clusterLights;
+uniform usamplerBuffer clusterGrid;    // per cluster: first index, light count
+uniform usamplerBuffer clusterIndices;
+uniform vec4 clusterScale;             // xy: tiles per pixel, z, w: slice from log(view depth)
+
+// the G-buffer of the deferred path, see gbuffer.h for the layout
+#define GBUFFER_SHININESS_LOG2 11.0 // shininess up to 2048
+uniform sampler2D gbufferAlbedo;
+uniform sampler2D gbufferNormal;
+uniform sampler2D gbufferMaterial;
+uniform sampler2D gbufferDepth;
+uniform mat4 gbufferInverseViewProjection;
 
+// the directional light's shadow cascades, see shadow_cascades.h
+#define SHADOW_CASCADES 4
+uniform sampler2DArrayShadow shadowMap;
+uniform mat4 shadowMatrices[SHADOW_CASCADES]; // world to the cascade's shadow map uv and depth
+uniform vec4 shadowTexelSizes;                // world size of a texel of each cascade
+
+// the light structs and blocks are std140, mirrored by the *Block structs in uniform_buffer.h
 struct DirLight {
     vec3 direction;
   
@@ -21,51 +89,98 @@ struct DirLight {
 
 struct PointLight {    
     vec3 position;
-    
     float constant;
-    float linear;
-    float quadratic;  
-
     vec3 ambient;
+    float linear;
     vec3 diffuse;
+    float quadratic;  
     vec3 specular;
 };  
 
 struct SpotLight {
     vec3  position;
-    vec3  direction;
-
     float cutOff;
+    vec3  direction;
     float outerCutOff;
 
+    vec3 ambient;
     float constant;
+    vec3 diffuse;
     float linear;
+    vec3 specular;
     float quadratic; 
+};
 
-    vec3 ambient;
-    vec3 diffuse;
-    vec3 specular;
+// the material inputs of one fragment, every material texture is fetched once in SampleSurface()
+struct Surface {
+    vec3 albedo;
+    float specular;
+    float occlusion;
+    float shininess;
 };
 
+#if !HAS_GBUFFER_INPUT
 in vec3 Normal;
 in vec3 FragPos; 
 in vec2 TexCoords;
+#if HAS_NORMAL_MAP
+in mat3 TBN;
+#endif
+#endif
 
+layout (std140) uniform Camera {
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+};
 // uniform vec3 lightPos;
-uniform vec3 viewPos;
-uniform Material material;
-// uniform Light light; 
-uniform DirLight dirLight;
-#define NR_POINT_LIGHTS 4  
-uniform PointLight pointLights[NR_POINT_LIGHTS];
-uniform SpotLight spotLight;
+// the block always holds every light, NR_POINT_LIGHTS only limits how many are evaluated
+#define MAX_POINT_LIGHTS 4  
+layout (std140) uniform Lights {
+    DirLight dirLight;
+    PointLight pointLights[MAX_POINT_LIGHTS];
+    SpotLight spotLight;
+};
+layout (std140) uniform Material {
+    float shininess;
+    float specular; // specular intensity of materials without a packed map
+} material;
+
+// the material's regions and constants, from the uniforms or from the draw's record (see Material::DrawRecord())
+#if HAS_DRAW_RECORDS
+flat in vec4 DrawMaterial;
+#define DIFFUSE_REGION int(DrawMaterial.x)
+#define PACKED_REGION int(DrawMaterial.y)
+#define MATERIAL_SHININESS DrawMaterial.z
+#define MATERIAL_SPECULAR DrawMaterial.w
+#else
+#define DIFFUSE_REGION vtDiffuseRegion
+#define PACKED_REGION vtPackedRegion
+#define MATERIAL_SHININESS material.shininess
+#define MATERIAL_SPECULAR material.specular
+#endif
+#if HAS_INSTANCING
+flat in vec4 InstanceData; // rgb: tint of the instance's albedo
+#endif
 
 
+#if HAS_GBUFFER_OUTPUT
+layout (location = 0) out vec4 GAlbedo;
+layout (location = 1) out vec2 GNormal;
+layout (location = 2) out vec2 GMaterial;
+#else
 out vec4 FragColor;
+#endif
 
-vec3 CalcDirLight(DirLight light, vec3 normal, vec3 viewDir);
-vec3 CalcPointLight(PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir); 
-vec3 CalcSpotLight(SpotLight light, vec3 norm, vec3 fragPos, vec3 viewDir); 
+vec3 CalcDirLight(DirLight light, Surface surface, vec3 normal, vec3 viewDir, float shadow);
+vec3 CalcPointLight(PointLight light, Surface surface, vec3 normal, vec3 fragPos, vec3 viewDir); 
+vec3 CalcSpotLight(SpotLight light, Surface surface, vec3 norm, vec3 fragPos, vec3 viewDir); 
+vec4 SampleVirtual(int region, vec2 uv);
+Surface SampleSurface();
+Surface ReadSurface(ivec2 pixel);
+vec2 EncodeNormal(vec3 n);
+vec3 DecodeNormal(vec2 encoded);
+float DirShadow(vec3 fragPos, vec3 normal);
 
 float near = 0.1; 
 float far  = 100.0; 
@@ -79,62 +194,152 @@ float LinearizeDepth(float depth)
 void main()
 {
     // FragColor = texture(texture_diffuse1, TexCoords);
+#if HAS_GBUFFER_INPUT
+    // properties, read back from the G-buffer; the background has nothing to light
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    float depth = texelFetch(gbufferDepth, pixel, 0).r;
+    if(depth == 1.0)
+        discard;
+    vec2 ndc = gl_FragCoord.xy / vec2(textureSize(gbufferDepth, 0)) * 2.0 - 1.0;
+    vec4 position = gbufferInverseViewProjection * vec4(ndc, depth * 2.0 - 1.0, 1.0);
+    vec3 fragPos = position.xyz / position.w;
+    vec3 norm = DecodeNormal(texelFetch(gbufferNormal, pixel, 0).rg);
+    Surface surface = ReadSurface(pixel);
+    // keeps the scene's depth for whatever is drawn forward after the resolve
+    gl_FragDepth = depth;
+#else
     // properties
+#if HAS_NORMAL_MAP
+    vec3 norm = normalize(TBN * (texture(texture_normal1, TexCoords).rgb * 2.0 - 1.0));
+#else
     vec3 norm = normalize(Normal);
-    vec3 viewDir = normalize(viewPos - FragPos);
+#endif
+    vec3 fragPos = FragPos;
+    Surface surface = SampleSurface();
+#endif
 
+#if HAS_GBUFFER_OUTPUT
+    // deferred geometry pass: store the surface, the resolve lights it
+    GAlbedo = vec4(surface.albedo, surface.occlusion);
+    GNormal = EncodeNormal(norm);
+    GMaterial = vec2(surface.specular, log2(surface.shininess) / GBUFFER_SHININESS_LOG2);
+#else
+    vec3 viewDir = normalize(viewPos - fragPos);
+
+    vec3 result = vec3(0.0);
+#if HAS_DIR_LIGHT
     // phase 1: Directional lighting
-    vec3 result = CalcDirLight(dirLight, norm, viewDir);
+#if HAS_SHADOWS
+    float shadow = DirShadow(fragPos, norm);
+#else
+    float shadow = 1.0;
+#endif
+    result += CalcDirLight(dirLight, surface, norm, viewDir, shadow);
+#endif
+#if HAS_CLUSTERED_LIGHTS
+    // phase 2: the point and spot lights binned into this fragment's cluster
+    ivec2 tile = min(ivec2(gl_FragCoord.xy * clusterScale.xy), ivec2(CLUSTER_X - 1, CLUSTER_Y - 1));
+    float viewDepth = -(view * vec4(fragPos, 1.0)).z;
+    int slice = clamp(int(log(viewDepth) * clusterScale.z + clusterScale.w), 0, CLUSTER_Z - 1);
+    uvec2 cluster = texelFetch(clusterGrid, (slice * CLUSTER_Y + tile.y) * CLUSTER_X + tile.x).xy;
+    for(uint i = 0u; i < cluster.y; i++)
+    {
+        int light = int(texelFetch(clusterIndices, int(cluster.x + i)).r) * CLUSTER_LIGHT_TEXELS;
+        vec4 positionConstant = texelFetch(clusterLights, light);
+        vec4 ambientLinear = texelFetch(clusterLights, light + 1);
+        vec4 diffuseQuadratic = texelFetch(clusterLights, light + 2);
+        vec4 specularCutOff = texelFetch(clusterLights, light + 3);
+        if(specularCutOff.w > 1.0)
+        {
+            PointLight point = PointLight(positionConstant.xyz, positionConstant.w, ambientLinear.rgb, ambientLinear.w,
+                                          diffuseQuadratic.rgb, diffuseQuadratic.w, specularCutOff.rgb);
+            result += CalcPointLight(point, surface, norm, fragPos, viewDir);
+        }
+        else
+        {
+            vec4 directionOuterCutOff = texelFetch(clusterLights, light + 4);
+            SpotLight spot = SpotLight(positionConstant.xyz, specularCutOff.w, directionOuterCutOff.xyz, directionOuterCutOff.w,
+                                       ambientLinear.rgb, positionConstant.w, diffuseQuadratic.rgb, ambientLinear.w,
+                                       specularCutOff.rgb, diffuseQuadratic.w);
+            result += CalcSpotLight(spot, surface, norm, fragPos, viewDir);
+        }
+    }
+#else
     // phase 2: Point lights
     for(int i = 0; i < NR_POINT_LIGHTS; i++)
-        result += CalcPointLight(pointLights[i], norm, FragPos, viewDir);    
+        result += CalcPointLight(pointLights[i], surface, norm, fragPos, viewDir);    
+#if HAS_SPOT_LIGHT
     // phase 3: Spot light
-    result += CalcSpotLight(spotLight, norm, FragPos, viewDir);  
+    result += CalcSpotLight(spotLight, surface, norm, fragPos, viewDir);  
+#endif
+#endif
     
     // result
     FragColor = vec4(result, 1.0);
+#endif
     // float depth = LinearizeDepth(gl_FragCoord.z) / far; // divide by far for demonstration
     // FragColor = vec4(vec3(1-depth), 1.0);
 }
 
-vec3 CalcDirLight(DirLight light, vec3 normal, vec3 viewDir)
+// shadow only dims the diffuse and specular terms, ambient light reaches everywhere
+vec3 CalcDirLight(DirLight light, Surface surface, vec3 normal, vec3 viewDir, float shadow)
 {
     vec3 lightDir = normalize(-light.direction);
     // diffuse shading
     float diff = max(dot(normal, lightDir), 0.0);
     // specular shading
     vec3 reflectDir = reflect(-lightDir, normal);
-    float spec = pow(max(dot(viewDir, reflectDir), 0.0), material.shininess);
+    float spec = pow(max(dot(viewDir, reflectDir), 0.0), surface.shininess);
     // combine results
-    vec3 ambient  = light.ambient  * vec3(texture(texture_diffuse1, TexCoords));
-    vec3 diffuse  = light.diffuse  * diff * vec3(texture(texture_diffuse1, TexCoords));
-    vec3 specular = light.specular * spec * vec3(texture(texture_specular1, TexCoords));
-    return (ambient + diffuse + specular);
+    vec3 ambient  = light.ambient  * surface.albedo * surface.occlusion;
+    vec3 diffuse  = light.diffuse  * diff * surface.albedo;
+    vec3 specular = light.specular * spec * surface.specular;
+    return (ambient + (diffuse + specular) * shadow);
 } 
 
-vec3 CalcPointLight(PointLight light, vec3 normal, vec3 fragPos, vec3 viewDir)
+// fraction of the directional light reaching fragPos, from the finest cascade covering it; 1 outside them all.
+// The position is pushed along the normal by a texel and a half against acne, and 3x3 bilinear compares
+// soften the edge.
+float DirShadow(vec3 fragPos, vec3 normal)
+{
+    vec2 texel = 1.0 / vec2(textureSize(shadowMap, 0).xy);
+    for(int i = 0; i < SHADOW_CASCADES; i++)
+    {
+        vec4 coord = shadowMatrices[i] * vec4(fragPos + normal * shadowTexelSizes[i] * 1.5, 1.0);
+        if(any(lessThan(coord.xyz, vec3(0.0))) || any(greaterThan(coord.xyz, vec3(1.0))))
+            continue;
+        float lit = 0.0;
+        for(int x = -1; x <= 1; x++)
+            for(int y = -1; y <= 1; y++)
+                lit += texture(shadowMap, vec4(coord.xy + vec2(x, y) * texel, float(i), coord.z));
+        return lit / 9.0;
+    }
+    return 1.0;
+}
+
+vec3 CalcPointLight(PointLight light, Surface surface, vec3 normal, vec3 fragPos, vec3 viewDir)
 {
     vec3 lightDir = normalize(light.position - fragPos);
     // diffuse shading
     float diff = max(dot(normal, lightDir), 0.0);
     // specular shading
     vec3 reflectDir = reflect(-lightDir, normal);
-    float spec = pow(max(dot(viewDir, reflectDir), 0.0), material.shininess);
+    float spec = pow(max(dot(viewDir, reflectDir), 0.0), surface.shininess);
     // attenuation
     float distance    = length(light.position - fragPos);
     float attenuation = 1.0 / (light.constant + light.linear * distance + 
   			     light.quadratic * (distance * distance));    
     // combine results
-    vec3 ambient  = light.ambient  * vec3(texture(texture_specular1, TexCoords));
-    vec3 diffuse  = light.diffuse  * diff * vec3(texture(texture_specular1, TexCoords));
-    vec3 specular = light.specular * spec * vec3(texture(texture_specular1, TexCoords));
+    vec3 ambient  = light.ambient  * surface.albedo * surface.occlusion;
+    vec3 diffuse  = light.diffuse  * diff * surface.albedo;
+    vec3 specular = light.specular * spec * surface.specular;
     ambient  *= attenuation;
     diffuse  *= attenuation;
     specular *= attenuation;
     return (ambient + diffuse + specular);
 } 
 
-vec3 CalcSpotLight(SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDir)
+vec3 CalcSpotLight(SpotLight light, Surface surface, vec3 normal, vec3 fragPos, vec3 viewDir)
 {
     // TODO: send lightDir as param?
     vec3 lightDir = normalize(light.position - fragPos);
@@ -147,7 +352,7 @@ vec3 CalcSpotLight(SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDir)
         float diff = max(dot(normal, lightDir), 0.0);
         // specular shading
         vec3 reflectDir = reflect(-lightDir, normal);
-        float spec = pow(max(dot(viewDir, reflectDir), 0.0), material.shininess);
+        float spec = pow(max(dot(viewDir, reflectDir), 0.0), surface.shininess);
         // attenuation
         float distance    = length(light.position - fragPos);
         float attenuation = 1.0 / (light.constant + light.linear * distance + 
@@ -157,9 +362,9 @@ vec3 CalcSpotLight(SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDir)
         float intensity = clamp((theta - light.outerCutOff) / epsilon, 0.0, 1.0); 
 
         // combine results
-        vec3 ambient  = light.ambient  * vec3(texture(texture_diffuse1, TexCoords));
-        vec3 diffuse  = light.diffuse  * diff * vec3(texture(texture_diffuse1, TexCoords));
-        vec3 specular = light.specular * spec * vec3(texture(texture_specular1, TexCoords));
+        vec3 ambient  = light.ambient  * surface.albedo * surface.occlusion;
+        vec3 diffuse  = light.diffuse  * diff * surface.albedo;
+        vec3 specular = light.specular * spec * surface.specular;
         ambient  *= attenuation * intensity;
         diffuse  *= attenuation * intensity;
         specular *= attenuation * intensity;
@@ -167,3 +372,78 @@ vec3 CalcSpotLight(SpotLight light, vec3 normal, vec3 fragPos, vec3 viewDir)
     }
     return vec3(0);
 }
+
+vec4 SampleVirtual(int region, vec2 uv)
+{
+    vec4 rect = vtRegions[region];
+    // pick the mip from the derivatives of the unwrapped coordinates so repeating seams don't spike the lod
+    vec2 texel = uv * rect.z * (VT_VIRTUAL_PAGES * VT_PAGE_SIZE);
+    vec2 dx = dFdx(texel);
+    vec2 dy = dFdy(texel);
+    float lod = clamp(0.5 * log2(max(dot(dx, dx), dot(dy, dy))) + vtLodBias, 0.0, rect.w);
+    int mip = int(lod);
+
+    // translate through the page table to the best resident tile
+    // fract() returns exactly 1.0 for tiny negative inputs, which would land in the neighbouring region
+    vec2 virtualUV = rect.xy + min(fract(uv), vec2(0.99998)) * rect.z;
+    ivec2 page = ivec2(virtualUV * VT_VIRTUAL_PAGES) >> mip;
+    vec3 entry = texelFetch(vtPageTable, page, mip).rgb * 255.0;
+    vec2 inPage = fract(virtualUV * (VT_VIRTUAL_PAGES / exp2(entry.b)));
+    vec2 physicalUV = (entry.rg * VT_TILE_SIZE + VT_PAGE_BORDER + inPage * VT_PAGE_SIZE) / (VT_PHYSICAL_PAGES * VT_TILE_SIZE);
+    return textureLod(vtPhysical, physicalUV, 0.0);
+}
+
+#if !HAS_GBUFFER_INPUT
+Surface SampleSurface()
+{
+    int diffuseRegion = DIFFUSE_REGION;
+    vec4 albedo = diffuseRegion >= 0 ? SampleVirtual(diffuseRegion, TexCoords) : texture(texture_diffuse1, TexCoords);
+#if HAS_PACKED_MAP
+    int packedRegion = PACKED_REGION;
+    vec4 scalars = packedRegion >= 0 ? SampleVirtual(packedRegion, TexCoords) : texture(texture_packed1, TexCoords);
+#else
+    vec4 scalars = vec4(MATERIAL_SPECULAR, 1.0, 0.0, 1.0);
+#endif
+
+    Surface surface;
+    surface.albedo = albedo.rgb;
+#if HAS_INSTANCING
+    surface.albedo *= InstanceData.rgb;
+#endif
+    surface.specular = scalars.r;
+    surface.occlusion = scalars.g;
+    // rough surfaces get a wider highlight
+    surface.shininess = max(MATERIAL_SHININESS * (1.0 - scalars.b), 1.0);
+    return surface;
+}
+#endif
+
+Surface ReadSurface(ivec2 pixel)
+{
+    vec4 albedo = texelFetch(gbufferAlbedo, pixel, 0);
+    vec2 scalars = texelFetch(gbufferMaterial, pixel, 0).rg;
+
+    Surface surface;
+    surface.albedo = albedo.rgb;
+    surface.specular = scalars.r;
+    surface.occlusion = albedo.a;
+    surface.shininess = exp2(scalars.g * GBUFFER_SHININESS_LOG2);
+    return surface;
+}
+
+// octahedral normal encoding: the unit sphere folded onto a square, in 0..1 for the unsigned normalized target
+vec2 EncodeNormal(vec3 n)
+{
+    n /= abs(n.x) + abs(n.y) + abs(n.z);
+    vec2 folded = n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+    return folded * 0.5 + 0.5;
+}
+
+vec3 DecodeNormal(vec2 encoded)
+{
+    vec2 f = encoded * 2.0 - 1.0;
+    vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
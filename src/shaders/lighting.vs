@@ -1,22 +1,81 @@
 #version 330 core
+#ifndef HAS_NORMAL_MAP
+#define HAS_NORMAL_MAP 0
+#endif
+#ifndef HAS_DRAW_RECORDS
+#define HAS_DRAW_RECORDS 0
+#endif
+#ifndef HAS_INSTANCING
+#define HAS_INSTANCING 0
+#endif
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec3 aNormal;
 layout (location = 2) in vec2 aTexCoords;
+#if HAS_NORMAL_MAP
+layout (location = 3) in vec3 aTangent;
+#endif
 
+#if HAS_DRAW_RECORDS
+// index of the draw within the frame's records, an instanced attribute offset by the indirect command's
+// baseInstance (see geometry_pool.h); every record is 8 texels: the model matrix columns, the material,
+// then the normal matrix columns
+layout (location = 5) in uint aDrawID;
+uniform samplerBuffer drawRecords;
+flat out vec4 DrawMaterial;
+#elif HAS_INSTANCING
+// per instance attributes streamed by InstanceBuffer (see instance_buffer.h)
+layout (location = 6) in mat4 aInstanceModel;
+layout (location = 10) in vec4 aInstanceData;
+layout (location = 11) in mat3 aInstanceNormalMatrix;
+flat out vec4 InstanceData;
+#else
 uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+#endif
+#if !HAS_DRAW_RECORDS && !HAS_INSTANCING
+// the inverse transpose of model's upper 3x3, computed once per draw on the CPU (normal_matrix.h)
+uniform mat3 normalMatrix;
+#endif
+layout (std140) uniform Camera {
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+};
+
+// bit for bit the same as depth.vs, for the GL_EQUAL test after a depth pre-pass
+invariant gl_Position;
 
 out vec3 FragPos; 
 out vec3 Normal;
 out vec2 TexCoords;
+#if HAS_NORMAL_MAP
+out mat3 TBN;
+#endif
 
 void main()
 {
+#if HAS_DRAW_RECORDS
+    int record = int(aDrawID) * 8;
+    mat4 model = mat4(texelFetch(drawRecords, record), texelFetch(drawRecords, record + 1),
+                      texelFetch(drawRecords, record + 2), texelFetch(drawRecords, record + 3));
+    DrawMaterial = texelFetch(drawRecords, record + 4);
+    mat3 normalMatrix = mat3(texelFetch(drawRecords, record + 5).xyz, texelFetch(drawRecords, record + 6).xyz,
+                             texelFetch(drawRecords, record + 7).xyz);
+#elif HAS_INSTANCING
+    mat4 model = aInstanceModel;
+    mat3 normalMatrix = aInstanceNormalMatrix;
+    InstanceData = aInstanceData;
+#endif
     gl_Position = projection * view * model * vec4(aPos, 1.0);
     FragPos = vec3(model * vec4(aPos, 1.0));
     // Normal = aNormal;
-    Normal = mat3(transpose(inverse(model))) * aNormal;  
+    Normal = normalMatrix * aNormal;  
     // TexCoord = vec2(aTexCoord.x, aTexCoord.y);
     TexCoords = aTexCoords;
+#if HAS_NORMAL_MAP
+    // Gram-Schmidt the tangent against the normal, the bitangent follows from both
+    vec3 N = normalize(Normal);
+    vec3 T = normalize(normalMatrix * aTangent);
+    T = normalize(T - dot(T, N) * N);
+    TBN = mat3(T, cross(N, T), N);
+#endif
 }
\ No newline at end of file
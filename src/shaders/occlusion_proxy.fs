@@ -0,0 +1,5 @@
+#version 330 core
+// only the samples passing the depth test count, color writes are masked off
+void main()
+{
+}
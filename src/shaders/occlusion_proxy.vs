@@ -0,0 +1,17 @@
+#version 330 core
+// occlusion_queries.h: the bounding box of an occludee, from the unit cube's -1..1 corners
+layout (location = 0) in vec3 aPos;
+
+layout (std140) uniform Camera {
+    mat4 projection;
+    mat4 view;
+    vec3 viewPos;
+};
+
+uniform vec3 boxCenter;
+uniform vec3 boxExtent;
+
+void main()
+{
+    gl_Position = projection * view * vec4(boxCenter + aPos * boxExtent, 1.0);
+}
@@ -0,0 +1,24 @@
+#version 330 core
+// dynamic_resolution.h: the scene, rendered at a fraction of the window's resolution, scaled up to the window.
+// Bilinear, then sharpened against the four neighbouring scene texels and clamped to their range, so the
+// sharpening doesn't ring around edges.
+uniform sampler2D sceneColor;
+uniform vec2 windowSize;
+uniform float sharpness; // 0 at the window's resolution, a plain copy
+
+out vec4 FragColor;
+
+void main()
+{
+    vec2 uv = gl_FragCoord.xy / windowSize;
+    vec2 texel = 1.0 / vec2(textureSize(sceneColor, 0));
+    vec3 center = texture(sceneColor, uv).rgb;
+    vec3 left   = texture(sceneColor, uv - vec2(texel.x, 0.0)).rgb;
+    vec3 right  = texture(sceneColor, uv + vec2(texel.x, 0.0)).rgb;
+    vec3 down   = texture(sceneColor, uv - vec2(0.0, texel.y)).rgb;
+    vec3 up     = texture(sceneColor, uv + vec2(0.0, texel.y)).rgb;
+    vec3 low  = min(center, min(min(left, right), min(down, up)));
+    vec3 high = max(center, max(max(left, right), max(down, up)));
+    vec3 sharpened = center + (4.0 * center - (left + right + down + up)) * 0.25 * sharpness;
+    FragColor = vec4(clamp(sharpened, low, high), 1.0);
+}
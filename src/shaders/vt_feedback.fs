@@ -0,0 +1,42 @@
+#version 330 core
+out vec4 FragColor;
+
+in vec2 TexCoords;
+
+// see virtual_texture.h for the matching constants
+#define VT_PAGE_SIZE 128.0
+#define VT_VIRTUAL_PAGES 256.0
+#define VT_MAX_REGIONS 64
+uniform vec4 vtRegions[VT_MAX_REGIONS]; // xy: first page, z: side (virtual uv), w: max mip
+uniform float vtLodBias;
+uniform int vtDiffuseRegion;
+uniform int vtPackedRegion;
+
+void main()
+{
+    // derivatives first, while every pixel of the quad is still taking the same path
+    vec2 dx = dFdx(TexCoords);
+    vec2 dy = dFdy(TexCoords);
+
+    // alternate between the two virtual textures in a checkerboard; at feedback resolution that's plenty
+    bool packedSlot = ((int(gl_FragCoord.x) + int(gl_FragCoord.y)) & 1) == 1;
+    int region = (packedSlot && vtPackedRegion >= 0) || vtDiffuseRegion < 0 ? vtPackedRegion : vtDiffuseRegion;
+    if (region < 0)
+    {
+        FragColor = vec4(0.0);
+        return;
+    }
+
+    vec4 rect = vtRegions[region];
+    float scale = rect.z * (VT_VIRTUAL_PAGES * VT_PAGE_SIZE);
+    dx *= scale;
+    dy *= scale;
+    float lod = clamp(0.5 * log2(max(dot(dx, dx), dot(dy, dy))) + vtLodBias, 0.0, rect.w);
+    int mip = int(lod);
+
+    // fract() returns exactly 1.0 for tiny negative inputs, which would land in the neighbouring region
+    vec2 virtualUV = rect.xy + min(fract(TexCoords), vec2(0.99998)) * rect.z;
+    ivec2 page = ivec2(virtualUV * VT_VIRTUAL_PAGES) >> mip;
+    // r, g: page at the requested mip, b: mip, a: request marker
+    FragColor = vec4(vec3(page, mip) / 255.0, 1.0);
+}